@@ -1,25 +1,234 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "fs/fs.h"
 #include "tinydir/tinydir.h"
 #include "copy.h"
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#if defined(__GLIBC__) &&                                                      \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
+
+#ifdef __APPLE__
+#define st_atim st_atimespec
+#define st_mtim st_mtimespec
+#endif
+
 
-#define is_dot_file(file) 0 == strcmp(".", file.name) || 0 == strcmp("..", file.name)
+#define is_dot_file(file)                                                      \
+    0 == strcmp(".", file.name) || 0 == strcmp("..", file.name)
 #define check_err(x) if (0 != (err = x)) break;
 
+// the most the kernel copies in one call
+#define CHUNK_SIZE 0x40000000
 
+
+#ifdef _WIN32
+
+/**
+ * Copies `from` through a buffer, there are no directory fds and nothing
+ * to clone or copy files in the kernel with here
+ */
 int copy_file(char *from, char *to)
 {
-    char *content = fs_read(from);
-    if (!content) {
+    struct stat st;
+    FILE *file = NULL;
+    char *content = NULL;
+    int err = -1;
+
+    if (0 != stat(from, &st) || NULL == (file = fs_open(from, "rb"))) {
         return -1;
     }
-    fs_write(to, content);
+
+    content = fs_fnread(file, st.st_size);
+    fs_close(file);
+
+    if (NULL == content) {
+        return -1;
+    }
+
+    // `to` may be a hard link shared with other files, never write through it
+    unlink(to);
+
+    if (NULL != (file = fs_open(to, "wb"))) {
+        if (st.st_size == fs_fnwrite(file, content, st.st_size)) {
+            err = 0;
+        }
+
+        if (0 != fs_close(file)) {
+            err = -1;
+        }
+
+        if (0 == err && 0 != chmod(to, st.st_mode & 07777)) {
+            err = -1;
+        }
+
+        if (0 != err) {
+            unlink(to);
+        }
+    }
+
     free(content);
 
+    return err;
+}
+
+int copy_file_at(int from_dir, char *from, int to_dir, char *to)
+{
+    // only AT_FDCWD, the paths are taken as they are
+    (void) from_dir;
+    (void) to_dir;
+
+    return copy_file(from, to);
+}
+
+#else
+
+
+/**
+ * Copies what is left of `source` with plain reads and writes
+ */
+static int copy_buffered(int source, int target)
+{
+    char buffer[BUFSIZ * 8];
+    ssize_t n;
+
+    while (0 != (n = read(source, buffer, sizeof(buffer)))) {
+        char *p = buffer;
+
+        if (-1 == n) {
+            if (EINTR == errno) continue;
+            return -1;
+        }
+
+        while (n > 0) {
+            ssize_t written = write(target, p, n);
+
+            if (-1 == written) {
+                if (EINTR == errno) continue;
+                return -1;
+            }
+
+            p += written;
+            n -= written;
+        }
+    }
+
     return 0;
 }
 
+/**
+ * Shares the extents of `source` if the filesystem can, else copies them
+ * without a round-trip through userspace where the kernel allows it. Each
+ * step continues from the offsets the previous one left behind.
+ */
+static int copy_contents(int source, int target, off_t size)
+{
+    off_t copied = 0;
+
+#ifdef FICLONE
+    if (0 == ioctl(target, FICLONE, source)) {
+        return 0;
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while (copied < size) {
+        size_t chunk = size - copied < CHUNK_SIZE ? size - copied : CHUNK_SIZE;
+
+        ssize_t n = copy_file_range(source, NULL, target, NULL, chunk, 0);
+
+        if (-1 == n && EINTR == errno) continue;
+        // unsupported, e.g. across filesystems on older kernels
+        if (n <= 0) break;
+
+        copied += n;
+    }
+#endif
+
+#ifdef __linux__
+    while (copied < size) {
+        size_t chunk = size - copied < CHUNK_SIZE ? size - copied : CHUNK_SIZE;
+
+        ssize_t n = sendfile(target, source, NULL, chunk);
+
+        if (-1 == n && EINTR == errno) continue;
+        if (n <= 0) break;
+
+        copied += n;
+    }
+#endif
+
+    // picks up whatever the kernel did not copy, up to the real end of file
+    return copy_buffered(source, target);
+}
+
+int copy_file_at(int from_dir, char *from, int to_dir, char *to)
+{
+    struct stat st;
+    int source = -1;
+    int target = -1;
+    int err = -1;
+
+    if (-1 == (source = openat(from_dir, from, O_RDONLY))) {
+        return -1;
+    }
+
+    if (0 != fstat(source, &st)) {
+        goto cleanup;
+    }
+
+    // `to` may be a hard link shared with other files, never write through it
+    unlinkat(to_dir, to, 0);
+
+    target = openat(to_dir, to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (-1 == target) {
+        goto cleanup;
+    }
+
+    if (0 == copy_contents(source, target, st.st_size)) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+        if (0 == fchmod(target, st.st_mode & 07777)
+            && 0 == futimens(target, times)) {
+            err = 0;
+        }
+    }
+
+cleanup:
+    if (-1 != target && 0 != close(target)) {
+        err = -1;
+    }
+
+    if (-1 != target && 0 != err) {
+        unlinkat(to_dir, to, 0);
+    }
+
+    close(source);
+
+    return err;
+}
+
+int copy_file(char *from, char *to)
+{
+    return copy_file_at(AT_FDCWD, from, AT_FDCWD, to);
+}
+
+#endif
+
 static void check_dir(char *dir)
 {
     if (0 != fs_exists(dir)) {
@@ -43,9 +252,14 @@ static int copy(tinydir_file file, char *target_dir)
 int copy_dir(char *dir_path, char *target_dir)
 {
     int err = 0;
+    struct stat st;
     tinydir_dir dir;
     tinydir_file file;
-    tinydir_open(&dir, dir_path);
+
+    if (0 != stat(dir_path, &st) || 0 != tinydir_open(&dir, dir_path)) {
+        return -1;
+    }
+
     check_dir(target_dir);
 
     while (dir.has_next) {
@@ -61,5 +275,21 @@ int copy_dir(char *dir_path, char *target_dir)
     }
     tinydir_close(&dir);
 
+    // after the contents, which would change the modification time again
+    if (0 == err) {
+#ifdef _WIN32
+        if (0 != chmod(target_dir, st.st_mode & 07777)) {
+            err = -1;
+        }
+#else
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+        if (0 != chmod(target_dir, st.st_mode & 07777)
+            || 0 != utimensat(AT_FDCWD, target_dir, times, 0)) {
+            err = -1;
+        }
+#endif
+    }
+
     return err;
 }
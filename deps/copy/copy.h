@@ -1,9 +1,16 @@
 #ifndef COPY_DIR_H
 #define COPY_DIR_H
 
+#if defined(_WIN32) && !defined(AT_FDCWD)
+// there are no directory fds, paths are taken as they are
+#define AT_FDCWD -100
+#endif
 
 /**
- *  Copies one file
+ *  Copies one file, binary safe, keeping its permissions and modification
+ *  time. The file is cloned when the filesystem supports it, otherwise
+ *  copied by the kernel where possible. An existing "to_path" is replaced,
+ *  never written through.
  *
  *  @example copy_file("./dir/file.txt", "./target_dir/file.txt");
  *           "./target_dir/file.txt" will be created if it doesn't exist
@@ -13,7 +20,16 @@
 int copy_file(char *from_path, char *to_path);
 
 /**
- * Copies directory recursively to the given target
+ *  Like copy_file(), with each path relative to a directory fd, see openat(2).
+ *  On Windows both directories must be AT_FDCWD.
+ *
+ *  @return 0 on success, -1 otherwise
+ */
+int copy_file_at(int from_dir, char *from_path, int to_dir, char *to_path);
+
+/**
+ * Copies directory recursively to the given target, keeping permissions
+ * and modification times
  *
  * @example copy_dir("./dir/sub_dir", "./target_dir/sub_dir")
  *          "target_dir/sub_dir" will be created if it doesn't exist
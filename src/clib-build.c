@@ -5,7 +5,9 @@
 // MIT licensed
 //
 
+#include <ctype.h>
 #include <curl/curl.h>
+#include <dirent.h>
 #include <errno.h>
 #include <libgen.h>
 #include <limits.h>
@@ -13,6 +15,7 @@
 #include <string.h>
 
 #if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#include <sys/time.h>
 #include <unistd.h>
 #endif
 
@@ -28,7 +31,11 @@
 #endif
 
 #include "common/clib-cache.h"
+#include "common/clib-deps-index.h"
+#include "common/clib-jobserver.h"
 #include "common/clib-package.h"
+#include "common/clib-pool.h"
+#include "common/clib-sha256.h"
 
 #include <asprintf/asprintf.h>
 #include <commander/commander.h>
@@ -44,6 +51,7 @@
 #include "version.h"
 
 #define CLIB_PACKAGE_CACHE_TIME 30 * 24 * 60 * 60
+#define CLIB_BUILD_STATE_FILE ".clib-build-state"
 #define PROGRAM_NAME "clib-build"
 
 #define SX(s) #s
@@ -78,6 +86,7 @@ struct options {
   int global;
   char *clean;
   char *test;
+  int jobs;
 #ifdef HAVE_PTHREADS
   unsigned int concurrency;
 #endif
@@ -87,6 +96,7 @@ const char *manifest_names[] = {"clib.json", "package.json", 0};
 
 clib_package_opts_t package_opts = {0};
 clib_package_t *root_package = 0;
+char *cflags = 0; // as given, `CFLAGS` is overwritten for every package
 
 command_t program = {0};
 debug_t debugger = {0};
@@ -95,6 +105,7 @@ hash_t *built = 0;
 char **rest_argv = 0;
 int rest_offset = 0;
 int rest_argc = 0;
+int make_argc = 0; // leading `rest_argv` passed on to make
 
 options_t opts = {.skip_cache = 0,
                   .verbose = 1,
@@ -116,19 +127,55 @@ int build_package(const char *dir);
 
 #ifdef HAVE_PTHREADS
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-typedef struct clib_package_thread clib_package_thread_t;
-struct clib_package_thread {
-  const char *dir;
-};
+#endif
 
-void *build_package_with_manifest_name_thread(void *arg) {
-  clib_package_thread_t *wrap = arg;
-  const char *dir = wrap->dir;
-  build_package(dir);
-  return 0;
-}
+clib_pool_t *pool = 0;
+clib_jobserver_t *jobserver = 0;
+clib_deps_index_t *installed = 0;
+
+/**
+ * Read the manifest in the current directory, whose prefix applies to every
+ * package built. Called with the lock held.
+ */
+
+static void load_root_package(void) {
+  const char *name = NULL;
+  char *json = NULL;
+  unsigned int i = 0;
+
+#ifdef PATH_MAX
+  long path_max = PATH_MAX;
+#elif defined(_PC_PATH_MAX)
+  long path_max = pathconf(".", _PC_PATH_MAX);
+#else
+  long path_max = 4096;
 #endif
 
+  if (root_package) {
+    return;
+  }
+
+  do {
+    name = manifest_names[i];
+    json = fs_read(name);
+  } while (NULL != manifest_names[++i] && !json);
+
+  if (json) {
+    root_package = clib_package_new(json, opts.verbose);
+  }
+
+  if (root_package && root_package->prefix) {
+    char prefix[path_max];
+    memset(prefix, 0, path_max);
+    realpath(root_package->prefix, prefix);
+    unsigned long int size = strlen(prefix) + 1;
+    free(root_package->prefix);
+    root_package->prefix = malloc(size);
+    memset((void *)root_package->prefix, 0, size);
+    memcpy((void *)root_package->prefix, prefix, size);
+  }
+}
+
 int build_package_with_manifest_name(const char *dir, const char *file) {
   clib_package_t *package = 0;
   char *json = 0;
@@ -153,31 +200,7 @@ int build_package_with_manifest_name(const char *dir, const char *file) {
   pthread_mutex_lock(&mutex);
 #endif
 
-  if (!root_package) {
-    const char *name = NULL;
-    char *json = NULL;
-    unsigned int i = 0;
-
-    do {
-      name = manifest_names[i];
-      json = fs_read(name);
-    } while (NULL != manifest_names[++i] && !json);
-
-    if (json) {
-      root_package = clib_package_new(json, opts.verbose);
-    }
-
-    if (root_package && root_package->prefix) {
-      char prefix[path_max];
-      memset(prefix, 0, path_max);
-      realpath(root_package->prefix, prefix);
-      unsigned long int size = strlen(prefix) + 1;
-      free(root_package->prefix);
-      root_package->prefix = malloc(size);
-      memset((void *)root_package->prefix, 0, size);
-      memcpy((void *)root_package->prefix, prefix, size);
-    }
-  }
+  load_root_package();
 
   if (hash_has(built, path)) {
 #ifdef HAVE_PTHREADS
@@ -202,11 +225,10 @@ int build_package_with_manifest_name(const char *dir, const char *file) {
     package = clib_package_new(json, 0);
 #endif
   } else {
-#ifdef DEBUG
-    package = clib_package_new_from_slug(dir, 1);
-#else
-    package = clib_package_new_from_slug(dir, 0);
-#endif
+    // everything built is installed already, nothing is fetched
+    debug(&debugger, "no manifest: %s", path);
+    rc = -ENOENT;
+    goto cleanup;
   }
 
   if (0 == package) {
@@ -217,19 +239,13 @@ int build_package_with_manifest_name(const char *dir, const char *file) {
   if (0 != package->makefile) {
     char *makefile = path_join(dir, package->makefile);
     char *command = 0;
-    char *args = rest_argc > 0
-                     ? str_flatten((const char **)rest_argv, 0, rest_argc)
+    char *args = make_argc > 0
+                     ? str_flatten((const char **)rest_argv, 0, make_argc)
                      : "";
 
     char *clean = 0;
     char *flags = 0;
 
-#ifdef _GNU_SOURCE
-    char *cflags = secure_getenv("CFLAGS");
-#else
-    char *cflags = getenv("CFLAGS");
-#endif
-
     if (cflags) {
       asprintf(&flags, "%s -I %s", cflags, opts.dir);
     } else {
@@ -278,10 +294,17 @@ int build_package_with_manifest_name(const char *dir, const char *file) {
       logger_warn("build", "%s: %s", package->name, package->makefile);
     }
 
+    // every package holds a job slot while its make runs, which passes it
+    // on to the make jobs of its own files
+    int token = 0;
+    clib_jobserver_acquire(jobserver, &token);
+
     debug(&debugger, "system: %s", command);
     rc = system(command);
     free(command);
 
+    clib_jobserver_release(jobserver, token);
+
     if (clean) {
       free(clean);
     }
@@ -290,188 +313,606 @@ int build_package_with_manifest_name(const char *dir, const char *file) {
     free(make);
     free(flags);
 
-    if (rest_argc > 0) {
+    if (make_argc > 0) {
       free(args);
     }
 
     command = 0;
 #ifdef HAVE_PTHREADS
-    rc = pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&mutex);
 #endif
 
     hash_set(built, path, "t");
     ok = 1;
   } else {
 #ifdef HAVE_PTHREADS
-    rc = pthread_mutex_lock(&mutex);
+    pthread_mutex_lock(&mutex);
 #endif
 
     hash_set(built, path, "f");
     ok = 1;
   }
 
-  if (0 != rc) {
-    goto cleanup;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&mutex);
+#endif
+
+cleanup:
+  if (0 != package) {
+    clib_package_free(package);
+  }
+  if (0 != json) {
+    free(json);
+  }
+  if (0 == ok) {
+    if (0 != path) {
+      free(path);
+    }
+  }
+  return rc;
+}
+
+/**
+ * Read and parse the manifest of the package in `dir`, `file` or the first
+ * of `manifest_names` found if NULL. Nothing is fetched.
+ */
+
+static clib_package_t *load_manifest(const char *dir, const char *file) {
+  clib_package_t *package = 0;
+  const char *name = 0;
+  char *json = 0;
+
+  for (unsigned int i = 0; 0 == json && 0 != manifest_names[i]; ++i) {
+    name = file ? file : manifest_names[i];
+    char *path = path_join(dir, name);
+
+    if (path && 0 == fs_exists(path)) {
+      json = fs_read(path);
+    }
+
+    free(path);
+
+    if (file) {
+      break;
+    }
   }
 
+  if (json) {
+    if ((package = clib_package_new(json, 0))) {
+      package->filename = (char *)name;
+    }
+    free(json);
+  }
+
+  return package;
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+typedef struct build_graph build_graph_t;
+typedef struct build_node build_node_t;
+
+/**
+ * The packages reachable from the package being built, and what each one
+ * waits for before `make` can run.
+ */
+
+struct build_graph {
+  hash_t *nodes; // dir -> build_node_t
+  list_t *order; // nodes in discovery order
+  clib_pool_group_t group;
+  int failures;
+  int rc;
 #ifdef HAVE_PTHREADS
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_t mutex;
 #endif
+};
 
-  if (0 != package->dependencies) {
-    list_iterator_t *iterator = 0;
-    list_node_t *node = 0;
+struct build_node {
+  char *dir;
+  const char *file; // manifest to build with, 0 to try every name
+  char *name;
+  clib_package_t *package; // the local manifest, if any
+  int owns_package;        // rather than borrowing it from `installed`
+  list_t *dependencies;
+  list_t *dependents; // nodes that can only be built after this one
+  int unfinished;     // dependencies not built yet
+  int scheduled;
+  int installed; // lives in `opts.dir`, where its build state is kept
+  char fingerprint[CLIB_SHA256_HEX_SIZE];
+  double started;
+  double finished;
+  build_node_t *critical; // the dependency that finished last
+  build_graph_t *graph;
+};
 
+static inline void graph_lock(build_graph_t *graph) {
 #ifdef HAVE_PTHREADS
-    clib_package_thread_t wraps[opts.concurrency];
-    pthread_t threads[opts.concurrency];
-    unsigned int i = 0;
+  pthread_mutex_lock(&graph->mutex);
 #endif
+}
 
-    iterator = list_iterator_new(package->dependencies, LIST_HEAD);
+static inline void graph_unlock(build_graph_t *graph) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&graph->mutex);
+#endif
+}
 
-    while ((node = list_iterator_next(iterator))) {
-      clib_package_dependency_t *dep = node->val;
-      char *slug = 0;
-      char *dep_dir = 0;
-      asprintf(&slug, "%s/%s@%s", dep->author, dep->name, dep->version);
+static build_node_t *graph_node(build_graph_t *graph, char *dir,
+                                const char *file);
 
-      clib_package_t *dependency = clib_package_new_from_slug(slug, 0);
-      if (opts.dir && dependency && dependency->name) {
-        dep_dir = path_join(opts.dir, dependency->name);
-      }
+static int is_installed(const char *dir) {
+  size_t length = strlen(opts.dir);
+  return 0 == strncmp(dir, opts.dir, length) && '/' == dir[length];
+}
 
-      free(slug);
-      clib_package_free(dependency);
+/**
+ * Add the nodes of `dependencies`, declared by the manifest `file` of
+ * `node`. Every one of them must be installed already.
+ */
+
+static void add_dependencies(build_graph_t *graph, build_node_t *node,
+                             const char *file, list_t *dependencies) {
+  list_iterator_t *iterator = list_iterator_new(dependencies, LIST_HEAD);
+  list_node_t *item = 0;
+
+  while ((item = list_iterator_next(iterator))) {
+    clib_package_dependency_t *dep = item->val;
+    clib_deps_entry_t *entry = clib_deps_index_get_dependency(installed, dep);
+    build_node_t *dependency = 0;
+    char *dir = 0;
+
+    if (0 == entry) {
+      char *path = path_join(node->dir, file);
+      logger_error("error", "%s/%s is not installed, required by %s",
+                   dep->author, dep->name, path ? path : node->dir);
+      graph->failures++;
+      free(path);
+      continue;
+    }
 
-      if (0 == dep_dir) {
-        rc = -ENOMEM;
-        goto cleanup;
-      }
+    if (0 == (dir = strdup(entry->dir))) {
+      continue;
+    }
 
-#ifdef HAVE_PTHREADS
-      clib_package_thread_t *wrap = &wraps[i];
-      pthread_t *thread = &threads[i];
-      wrap->dir = dep_dir;
-      rc = pthread_create(thread, 0, build_package_with_manifest_name_thread,
-                          wrap);
-
-      if (++i >= opts.concurrency) {
-        for (int j = 0; j < i; ++j) {
-          pthread_join(threads[j], 0);
-          free((void *)wraps[j].dir);
-        }
+    if ((dependency = graph_node(graph, dir, 0)) && dependency != node) {
+      list_rpush(dependency->dependents, list_node_new(node));
+      list_rpush(node->dependencies, list_node_new(dependency));
+      node->unfinished++;
+    }
+  }
 
-        i = 0;
-      }
-#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-      usleep(1024 * 10);
-#endif
-#else
-      rc = build_package(dep_dir);
+  list_iterator_destroy(iterator);
+}
 
-      free((void *)dep_dir);
+/**
+ * Get the node of the package in `dir`, discovering its dependencies from
+ * the index of installed packages if it was not seen before. Takes `dir`.
+ */
 
-      if (0 != rc) {
-        goto cleanup;
-      }
-#endif
+static build_node_t *graph_node(build_graph_t *graph, char *dir,
+                                const char *file) {
+  build_node_t *node = hash_get(graph->nodes, dir);
+  clib_package_t *package = 0;
+  const char *manifest = file;
+
+  if (node) {
+    free(dir);
+    return node;
+  }
+
+  if (0 == (node = malloc(sizeof(build_node_t)))) {
+    free(dir);
+    return 0;
+  }
+
+  memset(node, 0, sizeof(build_node_t));
+  node->dir = dir;
+  node->file = file;
+  node->graph = graph;
+  node->dependencies = list_new();
+  node->dependents = list_new();
+  node->installed = is_installed(dir);
+
+  hash_set(graph->nodes, node->dir, node);
+  list_rpush(graph->order, list_node_new(node));
+
+  if (node->installed && 0 == file) {
+    clib_deps_entry_t *entry =
+        clib_deps_index_get(installed, dir + strlen(opts.dir) + 1);
+
+    if (entry && 0 == strcmp(entry->dir, dir)) {
+      package = entry->package;
+      manifest = entry->file;
     }
+  }
 
-#ifdef HAVE_PTHREADS
-    for (int j = 0; j < i; ++j) {
-      pthread_join(threads[j], 0);
-      free((void *)wraps[j].dir);
+  if (0 == package && (package = load_manifest(dir, file))) {
+    node->owns_package = 1;
+    manifest = package->filename;
+  }
+
+  if (package) {
+    node->package = package;
+
+    if (package->name) {
+      node->name = strdup(package->name);
     }
-#endif
 
-    if (0 != iterator) {
-      list_iterator_destroy(iterator);
+    if (package->dependencies) {
+      add_dependencies(graph, node, manifest, package->dependencies);
+    }
+
+    if (opts.dev && package->development) {
+      add_dependencies(graph, node, manifest, package->development);
     }
   }
 
-  if (opts.dev && 0 != package->development) {
-    list_iterator_t *iterator = 0;
-    list_node_t *node = 0;
+  if (0 == node->name) {
+    node->name = strdup(basename(dir));
+  }
 
-#ifdef HAVE_PTHREADS
-    clib_package_thread_t wraps[opts.concurrency];
-    pthread_t threads[opts.concurrency];
-    unsigned int i = 0;
-#endif
+  return node;
+}
 
-    iterator = list_iterator_new(package->development, LIST_HEAD);
+static void hash_string(clib_sha256_t *ctx, const char *string) {
+  if (string) {
+    clib_sha256_update(ctx, string, strlen(string));
+  }
 
-    while ((node = list_iterator_next(iterator))) {
-      clib_package_dependency_t *dep = node->val;
-      char *slug = 0;
-      asprintf(&slug, "%s/%s@%s", dep->author, dep->name, dep->version);
+  // keeps neighbouring fields apart
+  clib_sha256_update(ctx, "", 1);
+}
 
-      clib_package_t *dependency = clib_package_new_from_slug(slug, 0);
-      char *dep_dir = path_join(opts.dir, dependency->name);
+static void hash_file(clib_sha256_t *ctx, const char *dir, const char *file) {
+  char *path = path_join(dir, basename((char *)file));
 
-      free(slug);
-      clib_package_free(dependency);
+  hash_string(ctx, file);
 
-#ifdef HAVE_PTHREADS
-      clib_package_thread_t *wrap = &wraps[i];
-      pthread_t *thread = &threads[i];
-      wrap->dir = dep_dir;
-      rc = pthread_create(thread, 0, build_package_with_manifest_name_thread,
-                          wrap);
-
-      if (++i >= opts.concurrency) {
-        for (int j = 0; j < i; ++j) {
-          pthread_join(threads[j], 0);
-          free((void *)wraps[j].dir);
-        }
+  if (0 == path || 0 != clib_sha256_update_file(ctx, path)) {
+    hash_string(ctx, "(missing)");
+  }
 
-        i = 0;
-      }
-#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-      usleep(1024 * 10);
-#endif
-#else
-      if (0 == dep_dir) {
-        rc = -ENOMEM;
-        goto cleanup;
-      }
+  free(path);
+}
 
-      rc = build_package(dep_dir);
+/**
+ * Compute what the build of `node` depends on: its manifest, makefile and
+ * sources, the flags and prefix it is built with and the fingerprints of
+ * its dependencies, which are all built by now.
+ */
 
-      free((void *)dep_dir);
+static void fingerprint_node(build_node_t *node) {
+  clib_package_t *package = node->package;
+  list_iterator_t *iterator = 0;
+  list_node_t *item = 0;
+  const char *prefix = package->prefix;
+  clib_sha256_t ctx;
 
-      if (0 != rc) {
-        goto cleanup;
+  if (opts.prefix) {
+    prefix = opts.prefix;
+  } else if (root_package && root_package->prefix) {
+    prefix = root_package->prefix;
+  }
+
+  clib_sha256_init(&ctx);
+  hash_string(&ctx, CLIB_VERSION);
+  hash_string(&ctx, package->json);
+  hash_string(&ctx, cflags);
+  hash_string(&ctx, opts.dir);
+  hash_string(&ctx, prefix);
+
+  for (int i = 0; i < make_argc; i++) {
+    hash_string(&ctx, rest_argv[i]);
+  }
+
+  if (package->makefile) {
+    hash_file(&ctx, node->dir, package->makefile);
+  }
+
+  if (package->src) {
+    iterator = list_iterator_new(package->src, LIST_HEAD);
+    while ((item = list_iterator_next(iterator))) {
+      hash_file(&ctx, node->dir, item->val);
+    }
+    list_iterator_destroy(iterator);
+  }
+
+  iterator = list_iterator_new(node->dependencies, LIST_HEAD);
+  while ((item = list_iterator_next(iterator))) {
+    build_node_t *dependency = item->val;
+    hash_string(&ctx, dependency->fingerprint);
+  }
+  list_iterator_destroy(iterator);
+
+  clib_sha256_final_hex(&ctx, node->fingerprint);
+}
+
+/**
+ * @return 1 if `node` was built before with the same fingerprint
+ */
+
+static int is_up_to_date(build_node_t *node) {
+  char *path = 0;
+  char *state = 0;
+  int fresh = 0;
+
+  if (!node->installed || opts.force || opts.clean || opts.test) {
+    return 0;
+  }
+
+  if ((path = path_join(node->dir, CLIB_BUILD_STATE_FILE)) &&
+      0 == fs_exists(path) && (state = fs_read(path))) {
+    fresh = 0 == strcmp(trim(state), node->fingerprint);
+  }
+
+  free(state);
+  free(path);
+  return fresh;
+}
+
+static void save_build_state(build_node_t *node) {
+  char *path = path_join(node->dir, CLIB_BUILD_STATE_FILE);
+
+  if (path && -1 == fs_write(path, node->fingerprint)) {
+    debug(&debugger, "failed to write %s", path);
+  }
+
+  free(path);
+}
+
+static void build_node_task(void *);
+
+/**
+ * Queue `node` on the pool. Called with the graph locked.
+ */
+
+static void schedule_node(build_node_t *node) {
+  node->scheduled = 1;
+
+  if (0 != clib_pool_submit(pool, &node->graph->group, build_node_task, node)) {
+    node->graph->failures++;
+    node->graph->rc = -ENOMEM;
+  }
+}
+
+/**
+ * Build `node`, then schedule the dependents it was the last unfinished
+ * dependency of. Dependents of a failed build are never built.
+ */
+
+static void build_node_task(void *data) {
+  build_node_t *node = data;
+  build_graph_t *graph = node->graph;
+  list_iterator_t *iterator = 0;
+  list_node_t *item = 0;
+  int rc = 0;
+
+  node->started = now();
+
+  if (node->package) {
+    fingerprint_node(node);
+  }
+
+  // without a makefile there is nothing worth skipping
+  if (node->package && node->package->makefile && is_up_to_date(node)) {
+    debug(&debugger, "up to date: %s", node->name);
+
+    if (0 != opts.verbose) {
+      logger_info("fresh", "%s", node->name);
+    }
+  } else {
+    rc = node->file ? build_package_with_manifest_name(node->dir, node->file)
+                    : build_package(node->dir);
+
+    if (0 == rc && node->installed && node->package &&
+        node->package->makefile && !opts.test) {
+      save_build_state(node);
+    }
+  }
+
+  node->finished = now();
+
+  graph_lock(graph);
+
+  if (0 != rc) {
+    if (0 == graph->failures++) {
+      graph->rc = rc;
+    }
+
+    logger_error("error", "failed to build %s", node->name);
+    goto done;
+  }
+
+  iterator = list_iterator_new(node->dependents, LIST_HEAD);
+  while ((item = list_iterator_next(iterator))) {
+    build_node_t *dependent = item->val;
+
+    if (0 == dependent->critical ||
+        dependent->critical->finished < node->finished) {
+      dependent->critical = node;
+    }
+
+    if (0 == --dependent->unfinished && !dependent->scheduled) {
+      schedule_node(dependent);
+    }
+  }
+  list_iterator_destroy(iterator);
+
+done:
+  graph_unlock(graph);
+}
+
+/**
+ * Print the chain of builds that determined the total build time.
+ */
+
+static void print_critical_path(build_graph_t *graph) {
+  list_iterator_t *iterator = list_iterator_new(graph->order, LIST_HEAD);
+  list_node_t *item = 0;
+  build_node_t *last = 0;
+  build_node_t *first = 0;
+  char *path = 0;
+
+  while ((item = list_iterator_next(iterator))) {
+    build_node_t *node = item->val;
+    if (node->finished > 0 && (0 == last || node->finished > last->finished)) {
+      last = node;
+    }
+  }
+  list_iterator_destroy(iterator);
+
+  if (0 == last) {
+    return;
+  }
+
+  for (build_node_t *node = last; node; node = node->critical) {
+    char *step = 0;
+
+    asprintf(&step, "%s (%.2fs)%s%s", node->name,
+             node->finished - node->started, path ? " -> " : "",
+             path ? path : "");
+
+    free(path);
+    path = step;
+    first = node;
+  }
+
+  if (path) {
+    logger_info("critical path", "%s, %.2fs", path,
+                last->finished - first->started);
+    free(path);
+  }
+}
+
+static void build_graph_free(build_graph_t *graph) {
+  list_node_t *item = 0;
+
+  if (graph->order) {
+    while ((item = list_lpop(graph->order))) {
+      build_node_t *node = item->val;
+      list_destroy(node->dependencies);
+      list_destroy(node->dependents);
+      if (node->owns_package) {
+        clib_package_free(node->package);
       }
-#endif
+
+      free(node->name);
+      free(node->dir);
+      free(node);
+      free(item);
     }
 
+    list_destroy(graph->order);
+  }
+
+  if (graph->nodes) {
+    hash_free(graph->nodes);
+  }
+
 #ifdef HAVE_PTHREADS
-    for (int j = 0; j < i; ++j) {
-      pthread_join(threads[j], 0);
-      free((void *)wraps[j].dir);
-    }
+  pthread_mutex_destroy(&graph->mutex);
 #endif
+}
 
-    if (0 != iterator) {
-      list_iterator_destroy(iterator);
-    }
+/**
+ * Build the package in `dir` and all of its installed dependencies in
+ * dependency order. Independent packages are built in parallel and each
+ * package starts as soon as its last dependency is built.
+ *
+ * @return 0 on success, a negative error otherwise
+ */
+
+int build_tree(const char *dir, const char *file) {
+  build_graph_t graph;
+  list_iterator_t *iterator = 0;
+  list_node_t *item = 0;
+  char *root = strdup(dir);
+
+  memset(&graph, 0, sizeof(build_graph_t));
+  clib_pool_group_init(&graph.group);
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&graph.mutex, 0);
+#endif
+
+  if (0 == root || 0 == (graph.nodes = hash_new()) ||
+      0 == (graph.order = list_new())) {
+    free(root);
+    graph.rc = -ENOMEM;
+    goto cleanup;
   }
 
-cleanup:
-  if (0 != package) {
-    clib_package_free(package);
+  // the prefix is part of every fingerprint
+  load_root_package();
+
+  if (0 == graph_node(&graph, root, file)) {
+    graph.rc = -ENOMEM;
+    goto cleanup;
   }
-  if (0 != json) {
-    free(json);
+
+  // nothing is built while a dependency is missing
+  if (0 != graph.failures) {
+    goto cleanup;
   }
-  if (0 == ok) {
-    if (0 != path) {
-      free(path);
+
+  while (1) {
+    build_node_t *blocked = 0;
+
+    graph_lock(&graph);
+    iterator = list_iterator_new(graph.order, LIST_HEAD);
+    while ((item = list_iterator_next(iterator))) {
+      build_node_t *node = item->val;
+      if (!node->scheduled && 0 == node->unfinished) {
+        schedule_node(node);
+      }
+    }
+    list_iterator_destroy(iterator);
+    graph_unlock(&graph);
+
+    clib_pool_group_wait(pool, &graph.group);
+
+    if (0 != graph.failures) {
+      break;
+    }
+
+    // anything left is part of a dependency cycle, which is broken by
+    // building its first package found regardless
+    iterator = list_iterator_new(graph.order, LIST_HEAD);
+    while ((item = list_iterator_next(iterator))) {
+      build_node_t *node = item->val;
+      if (!node->scheduled) {
+        blocked = node;
+        break;
+      }
     }
+    list_iterator_destroy(iterator);
+
+    if (0 == blocked) {
+      break;
+    }
+
+    debug(&debugger, "dependency cycle at %s", blocked->name);
+    blocked->unfinished = 0;
   }
-  return rc;
+
+  if (0 != opts.verbose && 0 == graph.failures) {
+    print_critical_path(&graph);
+  }
+
+cleanup:
+  build_graph_free(&graph);
+
+  // the status of a failed `system()` is no exit code, 512 would exit 0
+  if (0 != graph.failures && graph.rc >= 0) {
+    graph.rc = -1;
+  }
+
+  return graph.rc;
 }
 
 int build_package(const char *dir) {
@@ -546,6 +987,56 @@ static void setopt_quiet(command_t *self) {
   debug(&debugger, "set quiet flag");
 }
 
+static void setopt_jobs(command_t *self) {
+  if (self->arg) {
+    opts.jobs = atoi(self->arg);
+    debug(&debugger, "set jobs: %d", opts.jobs);
+  }
+}
+
+/**
+ * Take `-j` out of the arguments passed on to make, as a make given its own
+ * job count leaves the jobserver. Its value becomes the job budget unless
+ * `--jobs` was given. Note that commander splits `-j4` into `-j -4`.
+ */
+
+static void take_make_jobs(void) {
+  int j = 0;
+
+  for (int i = 0; i < rest_argc; i++) {
+    char *arg = rest_argv[i];
+    const char *value = 0;
+
+    if (0 == strncmp(arg, "-j", 2)) {
+      value = arg + 2;
+    } else if (0 == strncmp(arg, "--jobs", 6) &&
+               ('\0' == arg[6] || '=' == arg[6])) {
+      value = '=' == arg[6] ? arg + 7 : arg + 6;
+    } else {
+      rest_argv[j++] = arg;
+      continue;
+    }
+
+    if ('\0' == *value && i + 1 < rest_argc) {
+      const char *next = rest_argv[i + 1];
+
+      if (isdigit((unsigned char)next[0])) {
+        value = rest_argv[++i];
+      } else if ('-' == next[0] && isdigit((unsigned char)next[1])) {
+        value = rest_argv[++i] + 1;
+      }
+    }
+
+    if (0 == opts.jobs && isdigit((unsigned char)*value)) {
+      opts.jobs = atoi(value);
+    }
+
+    debug(&debugger, "took make jobs: %s", arg);
+  }
+
+  make_argc = j;
+}
+
 #ifdef HAVE_PTHREADS
 static void setopt_concurrency(command_t *self) {
   if (self->arg) {
@@ -556,6 +1047,7 @@ static void setopt_concurrency(command_t *self) {
 #endif
 
 int main(int argc, char **argv) {
+  int failed = 0;
   int rc = 0;
 
 #ifdef PATH_MAX
@@ -574,6 +1066,16 @@ int main(int argc, char **argv) {
     return -errno;
   }
 
+#ifdef _GNU_SOURCE
+  cflags = secure_getenv("CFLAGS");
+#else
+  cflags = getenv("CFLAGS");
+#endif
+
+  if (cflags) {
+    cflags = strdup(cflags);
+  }
+
   built = hash_new();
   hash_set(built, strdup("__" PROGRAM_NAME "__"), CLIB_VERSION);
 
@@ -616,6 +1118,11 @@ int main(int argc, char **argv) {
   command_option(&program, "-c", "--skip-cache", "skip cache when configuring",
                  setopt_skip_cache);
 
+  command_option(&program, "-J", "--jobs <number>",
+                 "share <number> make jobs between all packages (default: "
+                 "number of CPUs)",
+                 setopt_jobs);
+
 #ifdef HAVE_PTHREADS
   command_option(&program, "-C", "--concurrency <number>",
                  "Set concurrency (default: " S(MAX_THREADS) ")",
@@ -669,6 +1176,20 @@ int main(int argc, char **argv) {
     do {
       rest_argv[j++] = program.nargv[i++];
     } while (program.nargv[i]);
+
+    take_make_jobs();
+  }
+
+#ifdef _SC_NPROCESSORS_ONLN
+  if (0 == opts.jobs) {
+    opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+#endif
+
+  jobserver = clib_jobserver_new(opts.jobs);
+
+  if (0 == jobserver || 0 != clib_jobserver_export(jobserver)) {
+    logger_warn("warning", "Failed to start the make jobserver");
   }
 
   if (0 != curl_global_init(CURL_GLOBAL_ALL)) {
@@ -685,11 +1206,30 @@ int main(int argc, char **argv) {
 
   clib_package_set_opts(package_opts);
 
-  if (0 == program.argc || (argc == rest_offset + rest_argc)) {
-    rc = build_package(CWD);
+#ifdef HAVE_PTHREADS
+  pool = clib_pool_new(opts.concurrency);
+#else
+  pool = clib_pool_new(1);
+#endif
+
+  if (0 == pool) {
+    logger_error("error", "Failed to start the worker pool");
+    return 1;
+  }
+
+  installed = clib_deps_index_new(opts.dir);
+
+  if (0 == installed) {
+    logger_error("error", "Failed to read the installed packages");
+    return 1;
+  }
+
+  // arguments after `--` come last and are not packages
+  if (program.argc == rest_argc) {
+    rc = build_tree(CWD, 0);
   } else {
-    for (int i = 1; i <= rest_offset; ++i) {
-      char *dep = program.nargv[i];
+    for (int i = 0; i < program.argc - rest_argc; ++i) {
+      char *dep = program.argv[i];
 
       if ('.' == dep[0]) {
         char dir[path_max];
@@ -712,13 +1252,18 @@ int main(int argc, char **argv) {
 #endif
                         )) {
         dep = basename(dep);
-        rc = build_package_with_manifest_name(dirname(dep), basename(dep));
+        rc = build_tree(dirname(dep), basename(dep));
       } else {
-        rc = build_package(dep);
+        rc = build_tree(dep, 0);
 
         // try with slug
         if (0 != rc) {
-          rc = build_package(program.nargv[i]);
+          clib_deps_entry_t *entry =
+              clib_deps_index_get(installed, program.argv[i]);
+
+          if (entry) {
+            rc = build_tree(entry->dir, entry->file);
+          }
         }
       }
 
@@ -726,7 +1271,13 @@ int main(int argc, char **argv) {
         free(stats);
         stats = 0;
       }
+
+      if (0 != rc) {
+        failed = rc;
+      }
     }
+
+    rc = failed;
   }
 
   int total_built = 0;
@@ -739,6 +1290,9 @@ int main(int argc, char **argv) {
     }
   });
 
+  clib_pool_free(pool);
+  clib_jobserver_free(jobserver);
+  clib_deps_index_free(installed);
   hash_free(built);
   command_free(&program);
   curl_global_cleanup();
@@ -752,6 +1306,8 @@ int main(int argc, char **argv) {
     free(opts.prefix);
   }
 
+  free(cflags);
+
   if (rest_argc > 0) {
     free(rest_argv);
     rest_offset = 0;
@@ -788,5 +1344,5 @@ int main(int argc, char **argv) {
     }
   }
 
-  return rc;
+  return 0 == rc ? 0 : 1;
 }
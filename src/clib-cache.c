@@ -0,0 +1,150 @@
+//
+// clib-cache.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#include "commander/commander.h"
+#include "common/clib-cache.h"
+#include "common/clib-pool.h"
+#include "debug/debug.h"
+#include "logger/logger.h"
+#include "version.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CLIB_PACKAGE_CACHE_TIME 30 * 24 * 60 * 60
+
+// workers removing the evicted packages
+#define CLIB_CACHE_THREADS 4
+
+debug_t debugger;
+
+struct options {
+  clib_cache_limits_t limits;
+  int verbose;
+  int invalid;
+};
+
+static struct options opts;
+
+/**
+ * Option setters.
+ */
+
+static void setopt_max_size(command_t *self) {
+  if (0 != clib_cache_parse_size(self->arg, &opts.limits.max_size)) {
+    logger_error("error", "Invalid size: %s", self->arg);
+    opts.invalid = 1;
+  }
+
+  debug(&debugger, "set max size: %s", self->arg);
+}
+
+static void setopt_max_entries(command_t *self) {
+  opts.limits.max_entries = atol(self->arg);
+  debug(&debugger, "set max entries: %ld", opts.limits.max_entries);
+}
+
+static void setopt_quiet(command_t *self) {
+  opts.verbose = 0;
+  debug(&debugger, "set quiet flag");
+}
+
+/**
+ * Format `bytes` for humans, e.g. "1.5 MB".
+ */
+
+static void format_size(char *buffer, size_t length, int64_t bytes) {
+  const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  double size = (double)bytes;
+  int unit = 0;
+
+  while (size >= 1024 && unit < 4) {
+    size /= 1024;
+    unit++;
+  }
+
+  snprintf(buffer, length, 0 == unit ? "%.0f %s" : "%.1f %s", size,
+           units[unit]);
+}
+
+/**
+ * Entry point.
+ */
+
+int main(int argc, char *argv[]) {
+  clib_cache_gc_stats_t stats;
+  clib_pool_t *pool = NULL;
+  command_t program;
+  char reclaimed[32];
+  char size[32];
+  int rc = 1;
+
+  debug_init(&debugger, "clib-cache");
+
+  // 30 days expiration, like installs
+  if (0 != clib_cache_init(CLIB_PACKAGE_CACHE_TIME)) {
+    logger_error("error", "Failed to initialize the cache");
+    return 1;
+  }
+
+  opts.limits = clib_cache_limits();
+  opts.verbose = 1;
+
+  command_init(&program, "clib-cache", CLIB_VERSION);
+
+  program.usage = "[options] gc";
+
+  command_option(&program, "-s", "--max-size <size>",
+                 "evict packages down to size, e.g. 512M (default: 1G)",
+                 setopt_max_size);
+  command_option(&program, "-n", "--max-entries <number>",
+                 "evict packages down to number (default: 4096)",
+                 setopt_max_entries);
+  command_option(&program, "-q", "--quiet", "disable verbose output",
+                 setopt_quiet);
+  command_parse(&program, argc, argv);
+
+  debug(&debugger, "%d arguments", program.argc);
+
+  if (opts.invalid) {
+    goto cleanup;
+  }
+
+  if (1 != program.argc || 0 != strcmp("gc", program.argv[0])) {
+    command_help(&program);
+  }
+
+  clib_cache_set_limits(opts.limits);
+
+  pool = clib_pool_new(CLIB_CACHE_THREADS);
+  clib_cache_set_pool(pool);
+
+  if (0 != clib_cache_gc(&stats)) {
+    logger_error("error", "Failed to read the cache index");
+    goto cleanup;
+  }
+
+  if (opts.verbose) {
+    format_size(reclaimed, sizeof(reclaimed), stats.reclaimed);
+    format_size(size, sizeof(size), stats.size);
+    logger_info("reclaimed", "%s (%lld bytes), %ld entries evicted", reclaimed,
+                (long long)stats.reclaimed, stats.evicted);
+    logger_info("cache", "%ld entries, %s", stats.entries, size);
+  }
+
+  rc = 0;
+
+cleanup:
+  clib_cache_set_pool(NULL);
+
+  if (pool) {
+    clib_pool_free(pool);
+  }
+
+  command_free(&program);
+  return rc;
+}
@@ -28,7 +28,9 @@
 #endif
 
 #include "common/clib-cache.h"
+#include "common/clib-deps-index.h"
 #include "common/clib-package.h"
+#include "common/clib-pool.h"
 
 #include <asprintf/asprintf.h>
 #include <commander/commander.h>
@@ -107,18 +109,92 @@ int configure_package(const char *dir);
 
 #ifdef HAVE_PTHREADS
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-typedef struct clib_package_thread clib_package_thread_t;
-struct clib_package_thread {
-  const char *dir;
+#endif
+
+clib_pool_t *pool = 0;
+clib_deps_index_t *installed = 0;
+
+typedef struct configure_task configure_task_t;
+struct configure_task {
+  char *dir;
+  int rc;
 };
 
-void *configure_package_with_manifest_name_thread(void *arg) {
-  clib_package_thread_t *wrap = arg;
-  const char *dir = wrap->dir;
-  configure_package(dir);
-  return 0;
+static void configure_dependency_task(void *data) {
+  configure_task_t *task = data;
+  task->rc = configure_package(task->dir);
+}
+
+/**
+ * Configure `dependencies` of the manifest at `path` on the worker pool.
+ * Waiting for them runs other tasks meanwhile, so recursive calls never
+ * tie up a worker.
+ */
+
+int configure_dependencies(const char *path, list_t *dependencies) {
+  clib_pool_group_t group;
+  configure_task_t *tasks = 0;
+  list_iterator_t *iterator = 0;
+  list_node_t *node = 0;
+  unsigned int n = 0;
+  int rc = 0;
+
+  if (0 == dependencies->len) {
+    return 0;
+  }
+
+  tasks = malloc(dependencies->len * sizeof(configure_task_t));
+
+  if (0 == tasks) {
+    return -ENOMEM;
+  }
+
+  clib_pool_group_init(&group);
+  iterator = list_iterator_new(dependencies, LIST_HEAD);
+
+  while ((node = list_iterator_next(iterator))) {
+    clib_package_dependency_t *dep = node->val;
+    clib_deps_entry_t *entry = clib_deps_index_get_dependency(installed, dep);
+    char *dep_dir = 0;
+
+    if (0 == entry) {
+      logger_warn("warning", "%s/%s is not installed, required by %s",
+                  dep->author, dep->name, path);
+      continue;
+    }
+
+    if (0 == (dep_dir = strdup(entry->dir))) {
+      rc = -ENOMEM;
+      break;
+    }
+
+    tasks[n].dir = dep_dir;
+    tasks[n].rc = 0;
+
+    if (0 != clib_pool_submit(pool, &group, configure_dependency_task,
+                              &tasks[n])) {
+      free(dep_dir);
+      rc = -ENOMEM;
+      break;
+    }
+
+    n++;
+  }
+
+  list_iterator_destroy(iterator);
+  clib_pool_group_wait(pool, &group);
+
+  for (unsigned int i = 0; i < n; ++i) {
+    if (0 == rc) {
+      rc = tasks[i].rc;
+    }
+
+    free(tasks[i].dir);
+  }
+
+  free(tasks);
+  return rc;
 }
-#endif
 
 int configure_package_with_manifest_name(const char *dir, const char *file) {
   clib_package_t *package = 0;
@@ -182,6 +258,7 @@ int configure_package_with_manifest_name(const char *dir, const char *file) {
 
   // Free the json if it was allocated before attempting to modify it
   free(json);
+  json = NULL;
 
   if (0 == fs_exists(path)) {
     debug(&debugger, "read %s", path);
@@ -195,11 +272,10 @@ int configure_package_with_manifest_name(const char *dir, const char *file) {
     package = clib_package_new(json, 0);
 #endif
   } else {
-#ifdef DEBUG
-    package = clib_package_new_from_slug(dir, 1);
-#else
-    package = clib_package_new_from_slug(dir, 0);
-#endif
+    // everything configured is installed already, nothing is fetched
+    debug(&debugger, "no manifest: %s", path);
+    rc = -ENOENT;
+    goto cleanup;
   }
 
   if (0 == package) {
@@ -278,145 +354,15 @@ int configure_package_with_manifest_name(const char *dir, const char *file) {
 #endif
 
   if (0 != package->dependencies) {
-    list_iterator_t *iterator = 0;
-    list_node_t *node = 0;
-
-#ifdef HAVE_PTHREADS
-    clib_package_thread_t wraps[opts.concurrency];
-    pthread_t threads[opts.concurrency];
-    unsigned int i = 0;
-#endif
-
-    iterator = list_iterator_new(package->dependencies, LIST_HEAD);
-
-    while ((node = list_iterator_next(iterator))) {
-      clib_package_dependency_t *dep = node->val;
-      char *slug = 0;
-      asprintf(&slug, "%s/%s@%s", dep->author, dep->name, dep->version);
-
-      clib_package_t *dependency = clib_package_new_from_slug(slug, 0);
-      char *dep_dir = path_join(opts.dir, dependency->name);
-
-      free(slug);
-      clib_package_free(dependency);
-
-#ifdef HAVE_PTHREADS
-      clib_package_thread_t *wrap = &wraps[i];
-      pthread_t *thread = &threads[i];
-      wrap->dir = dep_dir;
-      rc = pthread_create(thread, 0,
-                          configure_package_with_manifest_name_thread, wrap);
-
-      if (++i >= opts.concurrency) {
-        for (int j = 0; j < i; ++j) {
-          pthread_join(threads[j], 0);
-          free((void *)wraps[j].dir);
-        }
-
-        i = 0;
-      }
-#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-      if (!opts.flags) {
-        usleep(1024 * 10);
-      }
-#endif
-#else
-      if (0 == dep_dir) {
-        rc = -ENOMEM;
-        goto cleanup;
-      }
-
-      rc = configure_package(dep_dir);
-
-      free((void *)dep_dir);
-
-      if (0 != rc) {
-        goto cleanup;
-      }
-#endif
-    }
+    rc = configure_dependencies(path, package->dependencies);
 
-#ifdef HAVE_PTHREADS
-    for (int j = 0; j < i; ++j) {
-      pthread_join(threads[j], 0);
-      free((void *)wraps[j].dir);
-    }
-#endif
-
-    if (0 != iterator) {
-      list_iterator_destroy(iterator);
+    if (0 != rc) {
+      goto cleanup;
     }
   }
 
   if (opts.dev && 0 != package->development) {
-    list_iterator_t *iterator = 0;
-    list_node_t *node = 0;
-
-#ifdef HAVE_PTHREADS
-    clib_package_thread_t wraps[opts.concurrency];
-    pthread_t threads[opts.concurrency];
-    unsigned int i = 0;
-#endif
-
-    iterator = list_iterator_new(package->development, LIST_HEAD);
-
-    while ((node = list_iterator_next(iterator))) {
-      clib_package_dependency_t *dep = node->val;
-      char *slug = 0;
-      asprintf(&slug, "%s/%s@%s", dep->author, dep->name, dep->version);
-
-      clib_package_t *dependency = clib_package_new_from_slug(slug, 0);
-      char *dep_dir = path_join(opts.dir, dependency->name);
-
-      free(slug);
-      clib_package_free(dependency);
-
-#ifdef HAVE_PTHREADS
-      clib_package_thread_t *wrap = &wraps[i];
-      pthread_t *thread = &threads[i];
-      wrap->dir = dep_dir;
-      rc = pthread_create(thread, 0,
-                          configure_package_with_manifest_name_thread, wrap);
-
-      if (++i >= opts.concurrency) {
-        for (int j = 0; j < i; ++j) {
-          pthread_join(threads[j], 0);
-          free((void *)wraps[j].dir);
-        }
-
-        i = 0;
-      }
-#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-      if (!opts.flags) {
-        usleep(1024 * 10);
-      }
-#endif
-#else
-      if (0 == dep_dir) {
-        rc = -ENOMEM;
-        goto cleanup;
-      }
-
-      rc = configure_package(dep_dir);
-
-      free((void *)dep_dir);
-
-      if (0 != rc) {
-        goto cleanup;
-      }
-#endif
-    }
-
-#ifdef HAVE_PTHREADS
-    for (int j = 0; j < i; ++j) {
-      pthread_join(threads[j], 0);
-      free((void *)wraps[j].dir);
-    }
-#endif
-
-    if (0 != iterator) {
-      list_iterator_destroy(iterator);
-    }
+    rc = configure_dependencies(path, package->development);
   }
 
 cleanup:
@@ -616,6 +562,24 @@ int main(int argc, char **argv) {
 
   clib_package_set_opts(package_opts);
 
+#ifdef HAVE_PTHREADS
+  pool = clib_pool_new(opts.concurrency);
+#else
+  pool = clib_pool_new(1);
+#endif
+
+  if (0 == pool) {
+    logger_error("error", "Failed to start the worker pool");
+    return 1;
+  }
+
+  installed = clib_deps_index_new(opts.dir);
+
+  if (0 == installed) {
+    logger_error("error", "Failed to read the installed packages");
+    return 1;
+  }
+
   if (0 == program.argc || (argc == rest_offset + rest_argc)) {
     rc = configure_package(CWD);
   } else {
@@ -649,7 +613,12 @@ int main(int argc, char **argv) {
 
         // try with slug
         if (0 != rc) {
-          rc = configure_package(program.nargv[i]);
+          clib_deps_entry_t *entry =
+              clib_deps_index_get(installed, program.nargv[i]);
+
+          if (entry) {
+            rc = configure_package_with_manifest_name(entry->dir, entry->file);
+          }
         }
       }
 
@@ -670,6 +639,8 @@ int main(int argc, char **argv) {
     }
   });
 
+  clib_pool_free(pool);
+  clib_deps_index_free(installed);
   hash_free(configured);
   command_free(&program);
   curl_global_cleanup();
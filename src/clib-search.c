@@ -9,11 +9,11 @@
 #include "case/case.h"
 #include "commander/commander.h"
 #include "common/clib-cache.h"
+#include "common/clib-download.h"
 #include "common/clib-package.h"
 #include "console-colors/console-colors.h"
 #include "debug/debug.h"
 #include "fs/fs.h"
-#include "http-get/http-get.h"
 #include "logger/logger.h"
 #include "parson/parson.h"
 #include "strdup/strdup.h"
@@ -25,6 +25,10 @@
 #include <string.h>
 #include <time.h>
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #define CLIB_WIKI_URL "https://github.com/clibs/clib/wiki/Packages"
 #define CLIB_SEARCH_CACHE_TIME 1 * 24 * 60 * 60
 
@@ -39,6 +43,7 @@ debug_t debugger;
 static int opt_color;
 static int opt_cache;
 static int opt_json;
+static int refreshing;
 
 static void setopt_nocolor(command_t *self) { opt_color = 0; }
 
@@ -92,37 +97,102 @@ cleanup:
   return rc;
 }
 
-static char *wiki_html_cache() {
-
-  if (clib_cache_has_search() && opt_cache) {
-    char *data = clib_cache_read_search();
-
-    if (data) {
-      return data;
-    }
+static char *fetch_wiki_html() {
+  clib_cache_validators_t validators;
+  clib_download_t *download = NULL;
+  char *html = NULL;
 
-    goto set_cache;
+  // an expired page is only sent again if it changed
+  if (opt_cache) {
+    html = clib_cache_read_stale_search(&validators);
   }
 
-set_cache:
-
   debug(&debugger, "setting cache from %s", CLIB_WIKI_URL);
-  http_get_response_t *res = http_get(CLIB_WIKI_URL);
-  if (!res->ok)
+  download = clib_download_get(CLIB_WIKI_URL, html ? validators.etag : NULL,
+                               html ? validators.last_modified : NULL, NULL);
+  if (!download || !download->ok) {
+    clib_download_free(download);
+    free(html);
     return NULL;
+  }
 
-  char *html = strdup(res->data);
-  if (NULL == html)
-    return NULL;
-  http_get_free(res);
+  if (304 == download->status) {
+    debug(&debugger, "not modified");
+    clib_cache_renew_search();
+    clib_download_free(download);
+    return html;
+  }
 
-  if (NULL == html)
+  free(html);
+  html = download->body;
+  download->body = NULL;
+
+  if (NULL == html) {
+    clib_download_free(download);
     return html;
-  clib_cache_save_search(html);
+  }
+
+  clib_cache_validators_init(&validators, NULL, download->etag,
+                             download->last_modified);
+  clib_download_free(download);
+  clib_cache_save_search_with_validators(html, &validators);
   debug(&debugger, "wrote cach");
   return html;
 }
 
+#ifdef HAVE_PTHREADS
+static pthread_t refresh_thread;
+
+static void *refresh_wiki_html(void *arg) {
+  free(fetch_wiki_html());
+  return NULL;
+}
+#endif
+
+/**
+ * Refresh the stale search cache while the results are shown.
+ */
+
+static void start_refresh() {
+#ifdef HAVE_PTHREADS
+  refreshing = 0 == pthread_create(&refresh_thread, NULL, refresh_wiki_html,
+                                   NULL);
+#else
+  refreshing = 1;
+#endif
+}
+
+static void finish_refresh() {
+  if (!refreshing) {
+    return;
+  }
+
+  fflush(stdout);
+  debug(&debugger, "refreshing the search cache");
+
+#ifdef HAVE_PTHREADS
+  pthread_join(refresh_thread, NULL);
+#else
+  free(fetch_wiki_html());
+#endif
+}
+
+static char *wiki_html_cache() {
+  if (clib_cache_has_search() && opt_cache) {
+    char *data = clib_cache_read_search();
+
+    if (data) {
+      if (clib_cache_is_stale_search()) {
+        start_refresh();
+      }
+
+      return data;
+    }
+  }
+
+  return fetch_wiki_html();
+}
+
 static void display_package(const wiki_package_t *pkg,
                             cc_color_t fg_color_highlight,
                             cc_color_t fg_color_text) {
@@ -228,5 +298,6 @@ int main(int argc, char *argv[]) {
   list_iterator_destroy(it);
   list_destroy(pkgs);
   command_free(&program);
+  finish_refresh();
   return 0;
 }
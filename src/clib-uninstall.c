@@ -9,6 +9,8 @@
 
 #include "asprintf/asprintf.h"
 #include "commander/commander.h"
+#include "common/clib-pool.h"
+#include "common/clib-tree.h"
 #include "debug/debug.h"
 #include "fs/fs.h"
 #include "http-get/http-get.h"
@@ -18,9 +20,13 @@
 #include "version.h"
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define CLIB_UNINSTALL_DEFAULT_TARGET "make uninstall"
 
+// workers removing the extracted sources
+#define CLIB_UNINSTALL_THREADS 4
+
 #if defined(_WIN32) || defined(WIN32) || defined(__MINGW32__) ||               \
     defined(__MINGW64__) || defined(__CYGWIN__)
 #define setenv(k, v, _) _putenv_s(k, v)
@@ -30,6 +36,8 @@ const char *manifest_names[] = {"clib.json", "package.json", NULL};
 
 debug_t debugger;
 
+static clib_pool_t *pool = NULL;
+
 static void setopt_prefix(command_t *self) {
   setenv("PREFIX", (char *)self->arg, 1);
   debug(&debugger, "set prefix: %s", (char *)self->arg);
@@ -93,6 +101,14 @@ static char *get_manifest_path(const char *dir) {
   return NULL;
 }
 
+static char *get_untar_dir(const char *name, const char *version) {
+  char *dir = NULL;
+  int size = asprintf(&dir, "/tmp/%s-%s", name, version);
+  if (-1 == size)
+    return NULL;
+  return dir;
+}
+
 static char *get_uninstall_target(const char *name, const char *version) {
   int size = 0;
   char *target = NULL;
@@ -102,8 +118,7 @@ static char *get_uninstall_target(const char *name, const char *version) {
   JSON_Value *root = NULL;
   JSON_Object *obj = NULL;
 
-  size = asprintf(&dir, "/tmp/%s-%s", name, version);
-  if (-1 == size)
+  if (!(dir = get_untar_dir(name, version)))
     return NULL;
 
   manifest = get_manifest_path(dir);
@@ -146,6 +161,7 @@ static int clib_uninstall(const char *owner, const char *name,
   char *file = NULL;
   char *tarpath = NULL;
   char *cmd = NULL;
+  char *dir = NULL;
   char *target = NULL;
   int rc = -1;
 
@@ -159,6 +175,8 @@ static int clib_uninstall(const char *owner, const char *name,
     goto done;
   if (!(tarpath = get_tmp_tarball(file)))
     goto done;
+  if (!(dir = get_untar_dir(name, version)))
+    goto done;
 
   logger_info("fetch", tarball);
   if (-1 == http_get_file(tarball, tarpath)) {
@@ -169,6 +187,10 @@ static int clib_uninstall(const char *owner, const char *name,
   if (!(cmd = get_untar_command(file)))
     goto done;
 
+  // left over by an earlier run, its files would mix with the new ones
+  if (0 == fs_exists(dir))
+    clib_tree_remove(pool, dir);
+
   logger_info("untar", tarpath);
   if (0 != system(cmd)) {
     logger_error("error", "failed to untar");
@@ -182,10 +204,15 @@ static int clib_uninstall(const char *owner, const char *name,
   rc = system(target);
 
 done:
+  if (tarpath)
+    unlink(tarpath);
+  if (dir && 0 == fs_exists(dir) && 0 != clib_tree_remove(pool, dir))
+    debug(&debugger, "failed to remove %s", dir);
   free(tarball);
   free(file);
   free(tarpath);
   free(cmd);
+  free(dir);
   free(target);
   return rc;
 }
@@ -209,6 +236,8 @@ int main(int argc, char **argv) {
   if (0 == program.argc)
     command_help(&program);
 
+  pool = clib_pool_new(CLIB_UNINSTALL_THREADS);
+
   for (int i = 0; i < program.argc; i++) {
     char *owner = parse_repo_owner(program.argv[i], NULL);
     if (!owner)
@@ -231,6 +260,8 @@ int main(int argc, char **argv) {
   rc = 0;
 
 cleanup:
+  if (pool)
+    clib_pool_free(pool);
   command_free(&program);
   return rc;
 }
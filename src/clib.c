@@ -55,6 +55,7 @@ static const char *usage =
     "    configure [name...]  Configure one or more packages\n"
     "    build [name...]      Build one or more packages\n"
     "    search [query]       Search for packages\n"
+    "    cache gc             Evict old packages, and reclaim disk space\n"
     "    help <cmd>           Display help for cmd\n"
     "";
 
@@ -84,7 +85,7 @@ static bool should_check_release(const char *path) {
 static void compare_versions(const char *marker_file_path) {
   const char *latest_version = clib_release_get_latest_tag();
 
-  if (0 != strcmp(CLIB_VERSION, latest_version)) {
+  if (latest_version && 0 != strcmp(CLIB_VERSION, latest_version)) {
     logger_info("info",
                 "You are using clib %s, a new version is avalable. You can "
                 "upgrade with the following command: clib upgrade --tag %s",
@@ -116,8 +117,9 @@ cleanup:
 }
 
 static void warn_deprecated_sub_command(const char *cmd) {
-  const char *allowed[] = {"build",  "configure", "init",    "install",
-                           "search", "update",    "upgrade", "uninstall", NULL};
+  const char *allowed[] = {"build",   "cache",   "configure", "init",
+                           "install", "search",  "update",    "upgrade",
+                           "uninstall", NULL};
 
   int i = 0;
 
@@ -0,0 +1,739 @@
+//
+// clib-cache-index.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+// mmap() and friends
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "clib-cache-index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#define INDEX_MAGIC "clibidx\n"
+#define INDEX_VERSION 1
+
+// a slot being written is read again, then taken as a miss
+#define INDEX_READ_RETRIES 64
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t capacity; // number of slots, a power of two
+  uint32_t used;     // slots taken, removed entries included
+  uint32_t stale;    // replaced by a new file, which is to be mapped
+  uint32_t writing;  // set while an entry is written, left set by a crash
+  uint32_t reserved[9];
+} index_header_t;
+
+typedef struct {
+  uint32_t seq;  // odd while the slot is written
+  uint32_t hash; // of the kind and key, 0 for a slot never used
+  clib_cache_index_entry_t entry;
+} index_slot_t;
+
+struct clib_cache_index {
+  char *path;
+  int lock_fd;
+  void *map;
+  size_t size;
+  index_header_t *header;
+  index_slot_t *slots;
+  clib_cache_index_fill_fn fill;
+  void *data;
+  int building; // being filled aside, nobody else sees it yet
+  int overflow; // filled past its capacity while building
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_t map_lock; // held exclusively to replace the mapping
+  pthread_mutex_t write_lock;
+#endif
+};
+
+static uint32_t key_hash(int kind, const char *key) {
+  uint32_t hash = 2166136261u;
+
+  hash = (hash ^ (unsigned char)kind) * 16777619u;
+
+  for (const char *c = key; *c; c++) {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+
+  return 0 == hash ? 1 : hash;
+}
+
+static size_t index_size(uint32_t capacity) {
+  return sizeof(index_header_t) + (size_t)capacity * sizeof(index_slot_t);
+}
+
+static int same_key(const clib_cache_index_entry_t *entry, int kind,
+                    const char *key) {
+  return kind == entry->kind &&
+         0 == strncmp(key, entry->key, CLIB_CACHE_INDEX_KEY_SIZE);
+}
+
+#ifndef _WIN32
+
+static void unmap_index(clib_cache_index_t *index) {
+  if (index->map) {
+    munmap(index->map, index->size);
+  }
+
+  index->map = NULL;
+  index->header = NULL;
+  index->slots = NULL;
+  index->size = 0;
+}
+
+/**
+ * Map the index file `fd` in place of the current mapping, if it is one.
+ */
+
+static int map_index(clib_cache_index_t *index, int fd) {
+  index_header_t *header = NULL;
+  struct stat st;
+  void *map = NULL;
+
+  if (0 != fstat(fd, &st) || (size_t)st.st_size < sizeof(index_header_t)) {
+    return -1;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (MAP_FAILED == map) {
+    return -1;
+  }
+
+  header = map;
+
+  if (0 != memcmp(INDEX_MAGIC, header->magic, sizeof(header->magic)) ||
+      INDEX_VERSION != header->version || 0 == header->capacity ||
+      0 != (header->capacity & (header->capacity - 1)) ||
+      index_size(header->capacity) != (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  unmap_index(index);
+  index->map = map;
+  index->size = st.st_size;
+  index->header = header;
+  index->slots = (index_slot_t *)(header + 1);
+
+  return 0;
+}
+
+/**
+ * Map the index file again if it was replaced. Called with the mapping
+ * locked exclusively.
+ */
+
+static int refresh_index(clib_cache_index_t *index) {
+  for (int i = 0; i < 8; i++) {
+    int fd = -1;
+    int rc = -1;
+
+    if (index->header && !index->header->stale) {
+      return 0;
+    }
+
+    if (-1 == (fd = open(index->path, O_RDWR | O_CLOEXEC))) {
+      return -1;
+    }
+
+    rc = map_index(index, fd);
+    close(fd);
+
+    if (0 != rc) {
+      return -1;
+    }
+  }
+
+  return -1;
+}
+
+static int read_begin(clib_cache_index_t *index) {
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_rdlock(&index->map_lock);
+
+  if (index->header && index->header->stale) {
+    pthread_rwlock_unlock(&index->map_lock);
+    pthread_rwlock_wrlock(&index->map_lock);
+    refresh_index(index);
+    pthread_rwlock_unlock(&index->map_lock);
+    pthread_rwlock_rdlock(&index->map_lock);
+  }
+#else
+  refresh_index(index);
+#endif
+
+  if (NULL == index->header || index->header->stale) {
+#ifdef HAVE_PTHREADS
+    pthread_rwlock_unlock(&index->map_lock);
+#endif
+    return -1;
+  }
+
+  return 0;
+}
+
+static void read_end(clib_cache_index_t *index) {
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_unlock(&index->map_lock);
+#endif
+}
+
+/**
+ * Lock out the writers of every process, and the readers of this one from
+ * the mapping, which may be replaced.
+ */
+
+static void lock_writes(clib_cache_index_t *index) {
+  if (index->building) {
+    return;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&index->write_lock);
+#endif
+  while (-1 == flock(index->lock_fd, LOCK_EX) && EINTR == errno)
+    ;
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_wrlock(&index->map_lock);
+#endif
+}
+
+static void unlock_writes(clib_cache_index_t *index) {
+  if (index->building) {
+    return;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_unlock(&index->map_lock);
+#endif
+  flock(index->lock_fd, LOCK_UN);
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&index->write_lock);
+#endif
+}
+
+/**
+ * Copy `slot` as a whole, never while it is written.
+ *
+ * @return 0 on success, -1 if it kept being written
+ */
+
+static int read_slot(index_slot_t *slot, index_slot_t *copy) {
+  volatile uint32_t *seq = &slot->seq;
+
+  for (int i = 0; i < INDEX_READ_RETRIES; i++) {
+    uint32_t before = *seq;
+
+    if (before & 1) {
+      continue;
+    }
+
+    __sync_synchronize();
+    memcpy(copy, slot, sizeof(index_slot_t));
+    __sync_synchronize();
+
+    if (before == *seq) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static void write_slot(clib_cache_index_t *index, index_slot_t *slot,
+                       uint32_t hash, const clib_cache_index_entry_t *entry) {
+  index->header->writing = 1;
+  __sync_add_and_fetch(&slot->seq, 1);
+  __sync_synchronize();
+
+  slot->hash = hash;
+  memcpy(&slot->entry, entry, sizeof(clib_cache_index_entry_t));
+
+  __sync_synchronize();
+  __sync_add_and_fetch(&slot->seq, 1);
+  index->header->writing = 0;
+}
+
+/**
+ * Probe for `key`, copying its slot to `copy`.
+ *
+ * @return The slot, or NULL if not found
+ */
+
+static index_slot_t *find_slot(clib_cache_index_t *index, int kind,
+                               const char *key, index_slot_t *copy) {
+  uint32_t hash = key_hash(kind, key);
+  uint32_t mask = index->header->capacity - 1;
+  uint32_t i = hash & mask;
+
+  for (uint32_t n = 0; n <= mask; n++, i = (i + 1) & mask) {
+    index_slot_t *slot = &index->slots[i];
+
+    if (0 != read_slot(slot, copy) || 0 == copy->hash) {
+      return NULL;
+    }
+
+    if (hash == copy->hash && same_key(&copy->entry, kind, key)) {
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Add or replace `entry`. Called with writes locked.
+ *
+ * @return 0 on success, -1 if the index has to grow first
+ */
+
+static int insert_entry(clib_cache_index_t *index,
+                        const clib_cache_index_entry_t *entry) {
+  uint32_t hash = key_hash(entry->kind, entry->key);
+  uint32_t capacity = index->header->capacity;
+  uint32_t mask = capacity - 1;
+  uint32_t i = hash & mask;
+  index_slot_t *removed = NULL;
+  index_slot_t *unused = NULL;
+  index_slot_t *slot = NULL;
+
+  for (uint32_t n = 0; n <= mask; n++, i = (i + 1) & mask) {
+    index_slot_t *probe = &index->slots[i];
+
+    if (0 == probe->hash) {
+      unused = probe;
+      break;
+    }
+
+    if (hash == probe->hash && same_key(&probe->entry, entry->kind,
+                                        entry->key)) {
+      slot = probe;
+      break;
+    }
+
+    if (0 == probe->entry.kind && NULL == removed) {
+      removed = probe;
+    }
+  }
+
+  if (NULL == slot) {
+    slot = removed;
+  }
+
+  if (NULL == slot) {
+    // three quarters full at most, so that probes stay short
+    if (NULL == unused || 4 * (index->header->used + 1) > 3 * capacity) {
+      return -1;
+    }
+
+    slot = unused;
+    index->header->used++;
+  }
+
+  write_slot(index, slot, hash, entry);
+
+  return 0;
+}
+
+/**
+ * Count the entries of `index`, removed ones aside. Called with writes
+ * locked.
+ */
+
+static uint32_t count_entries(clib_cache_index_t *index) {
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < index->header->capacity; i++) {
+    if (index->slots[i].hash && index->slots[i].entry.kind) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Get the capacity of an index for `count` entries, leaving it half empty
+ * so that as many puts go by before it is rebuilt again.
+ */
+
+static uint32_t capacity_for(uint32_t count) {
+  uint32_t capacity = CLIB_CACHE_INDEX_CAPACITY;
+
+  while (capacity < 2 * count) {
+    capacity *= 2;
+  }
+
+  return capacity;
+}
+
+static int copy_entries(clib_cache_index_t *from, clib_cache_index_t *to) {
+  for (uint32_t i = 0; i < from->header->capacity; i++) {
+    index_slot_t *slot = &from->slots[i];
+
+    if (slot->hash && slot->entry.kind &&
+        0 != clib_cache_index_put(to, &slot->entry)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Write a new index of `capacity` slots next to the index file, filled
+ * from the cache or copied from the current index, then rename it over the
+ * index file. Called with writes locked.
+ */
+
+static int build_index(clib_cache_index_t *index, uint32_t capacity,
+                       int from_cache) {
+  char tmp[BUFSIZ];
+  int rc = -1;
+
+  if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d.tmp", index->path,
+                       (int)getpid()) >= sizeof(tmp)) {
+    return -1;
+  }
+
+  for (;;) {
+    clib_cache_index_t fresh;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    memset(&fresh, 0, sizeof(clib_cache_index_t));
+    fresh.building = 1;
+
+    if (-1 == fd) {
+      return -1;
+    }
+
+    if (0 != ftruncate(fd, index_size(capacity)) ||
+        MAP_FAILED == (fresh.map = mmap(NULL, index_size(capacity),
+                                        PROT_READ | PROT_WRITE, MAP_SHARED,
+                                        fd, 0))) {
+      close(fd);
+      unlink(tmp);
+      return -1;
+    }
+
+    close(fd);
+    fresh.size = index_size(capacity);
+    fresh.header = fresh.map;
+    fresh.slots = (index_slot_t *)(fresh.header + 1);
+    memcpy(fresh.header->magic, INDEX_MAGIC, sizeof(fresh.header->magic));
+    fresh.header->version = INDEX_VERSION;
+    fresh.header->capacity = capacity;
+
+    if (from_cache) {
+      rc = index->fill ? index->fill(&fresh, index->data) : 0;
+    } else {
+      rc = copy_entries(index, &fresh);
+    }
+
+    if (fresh.overflow) {
+      unmap_index(&fresh);
+      capacity *= 2;
+      continue;
+    }
+
+    if (0 != rc || 0 != rename(tmp, index->path)) {
+      unmap_index(&fresh);
+      unlink(tmp);
+      return -1;
+    }
+
+    // the processes still mapping it go over to the new file
+    if (index->header) {
+      index->header->stale = 1;
+    }
+
+    unmap_index(index);
+    index->map = fresh.map;
+    index->size = fresh.size;
+    index->header = fresh.header;
+    index->slots = fresh.slots;
+
+    return 0;
+  }
+}
+
+#endif
+
+clib_cache_index_t *clib_cache_index_open(const char *path,
+                                          clib_cache_index_fill_fn fill,
+                                          void *data) {
+#ifdef _WIN32
+  return NULL;
+#else
+  clib_cache_index_t *index = calloc(1, sizeof(clib_cache_index_t));
+  char lock[BUFSIZ];
+  int fd = -1;
+  int rc = -1;
+
+  if (NULL == index) {
+    return NULL;
+  }
+
+  index->lock_fd = -1;
+  index->fill = fill;
+  index->data = data;
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_init(&index->map_lock, NULL);
+  pthread_mutex_init(&index->write_lock, NULL);
+#endif
+
+  if (NULL == (index->path = strdup(path)) ||
+      (size_t)snprintf(lock, sizeof(lock), "%s.lock", path) >= sizeof(lock) ||
+      -1 == (index->lock_fd =
+                 open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600))) {
+    clib_cache_index_free(index);
+    return NULL;
+  }
+
+  if (-1 != (fd = open(path, O_RDWR | O_CLOEXEC))) {
+    rc = map_index(index, fd);
+    close(fd);
+  }
+
+  if (0 == rc && !index->header->stale && !index->header->writing) {
+    return index;
+  }
+
+  // missing, corrupted, replaced meanwhile, or a writer crashed, unless
+  // another process fixed it in the meantime
+  lock_writes(index);
+
+  if (-1 != (fd = open(path, O_RDWR | O_CLOEXEC))) {
+    rc = map_index(index, fd);
+    close(fd);
+  }
+
+  if (0 != rc || index->header->stale || index->header->writing) {
+    rc = build_index(index, CLIB_CACHE_INDEX_CAPACITY, 1);
+  }
+
+  unlock_writes(index);
+
+  if (0 != rc) {
+    clib_cache_index_free(index);
+    return NULL;
+  }
+
+  return index;
+#endif
+}
+
+int clib_cache_index_get(clib_cache_index_t *index, int kind, const char *key,
+                         clib_cache_index_entry_t *entry) {
+#ifdef _WIN32
+  return -1;
+#else
+  index_slot_t copy;
+  int rc = -1;
+
+  if (NULL == index || 0 != read_begin(index)) {
+    return -1;
+  }
+
+  rc = find_slot(index, kind, key, &copy) ? 0 : -1;
+  read_end(index);
+
+  if (0 == rc && entry) {
+    memcpy(entry, &copy.entry, sizeof(clib_cache_index_entry_t));
+    entry->sha256[CLIB_SHA256_HEX_SIZE - 1] = 0;
+    entry->key[CLIB_CACHE_INDEX_KEY_SIZE - 1] = 0;
+    entry->location[CLIB_CACHE_INDEX_LOCATION_SIZE - 1] = 0;
+  }
+
+  return rc;
+#endif
+}
+
+int clib_cache_index_put(clib_cache_index_t *index,
+                         const clib_cache_index_entry_t *entry) {
+#ifdef _WIN32
+  return -1;
+#else
+  clib_cache_index_entry_t copy;
+  int rc = -1;
+
+  if (NULL == index || entry->kind <= 0 ||
+      strlen(entry->key) >= CLIB_CACHE_INDEX_KEY_SIZE) {
+    return -1;
+  }
+
+  memcpy(&copy, entry, sizeof(clib_cache_index_entry_t));
+  copy.sha256[CLIB_SHA256_HEX_SIZE - 1] = 0;
+  copy.location[CLIB_CACHE_INDEX_LOCATION_SIZE - 1] = 0;
+
+  lock_writes(index);
+
+  if (index->building) {
+    if (0 != (rc = insert_entry(index, &copy))) {
+      index->overflow = 1;
+    }
+  } else if (0 == refresh_index(index) &&
+             0 != (rc = insert_entry(index, &copy)) &&
+             0 == build_index(index, capacity_for(count_entries(index) + 1),
+                              0)) {
+    // removed entries count as used until then, so it may not even grow
+    rc = insert_entry(index, &copy);
+  }
+
+  unlock_writes(index);
+
+  return rc;
+#endif
+}
+
+int clib_cache_index_touch(clib_cache_index_t *index, int kind,
+                           const char *key, time_t now) {
+#ifdef _WIN32
+  return -1;
+#else
+  index_slot_t *slot = NULL;
+  index_slot_t copy;
+
+  if (NULL == index || 0 != read_begin(index)) {
+    return -1;
+  }
+
+  // racing another touch is fine, either time will do
+  if ((slot = find_slot(index, kind, key, &copy)) &&
+      copy.entry.accessed < now) {
+    __sync_bool_compare_and_swap(&slot->entry.accessed, copy.entry.accessed,
+                                 (int64_t)now);
+  }
+
+  read_end(index);
+
+  return slot ? 0 : -1;
+#endif
+}
+
+int clib_cache_index_remove(clib_cache_index_t *index, int kind,
+                            const char *key) {
+#ifdef _WIN32
+  return -1;
+#else
+  index_slot_t *slot = NULL;
+  index_slot_t copy;
+
+  if (NULL == index) {
+    return -1;
+  }
+
+  lock_writes(index);
+
+  if (0 == refresh_index(index) &&
+      (slot = find_slot(index, kind, key, &copy))) {
+    copy.entry.kind = 0;
+    write_slot(index, slot, copy.hash, &copy.entry);
+  }
+
+  unlock_writes(index);
+
+  return slot ? 0 : -1;
+#endif
+}
+
+int clib_cache_index_each(clib_cache_index_t *index,
+                          clib_cache_index_each_fn fn, void *data) {
+#ifdef _WIN32
+  return -1;
+#else
+  int rc = 0;
+
+  if (NULL == index || 0 != read_begin(index)) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; 0 == rc && i < index->header->capacity; i++) {
+    index_slot_t copy;
+
+    // skipped if it kept being written, as if it were written after
+    if (0 != read_slot(&index->slots[i], &copy) || 0 == copy.hash ||
+        0 == copy.entry.kind) {
+      continue;
+    }
+
+    copy.entry.sha256[CLIB_SHA256_HEX_SIZE - 1] = 0;
+    copy.entry.key[CLIB_CACHE_INDEX_KEY_SIZE - 1] = 0;
+    copy.entry.location[CLIB_CACHE_INDEX_LOCATION_SIZE - 1] = 0;
+    rc = fn(&copy.entry, data);
+  }
+
+  read_end(index);
+
+  return rc;
+#endif
+}
+
+int clib_cache_index_rebuild(clib_cache_index_t *index) {
+#ifdef _WIN32
+  return -1;
+#else
+  uint32_t capacity = CLIB_CACHE_INDEX_CAPACITY;
+  int rc = -1;
+
+  if (NULL == index) {
+    return -1;
+  }
+
+  lock_writes(index);
+
+  // grows again while filled if the cache holds more, shrinks otherwise
+  if (index->header && 0 == refresh_index(index)) {
+    capacity = capacity_for(count_entries(index));
+  }
+
+  rc = build_index(index, capacity, 1);
+  unlock_writes(index);
+
+  return rc;
+#endif
+}
+
+void clib_cache_index_free(clib_cache_index_t *index) {
+  if (NULL == index) {
+    return;
+  }
+
+#ifndef _WIN32
+  unmap_index(index);
+#endif
+
+  if (-1 != index->lock_fd) {
+    close(index->lock_fd);
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_destroy(&index->map_lock);
+  pthread_mutex_destroy(&index->write_lock);
+#endif
+
+  free(index->path);
+  free(index);
+}
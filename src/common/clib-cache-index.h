@@ -0,0 +1,127 @@
+//
+// clib-cache-index.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_CACHE_INDEX_H
+#define CLIB_CACHE_INDEX_H 1
+
+#include "clib-sha256.h"
+#include <stdint.h>
+#include <time.h>
+
+#define CLIB_CACHE_INDEX_KEY_SIZE 128
+#define CLIB_CACHE_INDEX_LOCATION_SIZE 160
+
+/**
+ * Fewest slots of an index. Once three quarters of its slots were used,
+ * removed entries included, it is rebuilt with twice as many slots as it
+ * holds entries.
+ */
+#define CLIB_CACHE_INDEX_CAPACITY 1024
+
+enum {
+  CLIB_CACHE_INDEX_JSON = 1,
+  CLIB_CACHE_INDEX_PACKAGE = 2,
+};
+
+/**
+ * What the index knows of a cache entry. The layout is the one of the
+ * index file, so only fixed size types are used.
+ */
+typedef struct {
+  int32_t kind; // 0 once removed
+  int32_t reserved;
+  int64_t size;     // in bytes
+  int64_t inserted; // when the entry was saved, in seconds
+  int64_t accessed; // when the entry was last read, in seconds
+  char sha256[CLIB_SHA256_HEX_SIZE];
+  char key[CLIB_CACHE_INDEX_KEY_SIZE];
+  char location[CLIB_CACHE_INDEX_LOCATION_SIZE]; // relative to the cache
+} clib_cache_index_entry_t;
+
+typedef struct clib_cache_index clib_cache_index_t;
+
+/**
+ * Add the entries found in the cache itself to a new `index`, with
+ * `clib_cache_index_put()`, when the index file is missing or corrupted.
+ *
+ * @return 0 on success, anything else to give up
+ */
+typedef int (*clib_cache_index_fill_fn)(clib_cache_index_t *index,
+                                        void *data);
+
+/**
+ * Map the index file at `path`, shared by every process using the cache.
+ * Lookups are lock-free probes of the mapping, writes lock `path`.lock and
+ * update one entry at a time, which readers never see half written. An
+ * index that is missing, corrupted, or was left half written by a crash is
+ * rebuilt aside with `fill`, then renamed over `path`.
+ *
+ * @return A new index, or NULL on error, e.g. where files cannot be mapped
+ */
+clib_cache_index_t *clib_cache_index_open(const char *path,
+                                          clib_cache_index_fill_fn fill,
+                                          void *data);
+
+/**
+ * Look up `key`, and copy its entry to `entry` if not NULL.
+ *
+ * @return 0 if found, -1 otherwise
+ */
+int clib_cache_index_get(clib_cache_index_t *index, int kind, const char *key,
+                         clib_cache_index_entry_t *entry);
+
+/**
+ * Add `entry`, or replace the entry of the same kind and key.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_index_put(clib_cache_index_t *index,
+                         const clib_cache_index_entry_t *entry);
+
+/**
+ * Record that `key` was read at `now`, without locking.
+ *
+ * @return 0 on success, -1 if not found
+ */
+int clib_cache_index_touch(clib_cache_index_t *index, int kind,
+                           const char *key, time_t now);
+
+/**
+ * @return 0 on success, -1 if not found or on error
+ */
+int clib_cache_index_remove(clib_cache_index_t *index, int kind,
+                            const char *key);
+
+/**
+ * Called with a copy of each entry, see `clib_cache_index_each()`.
+ *
+ * @return 0 to go on, anything else to stop
+ */
+typedef int (*clib_cache_index_each_fn)(const clib_cache_index_entry_t *entry,
+                                        void *data);
+
+/**
+ * Call `fn` with every entry of the index, in no particular order. `fn`
+ * must not change the index, entries to change are collected first.
+ *
+ * @return 0 once every entry was seen, -1 on error, or what `fn` returned
+ * to stop
+ */
+int clib_cache_index_each(clib_cache_index_t *index,
+                          clib_cache_index_each_fn fn, void *data);
+
+/**
+ * Rebuild the index from the cache, see `clib_cache_index_open()`. It is
+ * sized after the entries it holds, so it shrinks back after evictions.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_index_rebuild(clib_cache_index_t *index);
+
+void clib_cache_index_free(clib_cache_index_t *index);
+
+#endif
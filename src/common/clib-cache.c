@@ -5,23 +5,66 @@
 // MIT licensed
 //
 
+// linkat() and friends
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "clib-cache.h"
+#include "clib-cache-index.h"
+#include "clib-pack.h"
+#include "clib-refs.h"
+#include "clib-sha256.h"
+#include "clib-tree.h"
 #include "copy/copy.h"
 #include "fs/fs.h"
-#include "rimraf/rimraf.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <mkdirp/mkdirp.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#define GET_PKG_CACHE(a, n, v)                                                 \
+#ifndef _WIN32
+#include <sys/file.h>
+#endif
+
+#define GET_PKG_CACHE(a, n, v, err)                                            \
   char pkg_cache[BUFSIZ];                                                      \
-  package_cache_path(pkg_cache, a, n, v);
+  if (0 != package_cache_path(pkg_cache, a, n, v))                             \
+    return err;
 
-#define GET_JSON_CACHE(a, n, v)                                                \
+#define GET_JSON_CACHE(a, n, v, err)                                           \
   char json_cache[BUFSIZ];                                                     \
-  json_cache_path(json_cache, a, n, v);
+  if (0 != json_cache_path(json_cache, a, n, v))                               \
+    return err;
+
+#define GET_MISSING_CACHE(a, n, v, f, err)                                     \
+  char missing_cache[BUFSIZ];                                                  \
+  if (0 != missing_cache_path(missing_cache, a, n, v, f))                      \
+    return err;
+
+#define GET_TREE_CACHE(a, n, v, err)                                           \
+  char tree_cache[BUFSIZ];                                                     \
+  if (0 != tree_cache_path(tree_cache, a, n, v))                               \
+    return err;
+
+#define GET_PACK_CACHE(a, n, v, err)                                           \
+  char pack_cache[BUFSIZ];                                                     \
+  if (0 != pack_cache_path(pack_cache, a, n, v))                               \
+    return err;
+
+#define GET_ENTRY_KEY(a, n, v, err)                                            \
+  char entry_key[BUFSIZ];                                                      \
+  if (0 != format_path(entry_key, ENTRY_KEY_PATTERN, a, n, v))                 \
+    return err;
 
 #ifdef _WIN32
 #define BASE_DIR getenv("AppData")
@@ -30,25 +73,285 @@
 #endif
 
 #define BASE_CACHE_PATTERN "%s/.cache/clib"
+#define VALIDATORS_SUFFIX ".validators"
+#define FILE_HEADER "File: "
+#define ETAG_HEADER "ETag: "
+#define LAST_MODIFIED_HEADER "Last-Modified: "
 #define PKG_CACHE_PATTERN "%s/%s_%s_%s"
 #define JSON_CACHE_PATTERN "%s/%s_%s_%s.json"
+#define MISSING_CACHE_PATTERN "%s/%s_%s_%s_%s"
+#define TREE_CACHE_PATTERN "%s/%s_%s_%s"
+#define PACK_SUFFIX ".pack"
+#define PACK_CACHE_PATTERN "%s/%s_%s_%s" PACK_SUFFIX
+#define ENTRY_KEY_PATTERN "%s_%s_%s"
+#define LOCK_PATTERN "%s/%s.%s"
+#define OBJECT_PATTERN "%s/%.2s/%s%s"
+#define TMP_PATTERN "%s.%d.%lu.tmp"
+#define TREE_HEADER "clib-tree 1\n"
+
+// entries whose keys hash alike share a lock
+#define ENTRY_LOCKS 64
 
 /** Portable PATH_MAX ? */
+static char base_cache_dir[BUFSIZ];
 static char package_cache_dir[BUFSIZ];
 static char search_cache[BUFSIZ];
 static char json_cache_dir[BUFSIZ];
 static char meta_cache_dir[BUFSIZ];
+static char missing_cache_dir[BUFSIZ];
+static char tree_cache_dir[BUFSIZ];
+static char pack_cache_dir[BUFSIZ];
+static char refs_cache_dir[BUFSIZ];
+static char store_dir[BUFSIZ];
+static char lock_dir[BUFSIZ];
 static time_t expiration;
+static time_t missing_expiration = CLIB_CACHE_MISSING_TIME;
+static time_t max_stale; // past the expiration, 0 to never serve stale
+static int packed;       // packages are saved as packs
+static clib_cache_stats_t stats;
+static clib_pool_t *pool;
+static unsigned long tmp_files;
+static clib_cache_index_t *cache_index; // NULL if it cannot be mapped
+static int claims[ENTRY_LOCKS];
+static clib_cache_limits_t limits = {CLIB_CACHE_MAX_SIZE,
+                                     CLIB_CACHE_MAX_ENTRIES,
+                                     CLIB_CACHE_MIN_AGE};
+
+/**
+ * The entries of a package share a key, e.g. "author_name_1.0.0", which
+ * names their locks, and their files.
+ */
+
+static unsigned entry_index(const char *key) {
+  uint32_t hash = 2166136261u;
+
+  for (const char *c = key; *c; c++) {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+
+  return hash % ENTRY_LOCKS;
+}
+
+#ifdef HAVE_PTHREADS
+static pthread_rwlock_t entry_locks[ENTRY_LOCKS];
+static pthread_once_t entry_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_entry_locks(void) {
+  for (int i = 0; i < ENTRY_LOCKS; i++) {
+    pthread_rwlock_init(&entry_locks[i], NULL);
+  }
+}
+
+static pthread_rwlock_t *entry_lock(const char *key) {
+  pthread_once(&entry_locks_once, init_entry_locks);
+
+  return &entry_locks[entry_index(key)];
+}
+#endif
+
+/**
+ * Format a path into a `BUFSIZ` buffer.
+ *
+ * @return 0 on success, -1 if it does not fit
+ */
+
+static int format_path(char *path, const char *format, ...) {
+  va_list args;
+  int length = 0;
+
+  va_start(args, format);
+  length = vsnprintf(path, BUFSIZ, format, args);
+  va_end(args);
+
+  return length < 0 || length >= BUFSIZ ? -1 : 0;
+}
+
+static int json_cache_path(char *json_cache, char *author, char *name,
+                           char *version) {
+  return format_path(json_cache, JSON_CACHE_PATTERN, json_cache_dir, author,
+                     name, version);
+}
+
+static int package_cache_path(char *pkg_cache, char *author, char *name,
+                              char *version) {
+  return format_path(pkg_cache, PKG_CACHE_PATTERN, package_cache_dir, author,
+                     name, version);
+}
+
+static int missing_cache_path(char *missing_cache, char *author, char *name,
+                              char *version, const char *file) {
+  return format_path(missing_cache, MISSING_CACHE_PATTERN, missing_cache_dir,
+                     author, name, version, file);
+}
+
+static int tree_cache_path(char *tree_cache, char *author, char *name,
+                           char *version) {
+  return format_path(tree_cache, TREE_CACHE_PATTERN, tree_cache_dir, author,
+                     name, version);
+}
+
+static int pack_cache_path(char *pack_cache, char *author, char *name,
+                           char *version) {
+  return format_path(pack_cache, PACK_CACHE_PATTERN, pack_cache_dir, author,
+                     name, version);
+}
+
+/**
+ * The file telling whether a package is cached, and since when: its pack,
+ * or its tree, which a save replaces at once, unlike the directory of
+ * links next to it, or the directory of a package cached by an older
+ * version.
+ */
+
+static int package_entry_path(char *pkg_entry, char *author, char *name,
+                              char *version) {
+  if (0 != pack_cache_path(pkg_entry, author, name, version)) {
+    return -1;
+  }
+
+  if (0 == fs_exists(pkg_entry)) {
+    return 0;
+  }
+
+  if (0 != tree_cache_path(pkg_entry, author, name, version)) {
+    return -1;
+  }
+
+  if (0 == fs_exists(pkg_entry)) {
+    return 0;
+  }
+
+  return package_cache_path(pkg_entry, author, name, version);
+}
+
+/**
+ * A name for a temporary sibling of `path`, unique among the processes and
+ * threads writing next to it.
+ */
+
+static int tmp_path(char *tmp, const char *path) {
+  return format_path(tmp, TMP_PATTERN, path, (int)getpid(),
+                     __sync_add_and_fetch(&tmp_files, 1));
+}
+
+/**
+ * Objects are named after the SHA-256 of their content. Executables are
+ * stored apart, as every hard link to an object shares its mode.
+ */
+
+static int object_path(char *object, const char *hash, int executable) {
+  return format_path(object, OBJECT_PATTERN, store_dir, hash, hash + 2,
+                     executable ? "x" : "");
+}
+
+/**
+ * Lock files are shared by every process using the cache. They are removed
+ * with the last entry of their key, see `remove_lock_file()`.
+ */
+
+static int lock_path(char *path, const char *key, const char *kind) {
+  return format_path(path, LOCK_PATTERN, lock_dir, key, kind);
+}
+
+#ifndef _WIN32
+/**
+ * @return 1 if `fd` is still the file at `path`, which it was opened from
+ */
+
+static int is_lock_file(int fd, const char *path) {
+  struct stat opened;
+  struct stat named;
+
+  return 0 == fstat(fd, &opened) && 0 == stat(path, &named) &&
+         opened.st_dev == named.st_dev && opened.st_ino == named.st_ino;
+}
+#endif
+
+/**
+ * Open and `flock()` the lock file of an entry. Every call gets its own
+ * open file, so threads of one process exclude each other too. A file
+ * removed while waiting for it is not the lock anymore, the one created
+ * in its place is locked instead.
+ *
+ * @return The locked file, or -1 if locking is not supported, e.g. by a
+ * network filesystem
+ */
+
+static int lock_file(const char *key, const char *kind, int exclusive) {
+  int fd = -1;
+#ifndef _WIN32
+  char path[BUFSIZ];
+  int rc = -1;
+
+  if (0 != lock_path(path, key, kind)) {
+    return -1;
+  }
+
+  do {
+    // kept from the commands run while installing, e.g. a configure script
+    if (-1 == (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600))) {
+      return -1;
+    }
+
+    while (-1 == (rc = flock(fd, exclusive ? LOCK_EX : LOCK_SH)) &&
+           EINTR == errno)
+      ;
+
+    if (0 != rc) {
+      close(fd);
+      return -1;
+    }
+
+    if (!is_lock_file(fd, path)) {
+      close(fd);
+      fd = -1;
+    }
+  } while (-1 == fd);
+#endif
+
+  return fd;
+}
+
+/**
+ * Lock the cache entries of a package: shared to read its files, exclusive
+ * to write or delete any of its entries, against the other threads and
+ * processes. Files published with a rename, e.g. manifests, are read
+ * without a lock.
+ *
+ * @return The lock for `unlock_entry()`
+ */
+
+static int lock_entry(const char *key, int exclusive) {
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_t *lock = entry_lock(key);
+
+  if (exclusive) {
+    pthread_rwlock_wrlock(lock);
+  } else {
+    pthread_rwlock_rdlock(lock);
+  }
+#endif
+
+  return lock_file(key, "lock", exclusive);
+}
 
-static void json_cache_path(char *pkg_cache, char *author, char *name,
-                            char *version) {
-  sprintf(pkg_cache, JSON_CACHE_PATTERN, json_cache_dir, author, name, version);
+static void unlock_entry(const char *key, int fd) {
+  if (-1 != fd) {
+    close(fd);
+  }
+#ifdef HAVE_PTHREADS
+  pthread_rwlock_unlock(entry_lock(key));
+#endif
 }
 
-static void package_cache_path(char *json_cache, char *author, char *name,
-                               char *version) {
-  sprintf(json_cache, PKG_CACHE_PATTERN, package_cache_dir, author, name,
-          version);
+/**
+ * The pool to handle the files of an entry on. Not while this process holds
+ * its claim: waiting for the pool runs other installs, which may wait for a
+ * claim held by a process waiting for ours.
+ */
+
+static clib_pool_t *entry_pool(const char *key) {
+  return __sync_fetch_and_add(&claims[entry_index(key)], 0) ? NULL : pool;
 }
 
 const char *clib_cache_dir(void) { return package_cache_dir; }
@@ -60,8 +363,147 @@ static int check_dir(char *dir) {
   return 0;
 }
 
+/**
+ * Write `content` to a temporary sibling of `path`, then rename it over
+ * `path`, so that readers see either the old or the new content in full.
+ *
+ * @return Number of written bytes, or -1 on error
+ */
+
+static int publish_file(const char *path, const char *content) {
+  char tmp[BUFSIZ];
+  int rc = -1;
+
+  if (0 != tmp_path(tmp, path)) {
+    return -1;
+  }
+
+  if (-1 == (rc = fs_write(tmp, content)) || 0 != rename(tmp, path)) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return rc;
+}
+
+/**
+ * The validators of a cached response are kept next to it, as the headers
+ * they came in.
+ */
+
+static int validators_path(char *path, const char *cache) {
+  if (!*cache) {
+    return -1;
+  }
+
+  return format_path(path, "%s" VALIDATORS_SUFFIX, cache);
+}
+
+static void read_validator(const char *line, const char *header, char *value,
+                           size_t size) {
+  size_t length = strlen(header);
+
+  if (0 == strncmp(line, header, length) && strlen(line + length) < size) {
+    strcpy(value, line + length);
+  }
+}
+
+void clib_cache_validators_init(clib_cache_validators_t *validators,
+                                const char *file, const char *etag,
+                                const char *last_modified) {
+  memset(validators, 0, sizeof(clib_cache_validators_t));
+
+  // a truncated validator would never match
+  if (file && strlen(file) < sizeof(validators->file)) {
+    strcpy(validators->file, file);
+  }
+
+  if (etag && strlen(etag) < sizeof(validators->etag)) {
+    strcpy(validators->etag, etag);
+  }
+
+  if (last_modified &&
+      strlen(last_modified) < sizeof(validators->last_modified)) {
+    strcpy(validators->last_modified, last_modified);
+  }
+}
+
+/**
+ * @return 0 on success, -1 if the response at `cache` has no validators
+ */
+
+static int read_validators(const char *cache,
+                           clib_cache_validators_t *validators) {
+  char path[BUFSIZ];
+  char line[BUFSIZ];
+  FILE *file = NULL;
+
+  memset(validators, 0, sizeof(clib_cache_validators_t));
+
+  if (0 != validators_path(path, cache) || NULL == (file = fopen(path, "r"))) {
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = 0;
+    read_validator(line, FILE_HEADER, validators->file,
+                   sizeof(validators->file));
+    read_validator(line, ETAG_HEADER, validators->etag,
+                   sizeof(validators->etag));
+    read_validator(line, LAST_MODIFIED_HEADER, validators->last_modified,
+                   sizeof(validators->last_modified));
+  }
+
+  fclose(file);
+
+  return *validators->etag || *validators->last_modified ? 0 : -1;
+}
+
+/**
+ * Save the validators of the response just saved at `cache`, or remove
+ * those of the previous one if NULL.
+ */
+
+static int save_validators(const char *cache,
+                           const clib_cache_validators_t *validators) {
+  char content[sizeof(clib_cache_validators_t) + 64];
+  char path[BUFSIZ];
+
+  if (0 != validators_path(path, cache)) {
+    return -1;
+  }
+
+  if (NULL == validators ||
+      (!*validators->etag && !*validators->last_modified)) {
+    unlink(path);
+    return 0;
+  }
+
+  snprintf(content, sizeof(content), "%s%.*s\n%s%.*s\n%s%.*s\n", FILE_HEADER,
+           (int)sizeof(validators->file) - 1, validators->file, ETAG_HEADER,
+           CLIB_CACHE_VALIDATOR_SIZE - 1, validators->etag,
+           LAST_MODIFIED_HEADER, CLIB_CACHE_VALIDATOR_SIZE - 1,
+           validators->last_modified);
+
+  return -1 == publish_file(path, content) ? -1 : 0;
+}
+
+/**
+ * Make the cached response at `path` expire from now on.
+ */
+
+static int renew_file(const char *path) {
+#ifdef _WIN32
+  return -1;
+#else
+  return utimensat(AT_FDCWD, path, NULL, 0);
+#endif
+}
+
 int clib_cache_meta_init(void) {
-  sprintf(meta_cache_dir, BASE_CACHE_PATTERN "/meta", BASE_DIR);
+  if (0 != format_path(meta_cache_dir, BASE_CACHE_PATTERN "/meta", BASE_DIR)) {
+    return -1;
+  }
 
   if (0 != check_dir(meta_cache_dir)) {
     return -1;
@@ -72,12 +514,52 @@ int clib_cache_meta_init(void) {
 
 const char *clib_cache_meta_dir(void) { return meta_cache_dir; }
 
+static int fill_index(clib_cache_index_t *index, void *data);
+
 int clib_cache_init(time_t exp) {
+  const char *max_size = getenv("CLIB_CACHE_MAX_SIZE");
+  const char *max_entries = getenv("CLIB_CACHE_MAX_ENTRIES");
+  const char *stale = getenv("CLIB_CACHE_MAX_STALE");
+  const char *pack = getenv("CLIB_CACHE_PACKED");
+  char index_path[BUFSIZ];
+
   expiration = exp;
 
-  sprintf(package_cache_dir, BASE_CACHE_PATTERN "/packages", BASE_DIR);
-  sprintf(json_cache_dir, BASE_CACHE_PATTERN "/json", BASE_DIR);
-  sprintf(search_cache, BASE_CACHE_PATTERN "/search.html", BASE_DIR);
+  if (stale) {
+    max_stale = atol(stale);
+  }
+
+  if (pack) {
+    packed = 0 != atoi(pack);
+  }
+
+  if (max_size && 0 != clib_cache_parse_size(max_size, &limits.max_size)) {
+    return -1;
+  }
+
+  if (max_entries) {
+    limits.max_entries = atol(max_entries);
+  }
+
+  if (0 != format_path(base_cache_dir, BASE_CACHE_PATTERN, BASE_DIR) ||
+      0 != format_path(index_path, BASE_CACHE_PATTERN "/index", BASE_DIR) ||
+      0 != format_path(package_cache_dir, BASE_CACHE_PATTERN "/packages",
+                       BASE_DIR) ||
+      0 != format_path(json_cache_dir, BASE_CACHE_PATTERN "/json", BASE_DIR) ||
+      0 != format_path(search_cache, BASE_CACHE_PATTERN "/search.html",
+                       BASE_DIR) ||
+      0 != format_path(missing_cache_dir, BASE_CACHE_PATTERN "/missing",
+                       BASE_DIR) ||
+      0 != format_path(tree_cache_dir, BASE_CACHE_PATTERN "/trees",
+                       BASE_DIR) ||
+      0 != format_path(pack_cache_dir, BASE_CACHE_PATTERN "/packs",
+                       BASE_DIR) ||
+      0 != format_path(refs_cache_dir, BASE_CACHE_PATTERN "/refs",
+                       BASE_DIR) ||
+      0 != format_path(store_dir, BASE_CACHE_PATTERN "/store", BASE_DIR) ||
+      0 != format_path(lock_dir, BASE_CACHE_PATTERN "/locks", BASE_DIR)) {
+    return -1;
+  }
 
   if (0 != check_dir(package_cache_dir)) {
     return -1;
@@ -85,11 +567,33 @@ int clib_cache_init(time_t exp) {
   if (0 != check_dir(json_cache_dir)) {
     return -1;
   }
+  if (0 != check_dir(missing_cache_dir)) {
+    return -1;
+  }
+  if (0 != check_dir(tree_cache_dir)) {
+    return -1;
+  }
+  if (0 != check_dir(pack_cache_dir)) {
+    return -1;
+  }
+  if (0 != check_dir(refs_cache_dir)) {
+    return -1;
+  }
+  if (0 != check_dir(store_dir)) {
+    return -1;
+  }
+  if (0 != check_dir(lock_dir)) {
+    return -1;
+  }
+
+  // without it, lookups go to the filesystem
+  clib_cache_index_free(cache_index);
+  cache_index = clib_cache_index_open(index_path, fill_index, NULL);
 
   return 0;
 }
 
-static int is_expired(char *cache) {
+static int is_older_than(char *cache, time_t max_age) {
   fs_stats *stat = fs_stat(cache);
 
   if (!stat) {
@@ -100,97 +604,2004 @@ static int is_expired(char *cache) {
   time_t now = time(NULL);
   free(stat);
 
-  return now - modified >= expiration;
+  return now - modified >= max_age;
 }
 
-int clib_cache_has_json(char *author, char *name, char *version) {
-  GET_JSON_CACHE(author, name, version);
+static int is_expired(char *cache) { return is_older_than(cache, expiration); }
+
+void clib_cache_set_max_stale(time_t stale) { max_stale = stale; }
 
-  return 0 == fs_exists(json_cache) && !is_expired(json_cache);
+void clib_cache_set_packed(int pack) { packed = pack; }
+
+/**
+ * @return 1 if `cache` is still served, fresh or stale
+ */
+
+static int is_served(char *cache) {
+  return 0 == is_older_than(cache, expiration + max_stale);
 }
 
-char *clib_cache_read_json(char *author, char *name, char *version) {
-  GET_JSON_CACHE(author, name, version);
+static int index_key(char *key, const char *author, const char *name,
+                     const char *version) {
+  int length = snprintf(key, CLIB_CACHE_INDEX_KEY_SIZE, "%s_%s_%s", author,
+                        name, version);
 
-  if (is_expired(json_cache)) {
-    return NULL;
+  return length < 0 || length >= CLIB_CACHE_INDEX_KEY_SIZE ? -1 : 0;
+}
+
+/**
+ * Describe the cache entry at `path` for the index.
+ *
+ * @return 0 on success, -1 if `path` is not in the cache, or too long
+ */
+
+static int index_entry(clib_cache_index_entry_t *entry, int kind,
+                       const char *key, const char *path, int64_t size,
+                       time_t inserted, const char *sha256) {
+  size_t base = strlen(base_cache_dir);
+  int length = 0;
+
+  memset(entry, 0, sizeof(clib_cache_index_entry_t));
+  entry->kind = kind;
+  entry->size = size;
+  entry->inserted = inserted;
+  entry->accessed = inserted;
+
+  if (0 != strncmp(base_cache_dir, path, base) || '/' != path[base] ||
+      strlen(key) >= CLIB_CACHE_INDEX_KEY_SIZE) {
+    return -1;
+  }
+
+  strcpy(entry->key, key);
+  length = snprintf(entry->location, CLIB_CACHE_INDEX_LOCATION_SIZE, "%s",
+                    path + base + 1);
+
+  if (sha256) {
+    memcpy(entry->sha256, sha256, CLIB_SHA256_HEX_SIZE);
   }
 
-  return fs_read(json_cache);
+  return length < 0 || length >= CLIB_CACHE_INDEX_LOCATION_SIZE ? -1 : 0;
 }
 
-int clib_cache_save_json(char *author, char *name, char *version,
-                         char *content) {
-  GET_JSON_CACHE(author, name, version);
+static void index_put(int kind, const char *key, const char *path,
+                      int64_t size, const char *sha256) {
+  clib_cache_index_entry_t entry;
 
-  return fs_write(json_cache, content);
+  if (0 == index_entry(&entry, kind, key, path, size, time(NULL), sha256)) {
+    clib_cache_index_put(cache_index, &entry);
+  }
 }
 
-int clib_cache_delete_json(char *author, char *name, char *version) {
-  GET_JSON_CACHE(author, name, version);
+/**
+ * Look up a manifest or package in the index, or on disk if the index does
+ * not know it, e.g. when it was cached by an older version of clib, and
+ * index it then. An entry that is on disk is found without a syscall.
+ *
+ * @return 0 if cached, -1 otherwise
+ */
+
+static int find_entry(int kind, char *author, char *name, char *version,
+                      clib_cache_index_entry_t *entry) {
+  char key[CLIB_CACHE_INDEX_KEY_SIZE];
+  char path[BUFSIZ];
+  struct stat st;
+  int indexed = 0 == index_key(key, author, name, version);
+
+  if (indexed && 0 == clib_cache_index_get(cache_index, kind, key, entry)) {
+    return 0;
+  }
 
-  return unlink(json_cache);
+  if (0 != (CLIB_CACHE_INDEX_JSON == kind
+                ? json_cache_path(path, author, name, version)
+                : package_entry_path(path, author, name, version)) ||
+      0 != stat(path, &st)) {
+    return -1;
+  }
+
+  if (0 != index_entry(entry, kind, indexed ? key : "", path,
+                       S_ISREG(st.st_mode) ? st.st_size : 0, st.st_mtime,
+                       NULL)) {
+    entry->inserted = st.st_mtime;
+    return 0;
+  }
+
+  clib_cache_index_put(cache_index, entry);
+
+  return 0;
 }
 
-int clib_cache_has_search(void) {
-  return 0 == fs_exists(search_cache) && !is_expired(search_cache);
+/**
+ * Entries of a commit, e.g. "author_name_<sha>", always hold the same
+ * files, and never expire.
+ */
+
+static int is_immutable_key(const char *key) {
+  size_t length = strlen(key);
+
+  return length > CLIB_REFS_COMMIT_SIZE &&
+         '_' == key[length - CLIB_REFS_COMMIT_SIZE] &&
+         clib_refs_is_commit(key + length - CLIB_REFS_COMMIT_SIZE + 1);
 }
 
-char *clib_cache_read_search(void) {
-  if (!clib_cache_has_search()) {
-    return NULL;
+static int is_expired_entry(clib_cache_index_entry_t *entry) {
+  return !is_immutable_key(entry->key) &&
+         time(NULL) - entry->inserted >= expiration;
+}
+
+/**
+ * @return 1 if the entry is still served, fresh or stale
+ */
+
+static int is_served_entry(clib_cache_index_entry_t *entry) {
+  return !is_expired_entry(entry) ||
+         time(NULL) - entry->inserted < expiration + max_stale;
+}
+
+static void touch_entry(int kind, char *author, char *name, char *version) {
+  char key[CLIB_CACHE_INDEX_KEY_SIZE];
+
+  if (0 == index_key(key, author, name, version)) {
+    clib_cache_index_touch(cache_index, kind, key, time(NULL));
   }
-  return fs_read(search_cache);
 }
 
-int clib_cache_save_search(char *content) {
-  return fs_write(search_cache, content);
+static void forget_entry(int kind, char *author, char *name, char *version) {
+  char key[CLIB_CACHE_INDEX_KEY_SIZE];
+
+  if (0 == index_key(key, author, name, version)) {
+    clib_cache_index_remove(cache_index, kind, key);
+  }
 }
 
-int clib_cache_delete_search(void) { return unlink(search_cache); }
+/**
+ * Add up the sizes of the files below a package directory being removed
+ * that are not linked from anywhere else. Called from the workers of the
+ * walk.
+ */
 
-int clib_cache_has_package(char *author, char *name, char *version) {
-  GET_PKG_CACHE(author, name, version);
+static int add_unlinked_size(int dir_fd, const char *name, const char *path,
+                             const struct stat *st, void *data) {
+  if (1 == st->st_nlink) {
+    __sync_add_and_fetch((int64_t *)data, (int64_t)st->st_size);
+  }
 
-  return 0 == fs_exists(pkg_cache) && !is_expired(pkg_cache);
+  return 0;
 }
 
-int clib_cache_is_expired_package(char *author, char *name, char *version) {
-  GET_PKG_CACHE(author, name, version);
+/**
+ * @return 1 if a file `changed` at that time may still be in use by a save,
+ * i.e. within `min_age` seconds, 0 otherwise. File times may be a second
+ * ahead of `time()`, so a `min_age` of 0 skips the comparison.
+ */
 
-  return is_expired(pkg_cache);
+static int is_recent(time_t changed, time_t now) {
+  return 0 < limits.min_age && now - changed < limits.min_age;
 }
 
-int clib_cache_save_package(char *author, char *name, char *version,
-                            char *pkg_dir) {
-  GET_PKG_CACHE(author, name, version);
+/**
+ * Remove the objects listed in the removed `tree` that are linked from no
+ * other package or project. Objects changed within `min_age` seconds are
+ * kept, a save may be about to link them.
+ *
+ * @return The bytes reclaimed
+ */
+
+static int64_t prune_objects(const char *tree) {
+  FILE *file = fopen(tree, "r");
+  time_t now = time(NULL);
+  char line[BUFSIZ];
+  int64_t size = 0;
+
+  if (NULL == file) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    char object[BUFSIZ];
+    struct stat st;
+
+    if (strlen(line) < 2 + CLIB_SHA256_HEX_SIZE || ' ' != line[1]) {
+      continue;
+    }
+
+    line[2 + CLIB_SHA256_HEX_SIZE - 1] = 0;
 
-  if (0 == fs_exists(pkg_cache)) {
-    rimraf(pkg_cache);
+    if (0 == object_path(object, line + 2, 'x' == line[0]) &&
+        0 == stat(object, &st) && 1 == st.st_nlink &&
+        !is_recent(st.st_ctime, now) && 0 == unlink(object)) {
+      size += st.st_size;
+    }
   }
 
-  return copy_dir(pkg_dir, pkg_cache);
+  fclose(file);
+  return size;
 }
 
-int clib_cache_load_package(char *author, char *name, char *version,
-                            char *target_dir) {
-  GET_PKG_CACHE(author, name, version);
+/**
+ * Remove the cached manifest of the package `key`.
+ *
+ * @param reclaimed Incremented with the bytes freed, if not NULL
+ *
+ * @return 0 on success, -1 if it was not cached
+ */
 
-  if (-1 == fs_exists(pkg_cache)) {
+static int remove_json(const char *key, int64_t *reclaimed) {
+  char json_cache[BUFSIZ];
+  char validators[BUFSIZ];
+  struct stat st;
+  int lock = -1;
+  int rc = -1;
+
+  if (0 != format_path(json_cache, "%s/%s.json", json_cache_dir, key) ||
+      0 != validators_path(validators, json_cache)) {
     return -1;
   }
 
-  if (is_expired(pkg_cache)) {
-    rimraf(pkg_cache);
+  lock = lock_entry(key, 1);
 
-    return -2;
+  if (0 == stat(json_cache, &st) && 0 == (rc = unlink(json_cache)) &&
+      reclaimed) {
+    *reclaimed += st.st_size;
   }
 
-  return copy_dir(pkg_cache, target_dir);
+  unlink(validators);
+
+  clib_cache_index_remove(cache_index, CLIB_CACHE_INDEX_JSON, key);
+  unlock_entry(key, lock);
+
+  return rc;
 }
 
-int clib_cache_delete_package(char *author, char *name, char *version) {
-  GET_PKG_CACHE(author, name, version);
+/**
+ * The tree and directory of a package moved out of the way, under the
+ * lock of the entry, to be removed once it is released.
+ */
+
+typedef struct {
+  char dir[BUFSIZ];  // empty if there was none
+  char tree[BUFSIZ]; // empty if there was none
+} package_trash_t;
+
+/**
+ * Move the tree and the directory of the package `key` out of the way.
+ * Called with the lock of the entry held.
+ *
+ * @return 1 if there was any, 0 otherwise
+ */
+
+static int trash_package(const char *key, package_trash_t *trash) {
+  char pkg_cache[BUFSIZ];
+  char tree_cache[BUFSIZ];
+
+  *trash->dir = *trash->tree = 0;
+
+  if (0 != format_path(pkg_cache, "%s/%s", package_cache_dir, key) ||
+      0 != format_path(tree_cache, "%s/%s", tree_cache_dir, key)) {
+    return 0;
+  }
+
+  if (0 != tmp_path(trash->tree, tree_cache) ||
+      0 != rename(tree_cache, trash->tree)) {
+    *trash->tree = 0;
+  }
+
+  if (0 != tmp_path(trash->dir, pkg_cache) ||
+      0 != rename(pkg_cache, trash->dir)) {
+    *trash->dir = 0;
+  }
+
+  return *trash->tree || *trash->dir;
+}
+
+/**
+ * Remove what `trash_package()` moved out of the way, and the objects no
+ * longer linked from anywhere else.
+ *
+ * @return The bytes reclaimed
+ */
+
+static int64_t empty_package_trash(package_trash_t *trash,
+                                   clib_pool_t *workers) {
+  int64_t size = 0;
+  struct stat st;
+
+  if (*trash->dir) {
+    // the files linked to the store are counted with the objects
+    clib_tree_walk(workers, trash->dir, add_unlinked_size, &size);
+    clib_tree_remove(workers, trash->dir);
+  }
+
+  if (*trash->tree) {
+    if (0 == stat(trash->tree, &st)) {
+      size += st.st_size;
+    }
+
+    size += prune_objects(trash->tree);
+    unlink(trash->tree);
+  }
+
+  return size;
+}
 
-  return rimraf(pkg_cache);
+/**
+ * Remove the cached package `key`: its pack, or its tree, its directory,
+ * and the objects no longer linked from anywhere else. They are moved out
+ * of the way under the lock, and removed once it is released.
+ *
+ * @param reclaimed Incremented with the bytes freed, if not NULL
+ *
+ * @return 0 if anything was removed, -1 otherwise
+ */
+
+static int remove_package(const char *key, clib_pool_t *workers,
+                          int64_t *reclaimed) {
+  package_trash_t trash;
+  char pack_cache[BUFSIZ];
+  char pack_trash[BUFSIZ];
+  int64_t size = 0;
+  struct stat st;
+  int has_pack = 0;
+  int has_tree = 0;
+  int lock = -1;
+
+  if (0 != format_path(pack_cache, "%s/%s" PACK_SUFFIX, pack_cache_dir, key) ||
+      0 != tmp_path(pack_trash, pack_cache)) {
+    return -1;
+  }
+
+  lock = lock_entry(key, 1);
+  has_pack = 0 == rename(pack_cache, pack_trash);
+  has_tree = trash_package(key, &trash);
+  clib_cache_index_remove(cache_index, CLIB_CACHE_INDEX_PACKAGE, key);
+  unlock_entry(key, lock);
+
+  if (has_pack) {
+    if (0 == stat(pack_trash, &st)) {
+      size += st.st_size;
+    }
+
+    unlink(pack_trash);
+  }
+
+  size += empty_package_trash(&trash, workers);
+
+  if (reclaimed) {
+    *reclaimed += size;
+  }
+
+  return has_pack || has_tree ? 0 : -1;
+}
+
+int clib_cache_has_json(char *author, char *name, char *version) {
+  clib_cache_index_entry_t entry;
+
+  return 0 == find_entry(CLIB_CACHE_INDEX_JSON, author, name, version,
+                         &entry) &&
+         is_served_entry(&entry);
+}
+
+char *clib_cache_read_json(char *author, char *name, char *version) {
+  GET_JSON_CACHE(author, name, version, NULL);
+  clib_cache_index_entry_t entry;
+  char *json = NULL;
+
+  if (0 != find_entry(CLIB_CACHE_INDEX_JSON, author, name, version, &entry) ||
+      !is_served_entry(&entry)) {
+    return NULL;
+  }
+
+  // removed behind the back of the index
+  if (NULL == (json = fs_read(json_cache))) {
+    forget_entry(CLIB_CACHE_INDEX_JSON, author, name, version);
+    return NULL;
+  }
+
+  touch_entry(CLIB_CACHE_INDEX_JSON, author, name, version);
+
+  return json;
+}
+
+int clib_cache_is_stale_json(char *author, char *name, char *version) {
+  clib_cache_index_entry_t entry;
+
+  return 0 == find_entry(CLIB_CACHE_INDEX_JSON, author, name, version,
+                         &entry) &&
+         is_expired_entry(&entry) && is_served_entry(&entry);
+}
+
+int clib_cache_save_json(char *author, char *name, char *version,
+                         char *content) {
+  return clib_cache_save_json_with_validators(author, name, version, content,
+                                              NULL);
+}
+
+int clib_cache_save_json_with_validators(
+    char *author, char *name, char *version, char *content,
+    const clib_cache_validators_t *validators) {
+  GET_JSON_CACHE(author, name, version, -1);
+  GET_ENTRY_KEY(author, name, version, -1);
+  char key[CLIB_CACHE_INDEX_KEY_SIZE];
+  char hash[CLIB_SHA256_HEX_SIZE];
+  clib_sha256_t ctx;
+  int lock = lock_entry(entry_key, 1);
+  int rc = publish_file(json_cache, content);
+
+  if (-1 != rc && 0 == index_key(key, author, name, version)) {
+    clib_sha256_init(&ctx);
+    clib_sha256_update(&ctx, content, strlen(content));
+    clib_sha256_final_hex(&ctx, hash);
+    index_put(CLIB_CACHE_INDEX_JSON, key, json_cache, rc, hash);
+  }
+
+  // the validators of another response are worse than none
+  if (-1 != rc) {
+    save_validators(json_cache, validators);
+  }
+
+  unlock_entry(entry_key, lock);
+
+  return rc;
+}
+
+char *clib_cache_read_stale_json(char *author, char *name, char *version,
+                                 clib_cache_validators_t *validators) {
+  GET_JSON_CACHE(author, name, version, NULL);
+  GET_ENTRY_KEY(author, name, version, NULL);
+  char *json = NULL;
+  int lock = lock_entry(entry_key, 0);
+
+  if (0 == read_validators(json_cache, validators)) {
+    json = fs_read(json_cache);
+  }
+
+  unlock_entry(entry_key, lock);
+
+  return json;
+}
+
+int clib_cache_renew_json(char *author, char *name, char *version) {
+  GET_JSON_CACHE(author, name, version, -1);
+  GET_ENTRY_KEY(author, name, version, -1);
+  clib_cache_index_entry_t entry;
+  int lock = lock_entry(entry_key, 1);
+  int rc = renew_file(json_cache);
+
+  // the index goes by the time of insertion, rebuilding it by the file's
+  if (0 == rc &&
+      0 == find_entry(CLIB_CACHE_INDEX_JSON, author, name, version, &entry)) {
+    entry.inserted = time(NULL);
+    entry.accessed = entry.inserted;
+    clib_cache_index_put(cache_index, &entry);
+  }
+
+  unlock_entry(entry_key, lock);
+
+  return rc;
+}
+
+int clib_cache_delete_json(char *author, char *name, char *version) {
+  GET_ENTRY_KEY(author, name, version, -1);
+
+  return remove_json(entry_key, NULL);
+}
+
+void clib_cache_set_missing_expiration(time_t exp) {
+  missing_expiration = exp;
+}
+
+int clib_cache_has_missing(char *author, char *name, char *version,
+                           const char *file) {
+  GET_MISSING_CACHE(author, name, version, file, 0);
+
+  if (0 != fs_exists(missing_cache)) {
+    return 0;
+  }
+
+  if (is_older_than(missing_cache, missing_expiration)) {
+    unlink(missing_cache);
+    return 0;
+  }
+
+  __sync_fetch_and_add(&stats.missing_hits, 1);
+  return 1;
+}
+
+int clib_cache_save_missing(char *author, char *name, char *version,
+                            const char *file) {
+  GET_MISSING_CACHE(author, name, version, file, -1);
+  GET_ENTRY_KEY(author, name, version, -1);
+  int lock = lock_entry(entry_key, 1);
+  int rc = -1 == publish_file(missing_cache, "") ? -1 : 0;
+
+  unlock_entry(entry_key, lock);
+
+  return rc;
+}
+
+int clib_cache_delete_missing(char *author, char *name, char *version,
+                              const char *file) {
+  GET_MISSING_CACHE(author, name, version, file, -1);
+  GET_ENTRY_KEY(author, name, version, -1);
+  int lock = lock_entry(entry_key, 1);
+  int rc = unlink(missing_cache);
+
+  unlock_entry(entry_key, lock);
+
+  return rc;
+}
+
+int clib_cache_read_ref(char *author, char *name, char *version,
+                        char *commit) {
+  char refs_cache[BUFSIZ];
+  char *content = NULL;
+  int rc = -1;
+
+  if (0 != format_path(refs_cache, PKG_CACHE_PATTERN, refs_cache_dir, author,
+                       name, version) ||
+      NULL == (content = fs_read(refs_cache))) {
+    return -1;
+  }
+
+  if (clib_refs_is_commit(content)) {
+    memcpy(commit, content, CLIB_REFS_COMMIT_SIZE);
+    rc = 0;
+  }
+
+  free(content);
+  return rc;
+}
+
+int clib_cache_save_ref(char *author, char *name, char *version,
+                        const char *commit) {
+  char refs_cache[BUFSIZ];
+
+  if (!clib_refs_is_commit(commit) ||
+      0 != format_path(refs_cache, PKG_CACHE_PATTERN, refs_cache_dir, author,
+                       name, version)) {
+    return -1;
+  }
+
+  return -1 == publish_file(refs_cache, commit) ? -1 : 0;
+}
+
+clib_cache_stats_t clib_cache_stats(void) { return stats; }
+
+int clib_cache_has_search(void) {
+  return 0 == fs_exists(search_cache) && is_served(search_cache);
+}
+
+int clib_cache_is_stale_search(void) {
+  return 0 == fs_exists(search_cache) && 1 == is_expired(search_cache) &&
+         is_served(search_cache);
+}
+
+char *clib_cache_read_search(void) {
+  if (!clib_cache_has_search()) {
+    return NULL;
+  }
+  return fs_read(search_cache);
+}
+
+int clib_cache_save_search(char *content) {
+  return clib_cache_save_search_with_validators(content, NULL);
+}
+
+int clib_cache_save_search_with_validators(
+    char *content, const clib_cache_validators_t *validators) {
+  int rc = publish_file(search_cache, content);
+
+  if (-1 != rc) {
+    save_validators(search_cache, validators);
+  }
+
+  return rc;
+}
+
+char *clib_cache_read_stale_search(clib_cache_validators_t *validators) {
+  // read before the content, an older response is revalidated in full
+  if (0 != read_validators(search_cache, validators)) {
+    return NULL;
+  }
+
+  return fs_read(search_cache);
+}
+
+int clib_cache_renew_search(void) { return renew_file(search_cache); }
+
+int clib_cache_delete_search(void) {
+  save_validators(search_cache, NULL);
+
+  return unlink(search_cache);
+}
+
+static int meta_path(char *path, const char *name) {
+  if (!*meta_cache_dir && 0 != clib_cache_meta_init()) {
+    return -1;
+  }
+
+  return format_path(path, "%s/%s", meta_cache_dir, name);
+}
+
+char *clib_cache_read_meta(const char *name,
+                           clib_cache_validators_t *validators) {
+  clib_cache_validators_t none;
+  char path[BUFSIZ];
+
+  if (0 != meta_path(path, name)) {
+    return NULL;
+  }
+
+  read_validators(path, validators ? validators : &none);
+
+  return fs_read(path);
+}
+
+int clib_cache_save_meta(const char *name, const char *content,
+                         const clib_cache_validators_t *validators) {
+  char path[BUFSIZ];
+
+  if (0 != meta_path(path, name) || -1 == publish_file(path, content)) {
+    return -1;
+  }
+
+  return save_validators(path, validators);
+}
+
+int clib_cache_has_package(char *author, char *name, char *version) {
+  clib_cache_index_entry_t entry;
+
+  return 0 == find_entry(CLIB_CACHE_INDEX_PACKAGE, author, name, version,
+                         &entry) &&
+         !is_expired_entry(&entry);
+}
+
+int clib_cache_is_expired_package(char *author, char *name, char *version) {
+  clib_cache_index_entry_t entry;
+
+  if (0 != find_entry(CLIB_CACHE_INDEX_PACKAGE, author, name, version,
+                      &entry)) {
+    return -1;
+  }
+
+  return is_expired_entry(&entry);
+}
+
+/**
+ * Make `path` below `dir_fd` a hard link to `object`, or a copy if the
+ * filesystem refuses, e.g. once an object reached the link limit.
+ * `copy_file_at()` clones it where the filesystem supports that.
+ * `path` is replaced atomically, and never written through: other
+ * packages may share its current inode.
+ */
+
+static int place_object(const char *object, int dir_fd, const char *path,
+                        int executable) {
+  struct stat from;
+  struct stat to;
+  char tmp[BUFSIZ];
+  int rc = -1;
+
+  // linked already
+  if (0 == stat(object, &from) && 0 == fstatat(dir_fd, path, &to, 0) &&
+      from.st_dev == to.st_dev && from.st_ino == to.st_ino) {
+    return 0;
+  }
+
+  if (0 != format_path(tmp, "%s.clib-tmp", path)) {
+    return -1;
+  }
+
+  unlinkat(dir_fd, tmp, 0);
+
+#ifndef _WIN32
+  rc = linkat(AT_FDCWD, object, dir_fd, tmp, 0);
+#endif
+
+  if (0 != rc &&
+      0 == (rc = copy_file_at(AT_FDCWD, (char *)object, dir_fd, tmp))) {
+    fchmodat(dir_fd, tmp, executable ? 0755 : 0644, 0);
+  }
+
+  if (0 == rc) {
+    rc = renameat(dir_fd, tmp, dir_fd, path);
+  }
+
+  // left behind if `path` turned out to be another link to the object
+  unlinkat(dir_fd, tmp, 0);
+
+  return rc;
+}
+
+static int hash_file_at(int dir_fd, const char *name, char *hash) {
+  clib_sha256_t ctx;
+  int fd = -1;
+  int rc = -1;
+
+  clib_sha256_init(&ctx);
+
+  if (-1 == (fd = openat(dir_fd, name, O_RDONLY))) {
+    return -1;
+  }
+
+  rc = clib_sha256_update_fd(&ctx, fd);
+  close(fd);
+
+  if (0 == rc) {
+    clib_sha256_final_hex(&ctx, hash);
+  }
+
+  return rc;
+}
+
+/**
+ * Add a copy of the file `name` below `dir_fd` to the store, a clone where
+ * the filesystem supports that, and get its `hash`. The file itself never
+ * becomes an object: it belongs to the project, which may still write to
+ * it or change its mode. The object is named after what was copied, the
+ * file may change meanwhile, e.g. while saved in the background.
+ */
+
+static int store_object(int dir_fd, const char *name, const struct stat *st,
+                        char *hash) {
+#ifndef _WIN32
+  const struct timespec touch[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+#endif
+  int executable = 0 != (st->st_mode & S_IXUSR);
+  char fan_out[BUFSIZ];
+  char object[BUFSIZ];
+  char tmp[BUFSIZ];
+  int rc = -1;
+
+  if (0 != hash_file_at(dir_fd, name, hash) ||
+      0 != object_path(object, hash, executable)) {
+    return -1;
+  }
+
+#ifdef _WIN32
+  if (0 == fs_exists(object)) {
+    return 0;
+  }
+#else
+  // its change time keeps it from being pruned before it is linked, it is
+  // stored again if it was pruned already
+  if (0 == utimensat(AT_FDCWD, object, touch, 0)) {
+    return 0;
+  }
+#endif
+
+  if (0 != format_path(fan_out, "%s/%.2s", store_dir, hash) ||
+      0 != check_dir(fan_out) || 0 != tmp_path(tmp, object)) {
+    return -1;
+  }
+
+  if (0 != copy_file_at(dir_fd, (char *)name, AT_FDCWD, tmp)) {
+    unlink(tmp);
+    return -1;
+  }
+
+  // the copy is hashed again, it is what the object holds
+  if (0 != hash_file_at(AT_FDCWD, tmp, hash) ||
+      0 != object_path(object, hash, executable) ||
+      0 != format_path(fan_out, "%s/%.2s", store_dir, hash) ||
+      0 != check_dir(fan_out)) {
+    goto done;
+  }
+
+  // objects are shared by every package linked to them
+  chmod(tmp, executable ? 0555 : 0444);
+  rc = rename(tmp, object);
+
+done:
+  if (0 != rc) {
+    unlink(tmp);
+  }
+
+  return rc;
+}
+
+typedef struct {
+  FILE *file;
+  int64_t size; // of the files listed
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+#endif
+} tree_writer_t;
+
+/**
+ * Store a file of a package being saved, list it in its tree, and replace
+ * it with a link to the store. Called from the workers of the walk.
+ */
+
+static int store_file(int dir_fd, const char *name, const char *path,
+                      const struct stat *st, void *data) {
+  tree_writer_t *tree = data;
+  int executable = 0 != (st->st_mode & S_IXUSR);
+  char hash[CLIB_SHA256_HEX_SIZE];
+  char object[BUFSIZ];
+
+  if (0 != store_object(dir_fd, name, st, hash)) {
+    return -1;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&tree->mutex);
+#endif
+  fprintf(tree->file, "%c %s %s\n", executable ? 'x' : '-', hash, path);
+  tree->size += st->st_size;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&tree->mutex);
+#endif
+
+  if (0 == object_path(object, hash, executable)) {
+    place_object(object, dir_fd, name, executable);
+  }
+
+  return 0;
+}
+
+typedef struct {
+  clib_pool_t *pool;
+  int dir_fd;
+  int rc;
+  clib_pool_group_t group;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+#endif
+} checkout_t;
+
+typedef struct {
+  checkout_t *checkout;
+  int count;
+  char *lines[CLIB_TREE_BATCH];
+} checkout_batch_t;
+
+/**
+ * Place the files of a batch of tree lines, already split into the kind
+ * of file, its hash and its path.
+ */
+
+static void checkout_batch(void *data) {
+  checkout_batch_t *batch = data;
+  checkout_t *checkout = batch->checkout;
+  int rc = 0;
+
+  for (int i = 0; i < batch->count; i++) {
+    char *line = batch->lines[i];
+    char object[BUFSIZ];
+
+    if (0 == rc && 0 == (rc = object_path(object, line + 2, 'x' == line[0]))) {
+      rc = place_object(object, checkout->dir_fd,
+                        line + 2 + CLIB_SHA256_HEX_SIZE, 'x' == line[0]);
+    }
+
+    free(line);
+  }
+
+  if (0 != rc) {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&checkout->mutex);
+#endif
+    checkout->rc = rc;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&checkout->mutex);
+#endif
+  }
+
+  free(batch);
+}
+
+static void submit_checkout_batch(checkout_batch_t *batch) {
+  clib_pool_t *workers = batch->checkout->pool;
+
+  if (NULL == workers || 0 != clib_pool_submit(workers, &batch->checkout->group,
+                                               checkout_batch, batch)) {
+    checkout_batch(batch);
+  }
+}
+
+/**
+ * Create the files listed in `tree` below `target_dir` from the store. The
+ * directories are created up front, the files are placed in parallel on
+ * `workers`, if any.
+ */
+
+static int checkout_tree(const char *tree, const char *target_dir,
+                         clib_pool_t *workers) {
+  checkout_batch_t *batch = NULL;
+  char line[BUFSIZ];
+  char dir[BUFSIZ] = "";
+  checkout_t checkout;
+  FILE *file = fopen(tree, "r");
+  int rc = 0;
+
+  if (NULL == file) {
+    return -1;
+  }
+
+  if (NULL == fgets(line, sizeof(line), file) ||
+      0 != strcmp(TREE_HEADER, line) ||
+      -1 == (checkout.dir_fd = open(target_dir, O_RDONLY | O_DIRECTORY))) {
+    fclose(file);
+    return -1;
+  }
+
+  checkout.pool = workers;
+  checkout.rc = 0;
+  clib_pool_group_init(&checkout.group);
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&checkout.mutex, NULL);
+#endif
+
+  while (0 == rc && fgets(line, sizeof(line), file)) {
+    char path[BUFSIZ];
+    char *hash = line + 2;
+    char *relative = NULL;
+    char *slash = NULL;
+    size_t length = strlen(line);
+
+    if (length < 2 + CLIB_SHA256_HEX_SIZE + 1 || '\n' != line[length - 1]) {
+      rc = -1;
+      break;
+    }
+
+    line[length - 1] = 0;
+    hash[CLIB_SHA256_HEX_SIZE - 1] = 0;
+    relative = hash + CLIB_SHA256_HEX_SIZE;
+
+    // most lines are in the directory of the line before
+    if ((slash = strrchr(relative, '/')) &&
+        (strlen(dir) != (size_t)(slash - relative) ||
+         0 != strncmp(dir, relative, slash - relative))) {
+      *slash = 0;
+
+      if (0 != format_path(path, "%s/%s", target_dir, relative) ||
+          0 != format_path(dir, "%s", relative) || 0 != check_dir(path)) {
+        rc = -1;
+        break;
+      }
+
+      *slash = '/';
+    }
+
+    if (NULL == batch && NULL == (batch = calloc(1, sizeof(*batch)))) {
+      rc = -1;
+      break;
+    }
+
+    batch->checkout = &checkout;
+
+    if (NULL == (batch->lines[batch->count] = malloc(length))) {
+      rc = -1;
+      break;
+    }
+
+    memcpy(batch->lines[batch->count++], line, length);
+
+    if (CLIB_TREE_BATCH == batch->count) {
+      submit_checkout_batch(batch);
+      batch = NULL;
+    }
+  }
+
+  if (batch) {
+    submit_checkout_batch(batch);
+  }
+
+  if (workers) {
+    clib_pool_group_wait(workers, &checkout.group);
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_destroy(&checkout.mutex);
+#endif
+
+  close(checkout.dir_fd);
+  fclose(file);
+
+  return 0 != rc ? rc : checkout.rc;
+}
+
+void clib_cache_set_pool(clib_pool_t *workers) { pool = workers; }
+
+int clib_cache_claim_package(char *author, char *name, char *version) {
+  GET_ENTRY_KEY(author, name, version, -1);
+  int claim = lock_file(entry_key, "claim", 1);
+
+  if (-1 != claim) {
+    __sync_add_and_fetch(&claims[entry_index(entry_key)], 1);
+  }
+
+  return claim;
+}
+
+void clib_cache_release_package(char *author, char *name, char *version,
+                                int claim) {
+  char entry_key[BUFSIZ];
+
+  if (-1 == claim) {
+    return;
+  }
+
+  if (0 == format_path(entry_key, ENTRY_KEY_PATTERN, author, name, version)) {
+    __sync_sub_and_fetch(&claims[entry_index(entry_key)], 1);
+  }
+
+  close(claim);
+}
+
+/**
+ * Save the package at `pkg_dir` as a single pack, in place of the tree and
+ * directory of an earlier save, if any.
+ */
+
+static int save_pack(char *author, char *name, char *version, char *pkg_dir,
+                     clib_pool_t *workers) {
+  GET_PACK_CACHE(author, name, version, -1);
+  GET_ENTRY_KEY(author, name, version, -1);
+  char key[CLIB_CACHE_INDEX_KEY_SIZE];
+  char hash[CLIB_SHA256_HEX_SIZE] = "";
+  package_trash_t trash;
+  clib_sha256_t ctx;
+  char tmp_pack[BUFSIZ];
+  struct stat st;
+  int lock = -1;
+  int rc = 0;
+
+  if (0 != tmp_path(tmp_pack, pack_cache)) {
+    return -1;
+  }
+
+  // built aside and swapped in
+  if (0 != clib_pack_write(workers, pkg_dir, tmp_pack) ||
+      0 != stat(tmp_pack, &st)) {
+    unlink(tmp_pack);
+    return -1;
+  }
+
+  clib_sha256_init(&ctx);
+
+  if (0 == clib_sha256_update_file(&ctx, tmp_pack)) {
+    clib_sha256_final_hex(&ctx, hash);
+  }
+
+  lock = lock_entry(entry_key, 1);
+
+  if (0 != rename(tmp_pack, pack_cache)) {
+    *trash.dir = *trash.tree = 0;
+    rc = -1;
+  } else {
+    trash_package(entry_key, &trash);
+  }
+
+  if (0 == index_key(key, author, name, version)) {
+    if (0 == rc) {
+      index_put(CLIB_CACHE_INDEX_PACKAGE, key, pack_cache, st.st_size, hash);
+    } else {
+      clib_cache_index_remove(cache_index, CLIB_CACHE_INDEX_PACKAGE, key);
+    }
+  }
+
+  unlock_entry(entry_key, lock);
+
+  unlink(tmp_pack);
+  empty_package_trash(&trash, workers);
+
+  return rc;
+}
+
+static int save_package(char *author, char *name, char *version,
+                        char *pkg_dir, clib_pool_t *workers) {
+  if (packed) {
+    return save_pack(author, name, version, pkg_dir, workers);
+  }
+
+  GET_PKG_CACHE(author, name, version, -1);
+  GET_PACK_CACHE(author, name, version, -1);
+  GET_TREE_CACHE(author, name, version, -1);
+  GET_ENTRY_KEY(author, name, version, -1);
+  char key[CLIB_CACHE_INDEX_KEY_SIZE];
+  char hash[CLIB_SHA256_HEX_SIZE] = "";
+  tree_writer_t tree;
+  clib_sha256_t ctx;
+  char tmp_tree[BUFSIZ];
+  char tmp_dir[BUFSIZ];
+  char trash[BUFSIZ] = "";
+  int lock = -1;
+  int rc = 0;
+
+  if (0 != tmp_path(tmp_tree, tree_cache) ||
+      0 != tmp_path(tmp_dir, pkg_cache) ||
+      NULL == (tree.file = fopen(tmp_tree, "w"))) {
+    return -1;
+  }
+
+  tree.size = 0;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&tree.mutex, NULL);
+#endif
+
+  // the store is shared and only ever added to, no lock needed
+  fputs(TREE_HEADER, tree.file);
+  rc = clib_tree_walk(workers, pkg_dir, store_file, &tree);
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_destroy(&tree.mutex);
+#endif
+
+  if (0 != fclose(tree.file) || 0 != rc) {
+    rc = -1;
+    goto cleanup;
+  }
+
+  clib_sha256_init(&ctx);
+
+  if (0 == clib_sha256_update_file(&ctx, tmp_tree)) {
+    clib_sha256_final_hex(&ctx, hash);
+  }
+
+  // kept as a tree of links, which older versions of clib read directly,
+  // built aside and swapped in
+  if (0 != mkdir(tmp_dir, 0700) ||
+      0 != checkout_tree(tmp_tree, tmp_dir, workers)) {
+    rc = -1;
+    goto cleanup;
+  }
+
+  lock = lock_entry(entry_key, 1);
+
+  // saved as a pack before, which would be loaded instead
+  unlink(pack_cache);
+
+  // the directory can only be replaced in two steps, readers go by the tree
+  if (0 != rename(tmp_tree, tree_cache)) {
+    rc = -1;
+  } else if (0 == fs_exists(pkg_cache) && (0 != tmp_path(trash, pkg_cache) ||
+                                           0 != rename(pkg_cache, trash))) {
+    *trash = 0;
+    rc = -1;
+  } else if (0 != rename(tmp_dir, pkg_cache)) {
+    rc = -1;
+  }
+
+  if (0 == index_key(key, author, name, version)) {
+    if (0 == rc) {
+      index_put(CLIB_CACHE_INDEX_PACKAGE, key, tree_cache, tree.size, hash);
+    } else {
+      clib_cache_index_remove(cache_index, CLIB_CACHE_INDEX_PACKAGE, key);
+    }
+  }
+
+  unlock_entry(entry_key, lock);
+
+cleanup:
+  unlink(tmp_tree);
+
+  if (0 == fs_exists(tmp_dir)) {
+    clib_tree_remove(workers, tmp_dir);
+  }
+
+  // out of the way already, removed without holding the lock
+  if (*trash) {
+    clib_tree_remove(workers, trash);
+  }
+
+  return rc;
+}
+
+int clib_cache_save_package(char *author, char *name, char *version,
+                            char *pkg_dir) {
+  GET_ENTRY_KEY(author, name, version, -1);
+
+  return save_package(author, name, version, pkg_dir, entry_pool(entry_key));
+}
+
+/**
+ * A save handed to the writer, of a snapshot of the package.
+ */
+
+typedef struct cache_write {
+  char *author;
+  char *name;
+  char *version;
+  char *snapshot;
+  int claim;
+  struct cache_write *next;
+} cache_write_t;
+
+#ifdef HAVE_PTHREADS
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; // a save was queued or is done, or the writer stops
+  pthread_t thread;
+  int started;
+  int stopping;
+  int pending; // queued, or being saved
+  cache_write_t *head;
+  cache_write_t *tail;
+} writer = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void free_write(cache_write_t *write) {
+  free(write->author);
+  free(write->name);
+  free(write->version);
+  free(write->snapshot);
+  free(write);
+}
+
+static cache_write_t *new_write(char *author, char *name, char *version,
+                                char *snapshot, int claim) {
+  cache_write_t *write = calloc(1, sizeof(cache_write_t));
+
+  if (NULL == write) {
+    return NULL;
+  }
+
+  write->claim = claim;
+  write->author = strdup(author);
+  write->name = strdup(name);
+  write->version = strdup(version);
+  write->snapshot = strdup(snapshot);
+
+  if (!write->author || !write->name || !write->version || !write->snapshot) {
+    free_write(write);
+    return NULL;
+  }
+
+  return write;
+}
+
+/**
+ * Save a snapshot, then remove it and release its claim. Not on the pool:
+ * waiting for it runs installs, which may wait for the claim.
+ */
+
+static int write_package(cache_write_t *write) {
+  int rc = save_package(write->author, write->name, write->version,
+                        write->snapshot, NULL);
+
+  clib_tree_remove(NULL, write->snapshot);
+  clib_cache_release_package(write->author, write->name, write->version,
+                             write->claim);
+  free_write(write);
+
+  return rc;
+}
+
+static void *run_writer(void *data) {
+  (void)data;
+
+  pthread_mutex_lock(&writer.mutex);
+
+  for (;;) {
+    cache_write_t *write = writer.head;
+
+    if (NULL == write) {
+      if (writer.stopping) {
+        break;
+      }
+
+      pthread_cond_wait(&writer.cond, &writer.mutex);
+      continue;
+    }
+
+    if (NULL == (writer.head = write->next)) {
+      writer.tail = NULL;
+    }
+
+    pthread_mutex_unlock(&writer.mutex);
+    write_package(write);
+    pthread_mutex_lock(&writer.mutex);
+
+    writer.pending--;
+    pthread_cond_broadcast(&writer.cond);
+  }
+
+  pthread_mutex_unlock(&writer.mutex);
+  return NULL;
+}
+
+/**
+ * Let the writer save what is queued, then wait for it to stop.
+ */
+
+static void stop_writer(void) {
+  pthread_mutex_lock(&writer.mutex);
+  writer.stopping = 1;
+  pthread_cond_broadcast(&writer.cond);
+  pthread_mutex_unlock(&writer.mutex);
+
+  pthread_join(writer.thread, NULL);
+}
+
+/**
+ * Queue `write` for the writer, started on first use, once fewer than
+ * `CLIB_CACHE_WRITE_QUEUE` saves are pending.
+ *
+ * @return 0 on success, -1 if there is no writer
+ */
+
+static int queue_write(cache_write_t *write) {
+  int rc = 0;
+
+  pthread_mutex_lock(&writer.mutex);
+
+  while (writer.pending >= CLIB_CACHE_WRITE_QUEUE) {
+    pthread_cond_wait(&writer.cond, &writer.mutex);
+  }
+
+  if (!writer.started && !writer.stopping &&
+      0 == pthread_create(&writer.thread, NULL, run_writer, NULL)) {
+    writer.started = 1;
+    atexit(stop_writer);
+  }
+
+  if (writer.started && !writer.stopping) {
+    if (writer.tail) {
+      writer.tail->next = write;
+    } else {
+      writer.head = write;
+    }
+
+    writer.tail = write;
+    writer.pending++;
+    pthread_cond_broadcast(&writer.cond);
+  } else {
+    rc = -1;
+  }
+
+  pthread_mutex_unlock(&writer.mutex);
+  return rc;
+}
+#endif
+
+int clib_cache_save_package_async(char *author, char *name, char *version,
+                                  char *pkg_dir, int claim) {
+  char entry_key[BUFSIZ];
+  int rc = -1;
+
+  if (0 != format_path(entry_key, ENTRY_KEY_PATTERN, author, name, version)) {
+    clib_cache_release_package(author, name, version, claim);
+    return -1;
+  }
+
+#ifdef HAVE_PTHREADS
+  char pkg_cache[BUFSIZ];
+  char snapshot[BUFSIZ];
+  cache_write_t *write = NULL;
+
+  if (0 != package_cache_path(pkg_cache, author, name, version) ||
+      0 != tmp_path(snapshot, pkg_cache) ||
+      NULL == (write = new_write(author, name, version, snapshot, claim))) {
+    goto sync;
+  }
+
+  // links only, the install goes on while the files are stored
+  if (0 != clib_tree_link(entry_pool(entry_key), pkg_dir, snapshot)) {
+    clib_tree_remove(NULL, snapshot);
+    free_write(write);
+    goto sync;
+  }
+
+  if (0 == queue_write(write)) {
+    return 0;
+  }
+
+  return write_package(write);
+
+sync:
+#endif
+  rc = save_package(author, name, version, pkg_dir, entry_pool(entry_key));
+  clib_cache_release_package(author, name, version, claim);
+
+  return rc;
+}
+
+void clib_cache_flush(void) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&writer.mutex);
+
+  while (writer.pending > 0) {
+    pthread_cond_wait(&writer.cond, &writer.mutex);
+  }
+
+  pthread_mutex_unlock(&writer.mutex);
+#endif
+}
+
+int clib_cache_load_package(char *author, char *name, char *version,
+                            char *target_dir) {
+  GET_PKG_CACHE(author, name, version, -1);
+  GET_PACK_CACHE(author, name, version, -1);
+  GET_TREE_CACHE(author, name, version, -1);
+  GET_ENTRY_KEY(author, name, version, -1);
+  clib_cache_index_entry_t entry;
+  int lock = -1;
+  int rc = -1;
+
+  if (0 != find_entry(CLIB_CACHE_INDEX_PACKAGE, author, name, version,
+                      &entry)) {
+    return -1;
+  }
+
+  if (is_expired_entry(&entry)) {
+    clib_cache_delete_package(author, name, version);
+
+    return -2;
+  }
+
+  if (0 != check_dir(target_dir)) {
+    return -1;
+  }
+
+  // packs are replaced with a rename and read at once, lock-free; one that
+  // cannot be read, e.g. deflated while zlib is not available, is fetched
+  // and saved again
+  if (0 == fs_exists(pack_cache)) {
+    if (0 != clib_pack_extract(pack_cache, target_dir)) {
+      return -1;
+    }
+
+    touch_entry(CLIB_CACHE_INDEX_PACKAGE, author, name, version);
+    return 0;
+  }
+
+  // trees are replaced with a rename and objects never change, lock-free
+  if (0 == checkout_tree(tree_cache, target_dir, entry_pool(entry_key))) {
+    touch_entry(CLIB_CACHE_INDEX_PACKAGE, author, name, version);
+    return 0;
+  }
+
+  // cached by an older version, or an object is gone; not on the pool,
+  // which must not be waited for with a lock held
+  lock = lock_entry(entry_key, 0);
+  rc = clib_tree_copy(NULL, pkg_cache, target_dir);
+  unlock_entry(entry_key, lock);
+
+  if (0 == rc) {
+    touch_entry(CLIB_CACHE_INDEX_PACKAGE, author, name, version);
+  }
+
+  return rc;
+}
+
+int clib_cache_delete_package(char *author, char *name, char *version) {
+  GET_ENTRY_KEY(author, name, version, -1);
+
+  return remove_package(entry_key, entry_pool(entry_key), NULL);
+}
+
+/**
+ * Sum up the sizes of the objects listed in `tree`.
+ */
+
+static int64_t tree_size(const char *tree) {
+  FILE *file = fopen(tree, "r");
+  char line[BUFSIZ];
+  int64_t size = 0;
+
+  if (NULL == file) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    char object[BUFSIZ];
+    struct stat st;
+
+    if (strlen(line) < 2 + CLIB_SHA256_HEX_SIZE || ' ' != line[1]) {
+      continue;
+    }
+
+    line[2 + CLIB_SHA256_HEX_SIZE - 1] = 0;
+
+    if (0 == object_path(object, line + 2, 'x' == line[0]) &&
+        0 == stat(object, &st)) {
+      size += st.st_size;
+    }
+  }
+
+  fclose(file);
+  return size;
+}
+
+/**
+ * Index the entries of one of the cache directories, see `fill_index()`.
+ */
+
+static int fill_index_dir(clib_cache_index_t *index, int kind,
+                          const char *dir, const char *suffix) {
+  struct dirent *file = NULL;
+  DIR *handle = opendir(dir);
+
+  if (NULL == handle) {
+    return 0;
+  }
+
+  while ((file = readdir(handle))) {
+    clib_cache_index_entry_t entry;
+    char key[CLIB_CACHE_INDEX_KEY_SIZE];
+    char hash[CLIB_SHA256_HEX_SIZE] = "";
+    char path[BUFSIZ];
+    char tree[BUFSIZ];
+    size_t length = strlen(file->d_name);
+    size_t suffix_length = strlen(suffix);
+    int64_t size = 0;
+    clib_sha256_t ctx;
+    struct stat st;
+
+    // hidden files, and the temporary files of writers
+    if ('.' == file->d_name[0] || length <= suffix_length ||
+        0 != strcmp(suffix, file->d_name + length - suffix_length) ||
+        (length > 4 && 0 == strcmp(".tmp", file->d_name + length - 4)) ||
+        length - suffix_length >= sizeof(key)) {
+      continue;
+    }
+
+    memcpy(key, file->d_name, length - suffix_length);
+    key[length - suffix_length] = 0;
+
+    if (0 != format_path(path, "%s/%s", dir, file->d_name) ||
+        0 != stat(path, &st)) {
+      continue;
+    }
+
+    if (dir == package_cache_dir) {
+      // indexed by its tree or its pack already
+      if ((0 == format_path(tree, "%s/%s", tree_cache_dir, key) &&
+           0 == fs_exists(tree)) ||
+          (0 == format_path(tree, "%s/%s" PACK_SUFFIX, pack_cache_dir, key) &&
+           0 == fs_exists(tree))) {
+        continue;
+      }
+    } else {
+      clib_sha256_init(&ctx);
+
+      if (0 == clib_sha256_update_file(&ctx, path)) {
+        clib_sha256_final_hex(&ctx, hash);
+      }
+
+      size = dir == tree_cache_dir ? tree_size(path) : st.st_size;
+    }
+
+    if (0 == index_entry(&entry, kind, key, path, size, st.st_mtime, hash) &&
+        0 != clib_cache_index_put(index, &entry)) {
+      closedir(handle);
+      return -1;
+    }
+  }
+
+  closedir(handle);
+  return 0;
+}
+
+/**
+ * Index what is in the cache, when there is no index yet or it has to be
+ * rebuilt.
+ */
+
+static int fill_index(clib_cache_index_t *index, void *data) {
+  (void)data;
+
+  if (0 != fill_index_dir(index, CLIB_CACHE_INDEX_JSON, json_cache_dir,
+                          ".json") ||
+      0 != fill_index_dir(index, CLIB_CACHE_INDEX_PACKAGE, tree_cache_dir,
+                          "") ||
+      0 != fill_index_dir(index, CLIB_CACHE_INDEX_PACKAGE, pack_cache_dir,
+                          PACK_SUFFIX) ||
+      0 != fill_index_dir(index, CLIB_CACHE_INDEX_PACKAGE, package_cache_dir,
+                          "")) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void clib_cache_set_limits(clib_cache_limits_t bounds) { limits = bounds; }
+
+clib_cache_limits_t clib_cache_limits(void) { return limits; }
+
+int clib_cache_parse_size(const char *string, int64_t *size) {
+  char *end = NULL;
+  long long value = strtoll(string, &end, 10);
+  int shift = 0;
+
+  if (end == string || value < 0) {
+    return -1;
+  }
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    shift = 10;
+    break;
+  case 'm':
+  case 'M':
+    shift = 20;
+    break;
+  case 'g':
+  case 'G':
+    shift = 30;
+    break;
+  case 0:
+    break;
+  default:
+    return -1;
+  }
+
+  if (shift && 0 != end[1] && 0 != strcasecmp("b", end + 1) &&
+      0 != strcasecmp("ib", end + 1)) {
+    return -1;
+  }
+
+  if (value > (INT64_MAX >> shift)) {
+    return -1;
+  }
+
+  *size = (int64_t)value << shift;
+  return 0;
+}
+
+/**
+ * What eviction needs to know of an indexed entry.
+ */
+
+typedef struct {
+  int kind;
+  int expired;
+  int64_t size;
+  int64_t accessed;
+  char key[CLIB_CACHE_INDEX_KEY_SIZE];
+} gc_entry_t;
+
+typedef struct {
+  gc_entry_t *entries;
+  long count;
+  long capacity;
+  int64_t size;
+} gc_list_t;
+
+static int collect_entry(const clib_cache_index_entry_t *entry, void *data) {
+  gc_list_t *list = data;
+  gc_entry_t *collected = NULL;
+
+  if (list->count == list->capacity) {
+    long capacity = list->capacity ? 2 * list->capacity : 256;
+    gc_entry_t *entries =
+        realloc(list->entries, capacity * sizeof(gc_entry_t));
+
+    if (NULL == entries) {
+      return -1;
+    }
+
+    list->entries = entries;
+    list->capacity = capacity;
+  }
+
+  collected = &list->entries[list->count++];
+  collected->kind = entry->kind;
+  collected->expired = is_expired_entry((clib_cache_index_entry_t *)entry);
+  collected->size = entry->size;
+  collected->accessed = entry->accessed;
+  strcpy(collected->key, entry->key);
+  list->size += entry->size;
+
+  return 0;
+}
+
+/**
+ * Expired entries first, then the least recently used.
+ */
+
+static int compare_entries(const void *a, const void *b) {
+  const gc_entry_t *left = a;
+  const gc_entry_t *right = b;
+
+  if (left->expired != right->expired) {
+    return right->expired - left->expired;
+  }
+
+  if (left->accessed != right->accessed) {
+    return left->accessed < right->accessed ? -1 : 1;
+  }
+
+  return strcmp(left->key, right->key);
+}
+
+static int is_over_limits(gc_list_t *list) {
+  return (limits.max_size > 0 && list->size > limits.max_size) ||
+         (limits.max_entries > 0 && list->count > limits.max_entries);
+}
+
+static const char *lock_kinds[] = {"lock", "claim", NULL};
+
+/**
+ * Remove the lock file of `kind` of `key` if no entry of the key is left
+ * and nobody holds or waits for it. It is locked first, and removed only if
+ * it is still the file at its path: a process that was waiting for it
+ * locks the one created in its place, see `lock_file()`.
+ */
+
+static void remove_lock_file(const char *key, const char *kind) {
+#ifndef _WIN32
+  char path[BUFSIZ];
+  int fd = -1;
+
+  if (0 != lock_path(path, key, kind) ||
+      -1 == (fd = open(path, O_RDWR | O_CLOEXEC))) {
+    return;
+  }
+
+  // no entry is saved meanwhile, saving takes the lock
+  if (0 == flock(fd, LOCK_EX | LOCK_NB) && is_lock_file(fd, path) &&
+      0 != clib_cache_index_get(cache_index, CLIB_CACHE_INDEX_JSON, key,
+                                NULL) &&
+      0 != clib_cache_index_get(cache_index, CLIB_CACHE_INDEX_PACKAGE, key,
+                                NULL)) {
+    unlink(path);
+  }
+
+  close(fd);
+#endif
+}
+
+static void remove_lock_files(const char *key) {
+  for (int i = 0; NULL != lock_kinds[i]; i++) {
+    remove_lock_file(key, lock_kinds[i]);
+  }
+}
+
+/**
+ * Remove the lock files left behind by entries removed otherwise than by
+ * eviction, e.g. deleted, or by older versions of clib.
+ */
+
+static void prune_locks(void) {
+  struct dirent *file = NULL;
+  DIR *handle = opendir(lock_dir);
+
+  if (NULL == handle) {
+    return;
+  }
+
+  while ((file = readdir(handle))) {
+    char *kind = strrchr(file->d_name, '.');
+    char key[BUFSIZ];
+
+    if ('.' == file->d_name[0] || NULL == kind ||
+        (size_t)(kind - file->d_name) >= sizeof(key)) {
+      continue;
+    }
+
+    memcpy(key, file->d_name, kind - file->d_name);
+    key[kind - file->d_name] = 0;
+
+    for (int i = 0; NULL != lock_kinds[i]; i++) {
+      if (0 == strcmp(kind + 1, lock_kinds[i])) {
+        remove_lock_file(key, lock_kinds[i]);
+      }
+    }
+  }
+
+  closedir(handle);
+}
+
+/**
+ * Remove expired entries, then the least recently used ones until the
+ * cache is within its limits, `most` entries at most, and their lock files.
+ */
+
+static int evict_entries(long most, clib_cache_gc_stats_t *stats) {
+  gc_list_t list = {NULL, 0, 0, 0};
+  long evicted = 0;
+  long count = 0;
+
+  if (0 != clib_cache_index_each(cache_index, collect_entry, &list)) {
+    free(list.entries);
+    return -1;
+  }
+
+  qsort(list.entries, list.count, sizeof(gc_entry_t), compare_entries);
+  count = list.count;
+
+  for (long i = 0; i < count && evicted < most; i++) {
+    gc_entry_t *entry = &list.entries[i];
+    int rc = -1;
+
+    if (!entry->expired && !is_over_limits(&list)) {
+      break;
+    }
+
+    if (CLIB_CACHE_INDEX_JSON == entry->kind) {
+      rc = remove_json(entry->key, &stats->reclaimed);
+    } else {
+      rc = remove_package(entry->key, entry_pool(entry->key),
+                          &stats->reclaimed);
+    }
+
+    // gone either way
+    list.size -= entry->size;
+    list.count--;
+    evicted++;
+
+    if (0 == rc) {
+      stats->evicted++;
+    }
+
+    remove_lock_files(entry->key);
+  }
+
+  stats->entries = list.count;
+  stats->size = list.size;
+  free(list.entries);
+
+  return 0;
+}
+
+int clib_cache_evict(clib_cache_gc_stats_t *stats) {
+  clib_cache_gc_stats_t ignored;
+
+  if (NULL == stats) {
+    stats = &ignored;
+  }
+
+  memset(stats, 0, sizeof(clib_cache_gc_stats_t));
+
+  return evict_entries(CLIB_CACHE_EVICT_BATCH, stats);
+}
+
+static int is_tmp_name(const char *name) {
+  size_t length = strlen(name);
+
+  return length > 4 && 0 == strcmp(".tmp", name + length - 4);
+}
+
+/**
+ * @return 1 if `path` holds the validators of a response no longer cached
+ */
+
+static int is_orphan_validators(const char *path) {
+  size_t length = strlen(path);
+  size_t suffix_length = strlen(VALIDATORS_SUFFIX);
+  char cache[BUFSIZ];
+
+  if (length <= suffix_length || length - suffix_length >= sizeof(cache) ||
+      0 != strcmp(VALIDATORS_SUFFIX, path + length - suffix_length)) {
+    return 0;
+  }
+
+  memcpy(cache, path, length - suffix_length);
+  cache[length - suffix_length] = 0;
+
+  return 0 != fs_exists(cache);
+}
+
+/**
+ * Remove `path` if it was left behind by a writer that crashed, holds the
+ * validators of a response no longer cached, or is an expired missing
+ * manifest marker, and get the bytes reclaimed.
+ */
+
+static int64_t remove_leftover(const char *path, const char *name,
+                               int is_missing) {
+  time_t now = time(NULL);
+  int64_t size = 0;
+  struct stat st;
+
+  if (0 != lstat(path, &st)) {
+    return 0;
+  }
+
+  if (!is_orphan_validators(path) &&
+      (is_tmp_name(name)
+           ? is_recent(st.st_mtime, now)
+           : !is_missing || now - st.st_mtime < missing_expiration)) {
+    return 0;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    clib_tree_walk(pool, path, add_unlinked_size, &size);
+    clib_tree_remove(pool, path);
+    return size;
+  }
+
+  return 0 == unlink(path) && 1 == st.st_nlink ? st.st_size : 0;
+}
+
+static int64_t remove_leftovers(const char *dir, int is_missing) {
+  struct dirent *file = NULL;
+  DIR *handle = opendir(dir);
+  int64_t size = 0;
+
+  if (NULL == handle) {
+    return 0;
+  }
+
+  while ((file = readdir(handle))) {
+    char path[BUFSIZ];
+
+    if ('.' != file->d_name[0] &&
+        0 == format_path(path, "%s/%s", dir, file->d_name)) {
+      size += remove_leftover(path, file->d_name, is_missing);
+    }
+  }
+
+  closedir(handle);
+  return size;
+}
+
+/**
+ * Remove the objects linked from no package or project, which are left
+ * behind by packages removed by older versions of clib, or used by
+ * projects since removed.
+ */
+
+static int64_t prune_store(void) {
+  struct dirent *fan_out = NULL;
+  DIR *store = opendir(store_dir);
+  time_t now = time(NULL);
+  int64_t size = 0;
+
+  if (NULL == store) {
+    return 0;
+  }
+
+  while ((fan_out = readdir(store))) {
+    struct dirent *file = NULL;
+    char dir[BUFSIZ];
+    DIR *handle = NULL;
+
+    if ('.' == fan_out->d_name[0] ||
+        0 != format_path(dir, "%s/%s", store_dir, fan_out->d_name) ||
+        NULL == (handle = opendir(dir))) {
+      continue;
+    }
+
+    while ((file = readdir(handle))) {
+      int is_tmp = is_tmp_name(file->d_name);
+      char object[BUFSIZ];
+      struct stat st;
+
+      // objects are kept while linked, the files of crashed writers are not
+      if ('.' == file->d_name[0] ||
+          0 != format_path(object, "%s/%s", dir, file->d_name) ||
+          0 != lstat(object, &st) || !S_ISREG(st.st_mode) ||
+          (!is_tmp && 1 != st.st_nlink) ||
+          is_recent(is_tmp ? st.st_mtime : st.st_ctime, now)) {
+        continue;
+      }
+
+      if (0 == unlink(object) && 1 == st.st_nlink) {
+        size += st.st_size;
+      }
+    }
+
+    closedir(handle);
+  }
+
+  closedir(store);
+  return size;
+}
+
+int clib_cache_gc(clib_cache_gc_stats_t *stats) {
+  clib_cache_gc_stats_t ignored;
+
+  if (NULL == stats) {
+    stats = &ignored;
+  }
+
+  memset(stats, 0, sizeof(clib_cache_gc_stats_t));
+
+  if (0 != evict_entries(LONG_MAX, stats)) {
+    return -1;
+  }
+
+  stats->reclaimed += remove_leftovers(json_cache_dir, 0);
+  stats->reclaimed += remove_leftovers(tree_cache_dir, 0);
+  stats->reclaimed += remove_leftovers(pack_cache_dir, 0);
+  stats->reclaimed += remove_leftovers(package_cache_dir, 0);
+  stats->reclaimed += remove_leftovers(missing_cache_dir, 1);
+  stats->reclaimed += remove_leftovers(refs_cache_dir, 0);
+  stats->reclaimed += prune_store();
+  prune_locks();
+
+  return 0;
 }
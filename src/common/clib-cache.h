@@ -8,19 +8,115 @@
 #ifndef CLIB_CACHE_H
 #define CLIB_CACHE_H
 
+#include "clib-pool.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
+/**
+ * Default expiration of the missing manifest markers, in seconds
+ */
+#define CLIB_CACHE_MISSING_TIME 24 * 60 * 60
+
+/**
+ * Most saves waiting for the writer of `clib_cache_save_package_async()`
+ */
+#define CLIB_CACHE_WRITE_QUEUE 8
+
+/**
+ * Default limits of the cache, see `clib_cache_limits_t`. The environment
+ * variables `CLIB_CACHE_MAX_SIZE`, e.g. "512M", and `CLIB_CACHE_MAX_ENTRIES`
+ * override them.
+ */
+#define CLIB_CACHE_MAX_SIZE (1024LL * 1024 * 1024)
+#define CLIB_CACHE_MAX_ENTRIES 4096
+#define CLIB_CACHE_MIN_AGE 60 * 60
+
+/**
+ * Most entries removed by `clib_cache_evict()`
+ */
+#define CLIB_CACHE_EVICT_BATCH 16
+
+/**
+ * Most bytes of a validator, NUL included. Longer ones are not kept.
+ */
+#define CLIB_CACHE_VALIDATOR_SIZE 128
+
+/**
+ * The `ETag` and `Last-Modified` headers of a cached response, sent back
+ * once it expired to revalidate it: if it did not change, the server
+ * answers with a 304 and no body. Empty if the server sent none.
+ */
+typedef struct {
+  char file[32]; // the response is of, e.g. "clib.json", if it matters
+  char etag[CLIB_CACHE_VALIDATOR_SIZE];
+  char last_modified[CLIB_CACHE_VALIDATOR_SIZE];
+} clib_cache_validators_t;
+
+typedef struct {
+  unsigned long missing_hits; // requests skipped thanks to a missing marker
+} clib_cache_stats_t;
+
+typedef struct {
+  int64_t max_size; // of the manifests and packages, in bytes, 0 for none
+  long max_entries; // 0 for none
+  time_t min_age;   // in seconds, younger files may be in use by a save
+} clib_cache_limits_t;
+
+typedef struct {
+  long entries;      // manifests and packages left
+  int64_t size;      // of the entries left, in bytes
+  long evicted;      // manifests and packages removed
+  int64_t reclaimed; // bytes freed on disk
+} clib_cache_gc_stats_t;
+
+/**
+ * The functions below may be called from several threads, and processes
+ * sharing the cache, at once. Writes lock the entries of a package with
+ * `flock()`, and publish them with a rename. Reads take no lock.
+ */
+
+/**
+ * Set `validators` to the headers of a response, either may be NULL, and
+ * `file` to the file it is of, if not NULL.
+ */
+void clib_cache_validators_init(clib_cache_validators_t *validators,
+                                const char *file, const char *etag,
+                                const char *last_modified);
+
 /**
  * Internal setup, creates the base cache dir if necessary
  *
- * @param expiration Cache expiration in seconds
+ * @param expiration Cache expiration in seconds, of the manifests and
+ * packages of any version but a commit SHA, which never changes
  *
  * @return 0 on success, -1 otherwise
  */
 int clib_cache_init(time_t expiration);
 
+/**
+ * Serve expired manifests and search results for up to `max_stale` more
+ * seconds, instead of blocking on the network, while the caller refreshes
+ * them in the background for the next run: see `clib_cache_is_stale_json()`
+ * and `clib_cache_is_stale_search()`. 0, the default, disables it. The
+ * environment variable `CLIB_CACHE_MAX_STALE` sets it at init.
+ */
+void clib_cache_set_max_stale(time_t max_stale);
+
+/**
+ * Save packages as a single pack each, see clib-pack.h, instead of a tree
+ * of files linked to a store shared by every package. Either is loaded,
+ * whichever the package was saved as. Off by default, the environment
+ * variable `CLIB_CACHE_PACKED`, e.g. "1", sets it at init.
+ */
+void clib_cache_set_packed(int packed);
+
+/**
+ * Copy, link and remove the files of cached packages on the workers of
+ * `pool`, or on the calling thread if it is NULL
+ */
+void clib_cache_set_pool(clib_pool_t *pool);
+
 /**
  * Initializes the internal cache directory
  *
@@ -47,21 +143,104 @@ int clib_cache_has_json(char *author, char *name, char *version);
 
 /**
  * @return The content of the cached package.json, or NULL on error, if not
- * found, or expired
+ * found, or expired past the stale bound
  */
 char *clib_cache_read_json(char *author, char *name, char *version);
 
+/**
+ * @return 1 if the cached package.json is served although it expired, and
+ * should be refreshed, 0 otherwise
+ */
+int clib_cache_is_stale_json(char *author, char *name, char *version);
+
 /**
  * @return Number of written bytes, or -1 on error
  */
 int clib_cache_save_json(char *author, char *name, char *version,
                          char *content);
 
+/**
+ * Like `clib_cache_save_json()`, along with the validators of the response
+ * the manifest came in, or none if NULL.
+ */
+int clib_cache_save_json_with_validators(
+    char *author, char *name, char *version, char *content,
+    const clib_cache_validators_t *validators);
+
+/**
+ * Read a cached manifest even if it expired, to revalidate it.
+ *
+ * @param validators Set to the validators it was saved with
+ *
+ * @return The content of the cached package.json, or NULL if not found or
+ * saved without validators
+ */
+char *clib_cache_read_stale_json(char *author, char *name, char *version,
+                                 clib_cache_validators_t *validators);
+
+/**
+ * The server said the cached manifest did not change, it expires again
+ * from now on.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_renew_json(char *author, char *name, char *version);
+
 /**
  * @return Number of written bytes, or -1 on error
  */
 int clib_cache_delete_json(char *author, char *name, char *version);
 
+/**
+ * Set how long a manifest is remembered as missing, independently of the
+ * expiration given to `clib_cache_init()`
+ */
+void clib_cache_set_missing_expiration(time_t expiration);
+
+/**
+ * @param file The manifest name, e.g. "clib.json"
+ *
+ * @return 0/1 if `file` is known not to exist for the package
+ */
+int clib_cache_has_missing(char *author, char *name, char *version,
+                           const char *file);
+
+/**
+ * Remember that `file` does not exist for the package, e.g. after a 404
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_save_missing(char *author, char *name, char *version,
+                            const char *file);
+
+/**
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_delete_missing(char *author, char *name, char *version,
+                              const char *file);
+
+/**
+ * Read the commit the tag `version` of a package was resolved to. Tags are
+ * taken to never move, their resolution never expires.
+ *
+ * @param commit Set to the 40 hex digits of the commit, and a NUL
+ *
+ * @return 0 on success, -1 if not found
+ */
+int clib_cache_read_ref(char *author, char *name, char *version,
+                        char *commit);
+
+/**
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_save_ref(char *author, char *name, char *version,
+                        const char *commit);
+
+/**
+ * @return The cache statistics of the running process
+ */
+clib_cache_stats_t clib_cache_stats(void);
+
 /**
  * @return 0/1 if the search cache exists
  */
@@ -69,21 +248,62 @@ int clib_cache_has_search(void);
 
 /**
  * @return The content of the search cache, NULL on error, if not found, or
- * expired
+ * expired past the stale bound
  */
 char *clib_cache_read_search(void);
 
+/**
+ * Like `clib_cache_is_stale_json()`, for the search cache.
+ */
+int clib_cache_is_stale_search(void);
+
 /**
  * @return Number of written bytes, or -1 on error, or if there is no search
  * cahce
  */
 int clib_cache_save_search(char *content);
 
+/**
+ * Like `clib_cache_save_search()`, with the validators of the response.
+ */
+int clib_cache_save_search_with_validators(
+    char *content, const clib_cache_validators_t *validators);
+
+/**
+ * Like `clib_cache_read_stale_json()`, for the search cache.
+ */
+char *clib_cache_read_stale_search(clib_cache_validators_t *validators);
+
+/**
+ * Like `clib_cache_renew_json()`, for the search cache.
+ */
+int clib_cache_renew_search(void);
+
 /**
  * @return 0 on success, -1 otherwise
  */
 int clib_cache_delete_search(void);
 
+/**
+ * Read the response `name` cached in `clib_cache_meta_dir()`, whether it
+ * expired or not, e.g. the latest release of clib.
+ *
+ * @param validators Set to the validators it was saved with, if not NULL
+ *
+ * @return The response, or NULL if not found
+ */
+char *clib_cache_read_meta(const char *name,
+                           clib_cache_validators_t *validators);
+
+/**
+ * Cache the response `name` in `clib_cache_meta_dir()`, with its
+ * validators if not NULL.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_save_meta(const char *name, const char *content,
+                         const clib_cache_validators_t *validators);
+
 /**
  * @return 0/1 if the packe is cached
  */
@@ -95,6 +315,24 @@ int clib_cache_has_package(char *author, char *name, char *version);
  */
 int clib_cache_is_expired_package(char *author, char *name, char *version);
 
+/**
+ * Claim a package before fetching it, so that it is downloaded once however
+ * many processes need it: waits for the process holding the claim, which
+ * caches the package before releasing it. Check the cache once claimed.
+ * Files of a package claimed by this process are handled on the calling
+ * thread.
+ *
+ * @return The claim, or -1 if it could not be taken, in which case the
+ * package is fetched anyway
+ */
+int clib_cache_claim_package(char *author, char *name, char *version);
+
+/**
+ * Release a claim returned by `clib_cache_claim_package()`, -1 included
+ */
+void clib_cache_release_package(char *author, char *name, char *version,
+                                int claim);
+
 /**
  * @param target_dir Where the cached package should be copied
  *
@@ -114,9 +352,72 @@ int clib_cache_load_package(char *author, char *name, char *version,
 int clib_cache_save_package(char *author, char *name, char *version,
                             char *pkg_dir);
 
+/**
+ * Save the package like `clib_cache_save_package()`, in the background:
+ * the files of `pkg_dir` are snapshotted with hard links, and stored by a
+ * writer thread while the caller goes on. Waits while
+ * `CLIB_CACHE_WRITE_QUEUE` saves are pending. Without threads, the package
+ * is saved right away.
+ *
+ * @param claim Released once the package is saved, or -1
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_save_package_async(char *author, char *name, char *version,
+                                  char *pkg_dir, int claim);
+
+/**
+ * Wait for the saves queued so far. Done at exit too.
+ */
+void clib_cache_flush(void);
+
 /**
  * @return 0 on success, -1 on error
  */
 int clib_cache_delete_package(char *author, char *name, char *version);
 
+/**
+ * Set the limits enforced by `clib_cache_evict()` and `clib_cache_gc()`
+ */
+void clib_cache_set_limits(clib_cache_limits_t limits);
+
+/**
+ * @return The limits of the cache
+ */
+clib_cache_limits_t clib_cache_limits(void);
+
+/**
+ * Parse a size in bytes, with an optional "K", "M" or "G" suffix
+ *
+ * @return 0 on success, -1 if `string` is not a size
+ */
+int clib_cache_parse_size(const char *string, int64_t *size);
+
+/**
+ * Remove expired manifests and packages, then the least recently used,
+ * while the cache is over its limits, `CLIB_CACHE_EVICT_BATCH` at most.
+ * Sizes are taken from the index, so that it is cheap enough to run after
+ * every install. Files shared by several packages count once per package,
+ * and are removed with the last package linked to them. So are lock files
+ * with the last entry of their package, unless in use.
+ *
+ * @param stats Filled with what was evicted, may be NULL
+ *
+ * @return 0 on success, -1 on error, e.g. without an index
+ */
+int clib_cache_evict(clib_cache_gc_stats_t *stats);
+
+/**
+ * Like `clib_cache_evict()`, without a bound on the entries removed, then
+ * remove the files left behind by crashed writers, the expired missing
+ * manifest markers, the objects of the store linked from no package or
+ * project, and the unused lock files of packages no longer cached. Files
+ * younger than the `min_age` limit are kept.
+ *
+ * @param stats Filled with what was removed, may be NULL
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_cache_gc(clib_cache_gc_stats_t *stats);
+
 #endif
@@ -0,0 +1,240 @@
+//
+// clib-deps-index.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#include "clib-deps-index.h"
+#include "asprintf/asprintf.h"
+#include "debug/debug.h"
+#include "fs/fs.h"
+#include "path-join/path-join.h"
+#include "strdup/strdup.h"
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *manifest_names[] = {"clib.json", "package.json", NULL};
+
+static debug_t debugger;
+
+#define _debug(...)                                                            \
+  ({                                                                           \
+    if (!(debugger.name))                                                      \
+      debug_init(&debugger, "clib-deps-index");                                \
+    debug(&debugger, __VA_ARGS__);                                             \
+  })
+
+/**
+ * Map `key` to `entry` unless another package claimed it first.
+ */
+
+static void add_key(hash_t *hash, const char *key, size_t length,
+                    clib_deps_entry_t *entry) {
+  char *copy = NULL;
+
+  if (!key || 0 == length || !(copy = malloc(length + 1))) {
+    return;
+  }
+
+  memcpy(copy, key, length);
+  copy[length] = 0;
+
+  if (hash_get(hash, copy)) {
+    _debug("%s is installed twice, using %s", copy,
+           ((clib_deps_entry_t *)hash_get(hash, copy))->dir);
+    free(copy);
+    return;
+  }
+
+  hash_set(hash, copy, entry);
+}
+
+static clib_deps_entry_t *load_entry(const char *dir) {
+  clib_deps_entry_t *entry = NULL;
+  char *json = NULL;
+  unsigned int i = 0;
+
+  for (; NULL == json && NULL != manifest_names[i]; i++) {
+    char *path = path_join(dir, manifest_names[i]);
+
+    if (path && 0 == fs_exists(path)) {
+      json = fs_read(path);
+    }
+
+    free(path);
+  }
+
+  if (NULL == json) {
+    return NULL;
+  }
+
+  if ((entry = malloc(sizeof(clib_deps_entry_t)))) {
+    memset(entry, 0, sizeof(clib_deps_entry_t));
+    entry->file = manifest_names[i - 1];
+    entry->package = clib_package_new(json, 0);
+    entry->dir = strdup(dir);
+
+    if (!entry->package || !entry->dir) {
+      clib_package_free(entry->package);
+      free(entry->dir);
+      free(entry);
+      entry = NULL;
+    }
+  }
+
+  free(json);
+  return entry;
+}
+
+static void add_entry(clib_deps_index_t *index, const char *name) {
+  clib_deps_entry_t *entry = NULL;
+  clib_package_t *package = NULL;
+  char *dir = path_join(index->dir, name);
+
+  if (dir) {
+    entry = load_entry(dir);
+    free(dir);
+  }
+
+  if (NULL == entry) {
+    return;
+  }
+
+  list_rpush(index->entries, list_node_new(entry));
+  package = entry->package;
+
+  if (package->repo) {
+    add_key(index->repos, package->repo, strcspn(package->repo, "@"), entry);
+  } else if (package->author && package->name) {
+    char *repo = NULL;
+    asprintf(&repo, "%s/%s", package->author, package->name);
+    add_key(index->repos, repo, repo ? strlen(repo) : 0, entry);
+    free(repo);
+  }
+
+  if (package->name) {
+    add_key(index->names, package->name, strlen(package->name), entry);
+  }
+
+  add_key(index->names, name, strlen(name), entry);
+}
+
+clib_deps_index_t *clib_deps_index_new(const char *dir) {
+  clib_deps_index_t *index = malloc(sizeof(clib_deps_index_t));
+  struct dirent *item = NULL;
+  DIR *handle = NULL;
+
+  if (NULL == index) {
+    return NULL;
+  }
+
+  memset(index, 0, sizeof(clib_deps_index_t));
+
+  if (!(index->dir = strdup(dir)) || !(index->entries = list_new()) ||
+      !(index->repos = hash_new()) || !(index->names = hash_new())) {
+    clib_deps_index_free(index);
+    return NULL;
+  }
+
+  if (NULL == (handle = opendir(dir))) {
+    _debug("nothing installed in %s", dir);
+    return index;
+  }
+
+  while ((item = readdir(handle))) {
+    if ('.' != item->d_name[0]) {
+      add_entry(index, item->d_name);
+    }
+  }
+
+  closedir(handle);
+  _debug("%d packages installed in %s", index->entries->len, dir);
+
+  return index;
+}
+
+clib_deps_entry_t *clib_deps_index_get(clib_deps_index_t *index,
+                                       const char *slug) {
+  clib_deps_entry_t *entry = NULL;
+  char *name = NULL;
+  size_t length = 0;
+  char *key = NULL;
+
+  if (!index || !slug) {
+    return NULL;
+  }
+
+  length = strcspn(slug, "@");
+
+  if (!(key = malloc(length + 1))) {
+    return NULL;
+  }
+
+  memcpy(key, slug, length);
+  key[length] = 0;
+
+  if (strchr(key, '/')) {
+    entry = hash_get(index->repos, key);
+  }
+
+  // the directory of a package is named after it
+  if (NULL == entry) {
+    name = strrchr(key, '/');
+    entry = hash_get(index->names, name ? name + 1 : key);
+  }
+
+  free(key);
+  return entry;
+}
+
+clib_deps_entry_t *
+clib_deps_index_get_dependency(clib_deps_index_t *index,
+                               clib_package_dependency_t *dep) {
+  clib_deps_entry_t *entry = NULL;
+  char *slug = NULL;
+
+  if (!index || !dep || !dep->name) {
+    return NULL;
+  }
+
+  asprintf(&slug, "%s/%s", dep->author ? dep->author : "", dep->name);
+  entry = clib_deps_index_get(index, slug);
+  free(slug);
+
+  return entry;
+}
+
+void clib_deps_index_free(clib_deps_index_t *index) {
+  list_node_t *node = NULL;
+
+  if (NULL == index) {
+    return;
+  }
+
+  if (index->entries) {
+    while ((node = list_lpop(index->entries))) {
+      clib_deps_entry_t *entry = node->val;
+      clib_package_free(entry->package);
+      free(entry->dir);
+      free(entry);
+      free(node);
+    }
+
+    list_destroy(index->entries);
+  }
+
+  if (index->repos) {
+    hash_each_key(index->repos, { free((void *)key); });
+    hash_free(index->repos);
+  }
+
+  if (index->names) {
+    hash_each_key(index->names, { free((void *)key); });
+    hash_free(index->names);
+  }
+
+  free(index->dir);
+  free(index);
+}
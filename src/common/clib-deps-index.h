@@ -0,0 +1,63 @@
+//
+// clib-deps-index.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_DEPS_INDEX_H
+#define CLIB_DEPS_INDEX_H 1
+
+#include "clib-package.h"
+#include "hash/hash.h"
+#include "list/list.h"
+
+typedef struct clib_deps_entry clib_deps_entry_t;
+typedef struct clib_deps_index clib_deps_index_t;
+
+/**
+ * A package installed in the deps directory.
+ */
+struct clib_deps_entry {
+  char *dir;
+  const char *file; // name of its manifest in `dir`
+  clib_package_t *package;
+};
+
+/**
+ * The packages installed in a deps directory, read once so that build
+ * steps can resolve their dependencies without the network or the cache.
+ */
+struct clib_deps_index {
+  char *dir;
+  list_t *entries;
+  hash_t *repos; // "author/name" -> entry
+  hash_t *names; // name of the package and of its directory -> entry
+};
+
+/**
+ * Scan `dir` for installed packages. A missing `dir` gives an empty index.
+ *
+ * @return A new index, or NULL on error
+ */
+clib_deps_index_t *clib_deps_index_new(const char *dir);
+
+/**
+ * Find an installed package by `slug`, which is either "author/name",
+ * with an optional "@version" that is ignored, or just its name.
+ *
+ * @return The entry, or NULL if not installed
+ */
+clib_deps_entry_t *clib_deps_index_get(clib_deps_index_t *index,
+                                       const char *slug);
+
+/**
+ * Like `clib_deps_index_get()`, for a dependency of a manifest.
+ */
+clib_deps_entry_t *
+clib_deps_index_get_dependency(clib_deps_index_t *index,
+                               clib_package_dependency_t *dep);
+
+void clib_deps_index_free(clib_deps_index_t *index);
+
+#endif
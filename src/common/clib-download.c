@@ -0,0 +1,643 @@
+//
+// clib-download.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#include "clib-download.h"
+#include "debug/debug.h"
+#include "strdup/strdup.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CLIB_DOWNLOAD_POLL_TIMEOUT 1000
+
+// the GitHub API refuses requests without one
+#define CLIB_DOWNLOAD_USER_AGENT "clib"
+
+static debug_t debugger;
+
+#define _debug(...)                                                            \
+  ({                                                                           \
+    if (!(debugger.name))                                                      \
+      debug_init(&debugger, "clib-download");                                  \
+    debug(&debugger, __VA_ARGS__);                                             \
+  })
+
+static inline void queue_lock(clib_download_queue_t *queue) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&queue->mutex);
+#endif
+}
+
+static inline void queue_unlock(clib_download_queue_t *queue) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&queue->mutex);
+#endif
+}
+
+/**
+ * Interrupt a driver blocked on the network so it picks up new work.
+ */
+
+static inline void queue_wakeup(clib_download_queue_t *queue) {
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_wakeup(queue->multi);
+#endif
+}
+
+static size_t write_body_cb(void *contents, size_t size, size_t nmemb,
+                            void *userp) {
+  size_t realsize = size * nmemb;
+  clib_download_t *download = userp;
+  char *ptr = realloc(download->body, download->size + realsize + 1);
+
+  if (NULL == ptr) {
+    return 0;
+  }
+
+  download->body = ptr;
+  memcpy(download->body + download->size, contents, realsize);
+  download->size += realsize;
+  download->body[download->size] = 0;
+
+  return realsize;
+}
+
+static size_t write_file_cb(void *contents, size_t size, size_t nmemb,
+                            void *userp) {
+  clib_download_t *download = userp;
+  size_t n = fwrite(contents, size, nmemb, download->file);
+  download->size += n * size;
+  return n * size;
+}
+
+/**
+ * Set `*value` to the value of `header` if it is the one in `line`.
+ */
+
+static void take_header(const char *line, size_t length, const char *header,
+                        char **value) {
+  size_t header_length = strlen(header);
+  char *copy = NULL;
+
+  if (length <= header_length) {
+    return;
+  }
+
+  for (size_t i = 0; i < header_length; i++) {
+    if (tolower((unsigned char)line[i]) != tolower((unsigned char)header[i])) {
+      return;
+    }
+  }
+
+  line += header_length;
+  length -= header_length;
+
+  while (length && isspace((unsigned char)*line)) {
+    line++;
+    length--;
+  }
+
+  while (length && isspace((unsigned char)line[length - 1])) {
+    length--;
+  }
+
+  if (0 == length || !(copy = malloc(length + 1))) {
+    return;
+  }
+
+  memcpy(copy, line, length);
+  copy[length] = 0;
+  free(*value);
+  *value = copy;
+}
+
+static size_t header_cb(char *buffer, size_t size, size_t nitems,
+                        void *userp) {
+  size_t length = size * nitems;
+  clib_download_t *download = userp;
+
+  // the headers of a redirect are followed by those of its target
+  if (length > 5 && 0 == strncmp("HTTP/", buffer, 5)) {
+    free(download->etag);
+    free(download->last_modified);
+    download->etag = NULL;
+    download->last_modified = NULL;
+  } else {
+    take_header(buffer, length, "ETag:", &download->etag);
+    take_header(buffer, length, "Last-Modified:", &download->last_modified);
+  }
+
+  return length;
+}
+
+void clib_download_free(clib_download_t *download) {
+  if (NULL == download) {
+    return;
+  }
+
+  if (download->req) {
+    curl_easy_cleanup(download->req);
+  }
+
+  if (download->file) {
+    fclose(download->file);
+  }
+
+  curl_slist_free_all(download->headers);
+  free(download->url);
+  free(download->path);
+  free(download->body);
+  free(download->etag);
+  free(download->last_modified);
+  free(download);
+}
+
+/**
+ * Add the request header `header` with `value`, unless NULL or empty.
+ */
+
+static int add_header(clib_download_t *download, const char *header,
+                      const char *value) {
+  struct curl_slist *headers = NULL;
+  char *line = NULL;
+
+  if (NULL == value || !*value) {
+    return 0;
+  }
+
+  if (!(line = malloc(strlen(header) + strlen(value) + 1))) {
+    return -1;
+  }
+
+  sprintf(line, "%s%s", header, value);
+  headers = curl_slist_append(download->headers, line);
+  free(line);
+
+  if (NULL == headers) {
+    return -1;
+  }
+
+  download->headers = headers;
+  return 0;
+}
+
+static clib_download_t *new_download(const char *url, const char *path,
+                                     const char *etag,
+                                     const char *last_modified) {
+  clib_download_t *download = NULL;
+
+  if (!url || !(download = malloc(sizeof(clib_download_t)))) {
+    return NULL;
+  }
+
+  memset(download, 0, sizeof(clib_download_t));
+
+  if (!(download->url = strdup(url)) ||
+      (path && !(download->path = strdup(path))) ||
+      0 != add_header(download, "If-None-Match: ", etag) ||
+      0 != add_header(download, "If-Modified-Since: ", last_modified)) {
+    clib_download_free(download);
+    return NULL;
+  }
+
+  return download;
+}
+
+/**
+ * Set up the request of `download` but for where its response goes.
+ */
+
+static void setup_request(clib_download_t *download, CURLSH *share) {
+  if (share) {
+    curl_easy_setopt(download->req, CURLOPT_SHARE, share);
+  }
+
+  if (download->headers) {
+    curl_easy_setopt(download->req, CURLOPT_HTTPHEADER, download->headers);
+  }
+
+  curl_easy_setopt(download->req, CURLOPT_URL, download->url);
+  curl_easy_setopt(download->req, CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(download->req, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(download->req, CURLOPT_USERAGENT, CLIB_DOWNLOAD_USER_AGENT);
+  curl_easy_setopt(download->req, CURLOPT_WRITEDATA, (void *)download);
+  curl_easy_setopt(download->req, CURLOPT_HEADERFUNCTION, header_cb);
+  curl_easy_setopt(download->req, CURLOPT_HEADERDATA, (void *)download);
+}
+
+/**
+ * A 304 is a success for a conditional request, the cached response is
+ * still current.
+ */
+
+static int is_ok(clib_download_t *download, CURLcode result) {
+  return CURLE_OK == result &&
+         (200 == download->status ||
+          (304 == download->status && NULL != download->headers));
+}
+
+clib_download_queue_t *clib_download_queue_new(int concurrency,
+                                               CURLSH *share) {
+  clib_download_queue_t *queue = malloc(sizeof(clib_download_queue_t));
+
+  if (NULL == queue) {
+    return NULL;
+  }
+
+  memset(queue, 0, sizeof(clib_download_queue_t));
+
+  queue->share = share;
+  queue->max_in_flight = concurrency > 0 ? concurrency : 1;
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+#endif
+
+  if (!(queue->multi = curl_multi_init())) {
+    goto error;
+  }
+
+  if (!(queue->pending = list_new()) || !(queue->active = list_new())) {
+    goto error;
+  }
+
+  return queue;
+
+error:
+  clib_download_queue_free(queue);
+  return NULL;
+}
+
+static int enqueue(clib_download_queue_t *queue, clib_download_group_t *group,
+                   clib_download_t *download, clib_download_cb cb,
+                   void *data) {
+  list_node_t *node = NULL;
+
+  if (!queue || !download) {
+    goto error;
+  }
+
+  download->cb = cb;
+  download->data = data;
+  download->group = group;
+
+  if (!(node = list_node_new(download))) {
+    goto error;
+  }
+
+  queue_lock(queue);
+  list_rpush(queue->pending, node);
+  if (group) {
+    group->pending++;
+  }
+  queue_unlock(queue);
+
+  queue_wakeup(queue);
+  return 0;
+
+error:
+  clib_download_free(download);
+  return -1;
+}
+
+int clib_download_queue_add(clib_download_queue_t *queue, const char *url,
+                            const char *path, clib_download_cb cb,
+                            void *data) {
+  return enqueue(queue, NULL, new_download(url, path, NULL, NULL), cb, data);
+}
+
+void clib_download_group_init(clib_download_group_t *group,
+                              clib_download_queue_t *queue) {
+  memset(group, 0, sizeof(clib_download_group_t));
+  group->queue = queue;
+}
+
+int clib_download_group_add(clib_download_group_t *group, const char *url,
+                            const char *path, clib_download_cb cb,
+                            void *data) {
+  if (!group) {
+    return -1;
+  }
+
+  return enqueue(group->queue, group, new_download(url, path, NULL, NULL), cb,
+                 data);
+}
+
+int clib_download_group_revalidate(clib_download_group_t *group,
+                                   const char *url, const char *etag,
+                                   const char *last_modified,
+                                   clib_download_cb cb, void *data) {
+  if (!group) {
+    return -1;
+  }
+
+  return enqueue(group->queue, group,
+                 new_download(url, NULL, etag, last_modified), cb, data);
+}
+
+clib_download_t *clib_download_get(const char *url, const char *etag,
+                                   const char *last_modified, CURLSH *share) {
+  clib_download_t *download = new_download(url, NULL, etag, last_modified);
+  CURLcode result = CURLE_FAILED_INIT;
+
+  if (NULL == download) {
+    return NULL;
+  }
+
+  if ((download->req = curl_easy_init())) {
+    curl_easy_setopt(download->req, CURLOPT_WRITEFUNCTION, write_body_cb);
+    setup_request(download, share);
+
+    _debug("GET %s", download->url);
+    result = curl_easy_perform(download->req);
+    curl_easy_getinfo(download->req, CURLINFO_RESPONSE_CODE,
+                      &download->status);
+  }
+
+  download->ok = is_ok(download, result);
+  _debug("status: %ld %s", download->status, download->url);
+
+  return download;
+}
+
+/**
+ * Hand the next pending download over to the multi handle.
+ */
+
+static int start_download(clib_download_queue_t *queue,
+                          clib_download_t *download) {
+  if (!(download->req = curl_easy_init())) {
+    return -1;
+  }
+
+  if (download->path) {
+    // may be a hard link into the package store, never written through
+    remove(download->path);
+
+    if (!(download->file = fopen(download->path, "wb"))) {
+      goto error;
+    }
+
+    curl_easy_setopt(download->req, CURLOPT_WRITEFUNCTION, write_file_cb);
+  } else {
+    curl_easy_setopt(download->req, CURLOPT_WRITEFUNCTION, write_body_cb);
+  }
+
+  setup_request(download, queue->share);
+  curl_easy_setopt(download->req, CURLOPT_PRIVATE, (void *)download);
+
+  if (!(download->node = list_node_new(download))) {
+    goto error;
+  }
+
+  if (CURLM_OK != curl_multi_add_handle(queue->multi, download->req)) {
+    goto error;
+  }
+
+  _debug("GET %s", download->url);
+  queue_lock(queue);
+  list_rpush(queue->active, download->node);
+  queue->in_flight++;
+  queue_unlock(queue);
+  return 0;
+
+error:
+  free(download->node);
+  download->node = NULL;
+  curl_easy_cleanup(download->req);
+  download->req = NULL;
+  return -1;
+}
+
+static void finish_download(clib_download_queue_t *queue,
+                            clib_download_t *download, CURLcode result) {
+  clib_download_group_t *group = download->group;
+
+  if (download->node) {
+    curl_multi_remove_handle(queue->multi, download->req);
+    curl_easy_getinfo(download->req, CURLINFO_RESPONSE_CODE,
+                      &download->status);
+    queue_lock(queue);
+    list_remove(queue->active, download->node);
+    download->node = NULL;
+    queue->in_flight--;
+    queue_unlock(queue);
+  }
+
+  if (download->file) {
+    fclose(download->file);
+    download->file = NULL;
+  }
+
+  download->ok = is_ok(download, result);
+  _debug("status: %ld %s", download->status, download->url);
+
+  // never leave a partial or error page behind
+  if (!download->ok && download->path) {
+    remove(download->path);
+  }
+
+  if (download->cb) {
+    download->cb(download, download->data);
+  }
+
+  if (group) {
+    queue_lock(queue);
+    if (!download->ok) {
+      group->failures++;
+    }
+    group->pending--;
+    queue_unlock(queue);
+  }
+
+  clib_download_free(download);
+}
+
+static void fill_slots(clib_download_queue_t *queue) {
+  list_node_t *node = NULL;
+
+  while (1) {
+    queue_lock(queue);
+    node = queue->in_flight < queue->max_in_flight
+               ? list_lpop(queue->pending)
+               : NULL;
+    queue_unlock(queue);
+
+    if (NULL == node) {
+      break;
+    }
+
+    clib_download_t *download = node->val;
+    free(node);
+
+    if (0 != start_download(queue, download)) {
+      finish_download(queue, download, CURLE_FAILED_INIT);
+    }
+  }
+}
+
+static int is_done(clib_download_queue_t *queue,
+                   clib_download_group_t *group) {
+  if (group) {
+    return 0 == group->pending;
+  }
+
+  return 0 == queue->pending->len && 0 == queue->in_flight;
+}
+
+/**
+ * Run one turn of the event loop on behalf of `group`. Only the thread
+ * currently driving the queue may call this.
+ */
+
+static int drive(clib_download_queue_t *queue, clib_download_group_t *group) {
+  int running = 0;
+  int left = 0;
+  int idle = 0;
+  CURLMsg *msg = NULL;
+
+  fill_slots(queue);
+
+  if (CURLM_OK != curl_multi_perform(queue->multi, &running)) {
+    return -1;
+  }
+
+  while ((msg = curl_multi_info_read(queue->multi, &left))) {
+    if (CURLMSG_DONE == msg->msg) {
+      clib_download_t *download = NULL;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &download);
+      finish_download(queue, download, msg->data.result);
+    }
+  }
+
+  // refill finished slots before waiting on the network again
+  fill_slots(queue);
+
+  queue_lock(queue);
+  idle = 0 == queue->in_flight || is_done(queue, group);
+  queue_unlock(queue);
+
+  if (idle) {
+    return 0;
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x074200
+  if (CURLM_OK != curl_multi_poll(queue->multi, NULL, 0,
+                                  CLIB_DOWNLOAD_POLL_TIMEOUT, NULL)) {
+    return -1;
+  }
+#else
+  if (CURLM_OK != curl_multi_wait(queue->multi, NULL, 0,
+                                  CLIB_DOWNLOAD_POLL_TIMEOUT, NULL)) {
+    return -1;
+  }
+#endif
+
+  return 0;
+}
+
+/**
+ * Wait for `group`, or the whole queue if NULL. At most one waiting thread
+ * drives the event loop at a time, the others sleep until it hands over.
+ */
+
+static int wait_for(clib_download_queue_t *queue,
+                    clib_download_group_t *group) {
+  int rc = 0;
+
+  queue_lock(queue);
+
+  while (0 == rc && !is_done(queue, group)) {
+#ifdef HAVE_PTHREADS
+    if (queue->driving) {
+      pthread_cond_wait(&queue->cond, &queue->mutex);
+      continue;
+    }
+#endif
+
+    queue->driving = 1;
+    queue_unlock(queue);
+
+    rc = drive(queue, group);
+
+    queue_lock(queue);
+    queue->driving = 0;
+#ifdef HAVE_PTHREADS
+    pthread_cond_broadcast(&queue->cond);
+#endif
+  }
+
+  queue_unlock(queue);
+
+  return rc;
+}
+
+int clib_download_queue_run(clib_download_queue_t *queue) {
+  if (!queue) {
+    return -1;
+  }
+
+  return wait_for(queue, NULL);
+}
+
+int clib_download_group_wait(clib_download_group_t *group) {
+  if (!group) {
+    return -1;
+  }
+
+  // nothing was ever queued
+  if (!group->queue) {
+    return 0;
+  }
+
+  return wait_for(group->queue, group);
+}
+
+void clib_download_queue_free(clib_download_queue_t *queue) {
+  list_node_t *node = NULL;
+
+  if (NULL == queue) {
+    return;
+  }
+
+  if (queue->pending) {
+    while ((node = list_lpop(queue->pending))) {
+      clib_download_free(node->val);
+      free(node);
+    }
+    list_destroy(queue->pending);
+  }
+
+  // still attached to the multi handle, e.g. speculative manifest probes
+  if (queue->active) {
+    while ((node = list_lpop(queue->active))) {
+      clib_download_t *download = node->val;
+      free(node);
+
+      curl_multi_remove_handle(queue->multi, download->req);
+      if (download->file) {
+        fclose(download->file);
+        download->file = NULL;
+        remove(download->path);
+      }
+      clib_download_free(download);
+    }
+    list_destroy(queue->active);
+  }
+
+  if (queue->multi) {
+    curl_multi_cleanup(queue->multi);
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_destroy(&queue->mutex);
+  pthread_cond_destroy(&queue->cond);
+#endif
+
+  free(queue);
+}
@@ -0,0 +1,154 @@
+//
+// clib-download.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_DOWNLOAD_H
+#define CLIB_DOWNLOAD_H 1
+
+#include "list/list.h"
+#include <curl/curl.h>
+#include <stdio.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+typedef struct clib_download clib_download_t;
+typedef struct clib_download_group clib_download_group_t;
+typedef struct clib_download_queue clib_download_queue_t;
+
+/**
+ * Called on the thread driving the queue once a download is finished,
+ * whether it succeeded or not.
+ */
+typedef void (*clib_download_cb)(clib_download_t *download, void *data);
+
+struct clib_download {
+  char *url;
+  char *path; // NULL to keep the response body in `body`
+  char *body;
+  size_t size;
+  long status;
+  int ok;
+  char *etag;          // of the response, NULL if none
+  char *last_modified; // of the response, NULL if none
+  clib_download_cb cb;
+  void *data;
+  clib_download_group_t *group;
+  FILE *file;
+  CURL *req;
+  struct curl_slist *headers; // of a conditional request
+  list_node_t *node;          // in the `active` list of the queue
+};
+
+/**
+ * A set of downloads that can be waited on together, e.g. the files of
+ * a single package, while sharing the queue with everyone else.
+ */
+struct clib_download_group {
+  clib_download_queue_t *queue;
+  int pending;
+  int failures;
+};
+
+struct clib_download_queue {
+  CURLM *multi;
+  CURLSH *share;
+  list_t *pending;
+  list_t *active; // handed over to `multi`
+  int in_flight;
+  int max_in_flight;
+  int driving;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+};
+
+/**
+ * @param concurrency Maximum number of transfers in flight at once
+ * @param share Optional curl share handle used by every transfer
+ *
+ * @return A new download queue, or NULL on error
+ */
+clib_download_queue_t *clib_download_queue_new(int concurrency, CURLSH *share);
+
+/**
+ * Enqueue a GET of `url`. If `path` is given the response is written to
+ * that file, otherwise it is kept in memory in `download->body`.
+ * The callback may take ownership of `body` by setting it to NULL.
+ * Safe to call from any thread, including from a completion callback.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_download_queue_add(clib_download_queue_t *queue, const char *url,
+                            const char *path, clib_download_cb cb, void *data);
+
+/**
+ * Drive every pending download to completion, keeping at most
+ * `concurrency` transfers in flight.
+ *
+ * @return 0 on success, -1 if the event loop failed
+ */
+int clib_download_queue_run(clib_download_queue_t *queue);
+
+/**
+ * Free `queue`, aborting the downloads still in flight and dropping the
+ * pending ones, without calling their callbacks.
+ */
+void clib_download_queue_free(clib_download_queue_t *queue);
+
+/**
+ * Initialize an empty group of downloads on `queue`.
+ */
+void clib_download_group_init(clib_download_group_t *group,
+                              clib_download_queue_t *queue);
+
+/**
+ * Like `clib_download_queue_add()`, but the download is tracked by `group`
+ * and counted in `group->failures` if it does not succeed.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_download_group_add(clib_download_group_t *group, const char *url,
+                            const char *path, clib_download_cb cb, void *data);
+
+/**
+ * Like `clib_download_group_add()`, keeping the response in memory, unless
+ * it did not change since the one that came with `etag` or `last_modified`,
+ * either may be NULL. The download is then `ok`, with a 304 `status` and no
+ * body.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_download_group_revalidate(clib_download_group_t *group,
+                                   const char *url, const char *etag,
+                                   const char *last_modified,
+                                   clib_download_cb cb, void *data);
+
+/**
+ * GET `url` on the calling thread, keeping the response in memory,
+ * conditionally like `clib_download_group_revalidate()`.
+ *
+ * @param share Optional curl share handle
+ *
+ * @return The finished download, to free with `clib_download_free()`, or
+ * NULL on error
+ */
+clib_download_t *clib_download_get(const char *url, const char *etag,
+                                   const char *last_modified, CURLSH *share);
+
+void clib_download_free(clib_download_t *download);
+
+/**
+ * Block until every download of `group` is finished. Downloads of other
+ * groups keep making progress meanwhile, whichever thread is waiting.
+ *
+ * @return 0 on success, -1 if the event loop failed
+ */
+int clib_download_group_wait(clib_download_group_t *group);
+
+#endif
@@ -0,0 +1,256 @@
+//
+// clib-jobserver.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#include "clib-jobserver.h"
+#include "asprintf/asprintf.h"
+#include "debug/debug.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32) || defined(WIN32) || defined(__MINGW32__) ||               \
+    defined(__MINGW64__) || defined(__CYGWIN__)
+#define setenv(k, v, _) _putenv_s(k, v)
+#endif
+
+// the token GNU make puts in the pipe
+#define CLIB_JOBSERVER_TOKEN '+'
+
+// nothing was taken because the jobserver is unusable
+#define CLIB_JOBSERVER_NONE -1
+
+static debug_t debugger;
+
+#define _debug(...)                                                            \
+  ({                                                                           \
+    if (!(debugger.name))                                                      \
+      debug_init(&debugger, "clib-jobserver");                                 \
+    debug(&debugger, __VA_ARGS__);                                             \
+  })
+
+#ifndef _WIN32
+/**
+ * Find the jobserver of a parent `make` in `MAKEFLAGS`, either as a pair of
+ * inherited fds or, since GNU make 4.4, as a named fifo. The job slot this
+ * process was started in is left idle, every make run takes a token.
+ *
+ * @return 0 if one was joined, -1 otherwise
+ */
+
+static int join_parent(clib_jobserver_t *jobserver) {
+  const char *flags = getenv("MAKEFLAGS");
+  const char *auth = NULL;
+  int read_fd = -1;
+  int write_fd = -1;
+
+  if (!flags) {
+    return -1;
+  }
+
+  if (!(auth = strstr(flags, "--jobserver-auth="))) {
+    if ((auth = strstr(flags, "--jobserver-fds="))) {
+      auth += strlen("--jobserver-fds=");
+    }
+  } else {
+    auth += strlen("--jobserver-auth=");
+  }
+
+  if (!auth) {
+    return -1;
+  }
+
+  if (0 == strncmp(auth, "fifo:", 5)) {
+    size_t length = strcspn(auth + 5, " ");
+    char *path = malloc(length + 1);
+
+    if (!path) {
+      return -1;
+    }
+
+    memcpy(path, auth + 5, length);
+    path[length] = 0;
+
+    read_fd = open(path, O_RDWR);
+    free(path);
+
+    if (-1 == read_fd) {
+      return -1;
+    }
+
+    jobserver->read_fd = read_fd;
+    jobserver->write_fd = read_fd;
+    jobserver->opened = 1;
+    return 0;
+  }
+
+  if (2 != sscanf(auth, "%d,%d", &read_fd, &write_fd)) {
+    return -1;
+  }
+
+  // the parent did not mark this command as recursive, so the fds are gone
+  if (-1 == fcntl(read_fd, F_GETFD) || -1 == fcntl(write_fd, F_GETFD)) {
+    _debug("ignoring closed jobserver fds %d,%d", read_fd, write_fd);
+    return -1;
+  }
+
+  jobserver->read_fd = read_fd;
+  jobserver->write_fd = write_fd;
+  return 0;
+}
+
+/**
+ * Create the pipe with a token for every job. There is no implicit job
+ * slot, a thread waiting on the pipe would never notice it being freed.
+ */
+
+static int start_own(clib_jobserver_t *jobserver) {
+  int fds[2];
+  char token = CLIB_JOBSERVER_TOKEN;
+
+  if (0 != pipe(fds)) {
+    return -1;
+  }
+
+  jobserver->read_fd = fds[0];
+  jobserver->write_fd = fds[1];
+  jobserver->owned = 1;
+  jobserver->opened = 1;
+
+  for (int i = 0; i < jobserver->jobs; i++) {
+    if (1 != write(jobserver->write_fd, &token, 1)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+#endif
+
+clib_jobserver_t *clib_jobserver_new(int jobs) {
+  clib_jobserver_t *jobserver = malloc(sizeof(clib_jobserver_t));
+
+  if (NULL == jobserver) {
+    return NULL;
+  }
+
+  memset(jobserver, 0, sizeof(clib_jobserver_t));
+
+  jobserver->read_fd = -1;
+  jobserver->write_fd = -1;
+  jobserver->jobs = jobs > 0 ? jobs : 1;
+
+#ifndef _WIN32
+  if (0 == join_parent(jobserver)) {
+    _debug("joined jobserver %d,%d", jobserver->read_fd, jobserver->write_fd);
+  } else if (0 == start_own(jobserver)) {
+    _debug("started jobserver %d,%d with %d jobs", jobserver->read_fd,
+           jobserver->write_fd, jobserver->jobs);
+  } else {
+    clib_jobserver_free(jobserver);
+    return NULL;
+  }
+#endif
+
+  return jobserver;
+}
+
+int clib_jobserver_export(clib_jobserver_t *jobserver) {
+  const char *flags = getenv("MAKEFLAGS");
+  char *value = NULL;
+  int rc = 0;
+
+  if (!jobserver) {
+    return -1;
+  }
+
+  // inherited from the parent already
+  if (!jobserver->owned) {
+    return 0;
+  }
+
+  asprintf(&value, "%s%s-j%d --jobserver-auth=%d,%d", flags ? flags : "",
+           flags && *flags ? " " : "", jobserver->jobs, jobserver->read_fd,
+           jobserver->write_fd);
+
+  if (!value) {
+    return -1;
+  }
+
+  _debug("MAKEFLAGS=%s", value);
+  rc = setenv("MAKEFLAGS", value, 1);
+  free(value);
+
+  return 0 == rc ? 0 : -1;
+}
+
+int clib_jobserver_acquire(clib_jobserver_t *jobserver, int *token) {
+  *token = CLIB_JOBSERVER_NONE;
+
+  if (!jobserver) {
+    return -1;
+  }
+
+#ifdef _WIN32
+  return -1;
+#else
+  while (1) {
+    unsigned char c = 0;
+    ssize_t n = read(jobserver->read_fd, &c, 1);
+
+    if (1 == n) {
+      *token = c;
+      return 0;
+    }
+
+    if (-1 == n && EINTR == errno) {
+      continue;
+    }
+
+    return -1;
+  }
+#endif
+}
+
+void clib_jobserver_release(clib_jobserver_t *jobserver, int token) {
+  if (!jobserver || CLIB_JOBSERVER_NONE == token) {
+    return;
+  }
+
+#ifndef _WIN32
+  unsigned char c = (unsigned char)token;
+
+  while (-1 == write(jobserver->write_fd, &c, 1) && EINTR == errno) {
+  }
+#endif
+}
+
+void clib_jobserver_free(clib_jobserver_t *jobserver) {
+  if (!jobserver) {
+    return;
+  }
+
+#ifndef _WIN32
+  if (jobserver->opened) {
+    if (-1 != jobserver->read_fd) {
+      close(jobserver->read_fd);
+    }
+
+    if (-1 != jobserver->write_fd &&
+        jobserver->write_fd != jobserver->read_fd) {
+      close(jobserver->write_fd);
+    }
+  }
+#endif
+
+  free(jobserver);
+}
@@ -0,0 +1,58 @@
+//
+// clib-jobserver.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_JOBSERVER_H
+#define CLIB_JOBSERVER_H 1
+
+typedef struct clib_jobserver clib_jobserver_t;
+
+/**
+ * A GNU make jobserver: a pipe holding one token per job slot. Every
+ * `make` started with `MAKEFLAGS` exported takes its tokens from the same
+ * pipe, so the packages being built and the files of each package share
+ * a single job budget.
+ */
+struct clib_jobserver {
+  int read_fd;
+  int write_fd;
+  int jobs;
+  int owned;  // the pipe was created here rather than inherited
+  int opened; // the fds were opened here and must be closed
+};
+
+/**
+ * Join the jobserver of a parent `make` found in `MAKEFLAGS`, or start one
+ * allowing `jobs` jobs at once.
+ *
+ * @return A new jobserver, or NULL on error
+ */
+clib_jobserver_t *clib_jobserver_new(int jobs);
+
+/**
+ * Point `MAKEFLAGS` at the jobserver so every `make` run from now on
+ * takes part in it.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_jobserver_export(clib_jobserver_t *jobserver);
+
+/**
+ * Block until a job slot is free and take it into `token`. A `make` run
+ * while holding it uses it for its first job, as its implicit slot.
+ *
+ * @return 0 on success, -1 if the jobserver is gone and nothing is limited
+ */
+int clib_jobserver_acquire(clib_jobserver_t *jobserver, int *token);
+
+/**
+ * Give back a job slot taken by `clib_jobserver_acquire()`.
+ */
+void clib_jobserver_release(clib_jobserver_t *jobserver, int token);
+
+void clib_jobserver_free(clib_jobserver_t *jobserver);
+
+#endif
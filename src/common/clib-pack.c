@@ -0,0 +1,593 @@
+//
+// clib-pack.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+// openat(), mmap() and friends
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "clib-pack.h"
+#include "clib-tree.h"
+#include "mkdirp/mkdirp.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define TRAILER_HEADER "clib-pack 1 "
+
+typedef struct {
+  char *path;
+  int executable;
+  int deflated;
+  char *data; // the content as packed
+  size_t packed;
+  size_t size;
+} pack_file_t;
+
+typedef struct {
+  pack_file_t *files;
+  size_t count;
+  size_t capacity;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+#endif
+} pack_writer_t;
+
+int clib_pack_has_zlib(void) {
+#ifdef HAVE_ZLIB
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Read `size` bytes from `fd`, which short reads may take several calls.
+ */
+
+static int read_all(int fd, char *buffer, size_t size) {
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t n = read(fd, buffer + done, size - done);
+
+    if (n <= 0) {
+      return -1;
+    }
+
+    done += n;
+  }
+
+  return 0;
+}
+
+static int write_all(int fd, const char *buffer, size_t size) {
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t n = write(fd, buffer + done, size - done);
+
+    if (n <= 0) {
+      return -1;
+    }
+
+    done += n;
+  }
+
+  return 0;
+}
+
+/**
+ * Deflate the content of `file` if it gets smaller, keep it as is
+ * otherwise.
+ */
+
+static void deflate_file(pack_file_t *file) {
+#ifdef HAVE_ZLIB
+  uLongf packed = compressBound(file->size);
+  char *data = malloc(packed);
+
+  if (NULL == data ||
+      Z_OK != compress2((Bytef *)data, &packed, (const Bytef *)file->data,
+                        file->size, Z_DEFAULT_COMPRESSION) ||
+      packed >= file->size) {
+    free(data);
+    return;
+  }
+
+  free(file->data);
+  file->data = data;
+  file->packed = packed;
+  file->deflated = 1;
+#else
+  (void)file;
+#endif
+}
+
+/**
+ * Read and deflate a file of the directory being packed. Called from the
+ * workers of the walk.
+ */
+
+static int add_file(int dir_fd, const char *name, const char *path,
+                    const struct stat *st, void *data) {
+  pack_writer_t *writer = data;
+  pack_file_t file;
+  int fd = -1;
+  int rc = -1;
+
+  // a line of the table of contents each
+  if (NULL != strchr(path, '\n')) {
+    return -1;
+  }
+
+  memset(&file, 0, sizeof(pack_file_t));
+  file.executable = 0 != (st->st_mode & S_IXUSR);
+  file.size = file.packed = st->st_size;
+
+  if (NULL == (file.path = malloc(strlen(path) + 1)) ||
+      NULL == (file.data = malloc(file.size + 1)) ||
+      -1 == (fd = openat(dir_fd, name, O_RDONLY)) ||
+      0 != read_all(fd, file.data, file.size)) {
+    goto cleanup;
+  }
+
+  strcpy(file.path, path);
+  deflate_file(&file);
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&writer->mutex);
+#endif
+
+  if (writer->count == writer->capacity) {
+    size_t capacity = writer->capacity ? 2 * writer->capacity : 64;
+    pack_file_t *files =
+        realloc(writer->files, capacity * sizeof(pack_file_t));
+
+    if (NULL != files) {
+      writer->files = files;
+      writer->capacity = capacity;
+    }
+  }
+
+  if (writer->count < writer->capacity) {
+    writer->files[writer->count++] = file;
+    rc = 0;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&writer->mutex);
+#endif
+
+cleanup:
+  if (-1 != fd) {
+    close(fd);
+  }
+
+  if (0 != rc) {
+    free(file.path);
+    free(file.data);
+  }
+
+  return rc;
+}
+
+static int compare_files(const void *a, const void *b) {
+  return strcmp(((const pack_file_t *)a)->path,
+                ((const pack_file_t *)b)->path);
+}
+
+int clib_pack_write(clib_pool_t *pool, const char *dir, const char *path) {
+  pack_writer_t writer;
+  unsigned long long offset = 0;
+  unsigned long long toc = 0;
+  FILE *file = NULL;
+  int rc = -1;
+
+  memset(&writer, 0, sizeof(pack_writer_t));
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&writer.mutex, NULL);
+#endif
+
+  if (0 != clib_tree_walk(pool, dir, add_file, &writer) ||
+      NULL == (file = fopen(path, "wb"))) {
+    goto cleanup;
+  }
+
+  // the same files always make the same pack
+  if (writer.count > 0) {
+    qsort(writer.files, writer.count, sizeof(pack_file_t), compare_files);
+  }
+
+  for (size_t i = 0; i < writer.count; i++) {
+    if (writer.files[i].packed !=
+        fwrite(writer.files[i].data, 1, writer.files[i].packed, file)) {
+      goto cleanup;
+    }
+  }
+
+  for (size_t i = 0; i < writer.count; i++) {
+    pack_file_t *entry = &writer.files[i];
+    int length = fprintf(file, "%c %c %llu %llu %llu %s\n",
+                         entry->executable ? 'x' : '-',
+                         entry->deflated ? 'z' : 's', offset,
+                         (unsigned long long)entry->packed,
+                         (unsigned long long)entry->size, entry->path);
+
+    if (length < 0) {
+      goto cleanup;
+    }
+
+    offset += entry->packed;
+    toc += length;
+  }
+
+  if (CLIB_PACK_TRAILER_SIZE !=
+      fprintf(file, TRAILER_HEADER "%016llx %016llx\n", offset, toc)) {
+    goto cleanup;
+  }
+
+  rc = 0;
+
+cleanup:
+  if (file && 0 != fclose(file)) {
+    rc = -1;
+  }
+
+  for (size_t i = 0; i < writer.count; i++) {
+    free(writer.files[i].path);
+    free(writer.files[i].data);
+  }
+
+  free(writer.files);
+#ifdef HAVE_PTHREADS
+  pthread_mutex_destroy(&writer.mutex);
+#endif
+
+  return rc;
+}
+
+/**
+ * @return 1 if `path` stays below the directory it is relative to
+ */
+
+static int is_safe_path(const char *path) {
+  const char *part = path;
+
+  if ('/' == *path || 0 == *path) {
+    return 0;
+  }
+
+  while (part) {
+    if (0 == strncmp(part, "..", 2) && ('/' == part[2] || 0 == part[2])) {
+      return 0;
+    }
+
+    if ((part = strchr(part, '/'))) {
+      part++;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Parse a number of the table of contents, followed by a space.
+ */
+
+static const char *parse_number(const char *cursor, const char *end,
+                                uint64_t *number) {
+  *number = 0;
+
+  if (cursor >= end || *cursor < '0' || *cursor > '9') {
+    return NULL;
+  }
+
+  while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+    *number = 10 * *number + (*cursor++ - '0');
+  }
+
+  return cursor < end && ' ' == *cursor ? cursor + 1 : NULL;
+}
+
+/**
+ * Locate the table of contents of `pack->data` from its trailer, and list
+ * its entries.
+ */
+
+static int parse_pack(clib_pack_t *pack) {
+  char trailer[CLIB_PACK_TRAILER_SIZE + 1];
+  unsigned long long offset = 0;
+  unsigned long long toc = 0;
+  const char *cursor = NULL;
+  const char *end = NULL;
+  size_t lines = 0;
+
+  if (pack->size < CLIB_PACK_TRAILER_SIZE) {
+    return -1;
+  }
+
+  memcpy(trailer, pack->data + pack->size - CLIB_PACK_TRAILER_SIZE,
+         CLIB_PACK_TRAILER_SIZE);
+  trailer[CLIB_PACK_TRAILER_SIZE] = 0;
+
+  if (0 != strncmp(TRAILER_HEADER, trailer, strlen(TRAILER_HEADER)) ||
+      2 != sscanf(trailer + strlen(TRAILER_HEADER), "%16llx %16llx", &offset,
+                  &toc) ||
+      offset + toc + CLIB_PACK_TRAILER_SIZE != pack->size) {
+    return -1;
+  }
+
+  cursor = pack->data + offset;
+  end = cursor + toc;
+
+  for (const char *c = cursor; c < end; c++) {
+    lines += '\n' == *c;
+  }
+
+  if (lines > 0 &&
+      NULL == (pack->entries = calloc(lines, sizeof(clib_pack_entry_t)))) {
+    return -1;
+  }
+
+  while (cursor < end) {
+    const char *newline = memchr(cursor, '\n', end - cursor);
+    clib_pack_entry_t *entry = NULL;
+
+    if (NULL == newline || newline - cursor < 4 || ' ' != cursor[1] ||
+        ' ' != cursor[3] || ('x' != cursor[0] && '-' != cursor[0]) ||
+        ('z' != cursor[2] && 's' != cursor[2])) {
+      return -1;
+    }
+
+    entry = &pack->entries[pack->count];
+    entry->executable = 'x' == cursor[0];
+    entry->deflated = 'z' == cursor[2];
+    cursor += 4;
+
+    if (!(cursor = parse_number(cursor, newline, &entry->offset)) ||
+        !(cursor = parse_number(cursor, newline, &entry->packed)) ||
+        !(cursor = parse_number(cursor, newline, &entry->size)) ||
+        entry->offset + entry->packed > offset ||
+        (!entry->deflated && entry->packed != entry->size) ||
+        NULL == (entry->path = malloc(newline - cursor + 1))) {
+      return -1;
+    }
+
+    memcpy(entry->path, cursor, newline - cursor);
+    entry->path[newline - cursor] = 0;
+    pack->count++;
+
+    if (!is_safe_path(entry->path)) {
+      return -1;
+    }
+
+    cursor = newline + 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Read the pack at `path`, mapped or with a single read.
+ */
+
+static clib_pack_t *load_pack(const char *path, int map) {
+  clib_pack_t *pack = calloc(1, sizeof(clib_pack_t));
+  struct stat st;
+  int fd = -1;
+
+  if (NULL == pack || -1 == (fd = open(path, O_RDONLY)) ||
+      0 != fstat(fd, &st) || st.st_size < CLIB_PACK_TRAILER_SIZE) {
+    goto error;
+  }
+
+  pack->size = st.st_size;
+
+#ifndef _WIN32
+  if (map) {
+    pack->data = mmap(NULL, pack->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (MAP_FAILED == pack->data) {
+      pack->data = NULL;
+      goto error;
+    }
+
+    pack->mapped = 1;
+  }
+#endif
+
+  if (!pack->mapped && (NULL == (pack->data = malloc(pack->size)) ||
+                        0 != read_all(fd, pack->data, pack->size))) {
+    goto error;
+  }
+
+  close(fd);
+  fd = -1;
+
+  if (0 != parse_pack(pack)) {
+    goto error;
+  }
+
+  return pack;
+
+error:
+  if (-1 != fd) {
+    close(fd);
+  }
+
+  clib_pack_close(pack);
+  return NULL;
+}
+
+clib_pack_t *clib_pack_open(const char *path) { return load_pack(path, 1); }
+
+const clib_pack_entry_t *clib_pack_find(const clib_pack_t *pack,
+                                        const char *path) {
+  size_t low = 0;
+  size_t high = pack->count;
+
+  // sorted by path when written
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    int cmp = strcmp(pack->entries[middle].path, path);
+
+    if (0 == cmp) {
+      return &pack->entries[middle];
+    }
+
+    if (cmp < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return NULL;
+}
+
+char *clib_pack_read(const clib_pack_t *pack, const clib_pack_entry_t *entry) {
+  char *content = malloc(entry->size + 1);
+
+  if (NULL == content) {
+    return NULL;
+  }
+
+  if (entry->deflated) {
+#ifdef HAVE_ZLIB
+    uLongf size = entry->size;
+
+    if (Z_OK != uncompress((Bytef *)content, &size,
+                           (const Bytef *)pack->data + entry->offset,
+                           entry->packed) ||
+        size != entry->size) {
+      free(content);
+      return NULL;
+    }
+#else
+    free(content);
+    return NULL;
+#endif
+  } else {
+    memcpy(content, pack->data + entry->offset, entry->size);
+  }
+
+  content[entry->size] = 0;
+  return content;
+}
+
+void clib_pack_close(clib_pack_t *pack) {
+  if (NULL == pack) {
+    return;
+  }
+
+  for (size_t i = 0; i < pack->count; i++) {
+    free(pack->entries[i].path);
+  }
+
+  free(pack->entries);
+
+#ifndef _WIN32
+  if (pack->mapped) {
+    munmap(pack->data, pack->size);
+  } else
+#endif
+  {
+    free(pack->data);
+  }
+
+  free(pack);
+}
+
+/**
+ * Create the file of `entry` at `path`.
+ */
+
+static int extract_entry(const clib_pack_t *pack,
+                         const clib_pack_entry_t *entry, const char *path) {
+  char *content = NULL;
+  const char *data = pack->data + entry->offset;
+  int fd = -1;
+  int rc = -1;
+
+  if (entry->deflated &&
+      NULL == (data = content = clib_pack_read(pack, entry))) {
+    return -1;
+  }
+
+  // may be a hard link into the package store
+  unlink(path);
+
+  if (-1 != (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC,
+                       entry->executable ? 0755 : 0644))) {
+    rc = write_all(fd, data, entry->size);
+
+    if (0 != close(fd)) {
+      rc = -1;
+    }
+  }
+
+  free(content);
+  return rc;
+}
+
+int clib_pack_extract(const char *path, const char *dir) {
+  clib_pack_t *pack = load_pack(path, 0);
+  char file[BUFSIZ];
+  char parent[BUFSIZ] = "";
+  int rc = 0;
+
+  if (NULL == pack) {
+    return -1;
+  }
+
+  if (0 != mkdirp(dir, 0755)) {
+    clib_pack_close(pack);
+    return -1;
+  }
+
+  for (size_t i = 0; 0 == rc && i < pack->count; i++) {
+    const clib_pack_entry_t *entry = &pack->entries[i];
+    int length = snprintf(file, sizeof(file), "%s/%s", dir, entry->path);
+    char *slash = NULL;
+
+    if (length < 0 || length >= (int)sizeof(file)) {
+      rc = -1;
+      break;
+    }
+
+    // sorted by path, most files are in the directory of the one before
+    if ((slash = strrchr(file, '/')) &&
+        (strlen(parent) != (size_t)(slash - file) ||
+         0 != strncmp(parent, file, slash - file))) {
+      *slash = 0;
+      strcpy(parent, file);
+      *slash = '/';
+
+      if (0 != mkdirp(parent, 0755)) {
+        rc = -1;
+        break;
+      }
+    }
+
+    rc = extract_entry(pack, entry, file);
+  }
+
+  clib_pack_close(pack);
+  return rc;
+}
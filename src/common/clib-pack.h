@@ -0,0 +1,99 @@
+//
+// clib-pack.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_PACK_H
+#define CLIB_PACK_H 1
+
+#include "clib-pool.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A pack holds the files of a directory in a single file: the content of
+ * every file, deflated on its own when zlib is available and it pays off,
+ * then a table of contents, then a trailer of a fixed size locating it.
+ * Any file can be read at random from a mapped pack, and a whole pack is
+ * extracted after reading it at once.
+ *
+ * The table of contents has a line per file, sorted by path:
+ *
+ *   <x|-> <z|s> <offset> <packed size> <size> <path>
+ *
+ * "x" marks executables, "z" deflated content and "s" stored content.
+ */
+
+/**
+ * Bytes of the trailer, "clib-pack 1 <toc offset> <toc size>\n" with both
+ * numbers in 16 hex digits.
+ */
+#define CLIB_PACK_TRAILER_SIZE 46
+
+typedef struct {
+  char *path; // relative to the packed directory
+  int executable;
+  int deflated;
+  uint64_t offset; // of the content in the pack
+  uint64_t packed; // bytes of the content in the pack
+  uint64_t size;   // bytes of the file
+} clib_pack_entry_t;
+
+typedef struct {
+  char *data;
+  size_t size;
+  int mapped; // unmapped on close, freed otherwise
+  clib_pack_entry_t *entries;
+  size_t count;
+} clib_pack_t;
+
+/**
+ * @return 1 if deflated content can be written and read, 0 if every file
+ * is stored as is
+ */
+int clib_pack_has_zlib(void);
+
+/**
+ * Pack the files below `dir` into a new file at `path`. The files are read
+ * and deflated in parallel on `pool`, or on the calling thread if it is
+ * NULL.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_pack_write(clib_pool_t *pool, const char *dir, const char *path);
+
+/**
+ * Map the pack at `path` to read its files at random.
+ *
+ * @return The pack, to close with `clib_pack_close()`, or NULL if it
+ * cannot be read or is not a pack
+ */
+clib_pack_t *clib_pack_open(const char *path);
+
+/**
+ * @return The entry of the file at `path` in `pack`, or NULL if there is
+ * none
+ */
+const clib_pack_entry_t *clib_pack_find(const clib_pack_t *pack,
+                                        const char *path);
+
+/**
+ * @return The content of `entry`, `entry->size` bytes and a NUL, or NULL
+ * on error, e.g. if it is deflated and zlib is not available
+ */
+char *clib_pack_read(const clib_pack_t *pack, const clib_pack_entry_t *entry);
+
+void clib_pack_close(clib_pack_t *pack);
+
+/**
+ * Create the files of the pack at `path` below `dir`, which is created if
+ * needed. The pack is read at once, and files already there are replaced,
+ * never written through.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_pack_extract(const char *path, const char *dir);
+
+#endif
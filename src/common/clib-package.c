@@ -11,7 +11,10 @@
 
 #include "asprintf/asprintf.h"
 #include "clib-cache.h"
+#include "clib-download.h"
 #include "clib-package.h"
+#include "clib-pool.h"
+#include "clib-refs.h"
 #include "debug/debug.h"
 #include "fs/fs.h"
 #include "hash/hash.h"
@@ -46,33 +49,149 @@
 
 #define GITHUB_CONTENT_URL "https://raw.githubusercontent.com/"
 #define GITHUB_CONTENT_URL_WITH_TOKEN "https://%s@raw.githubusercontent.com/"
+#define GITHUB_URL "https://github.com/"
+#define GITHUB_URL_WITH_TOKEN "https://%s@github.com/"
+#define GITHUB_REFS_PATH ".git/info/refs?service=git-upload-pack"
 
 #if defined(_WIN32) || defined(WIN32) || defined(__MINGW32__) ||               \
     defined(__MINGW64__) || defined(__CYGWIN__)
 #define setenv(k, v, _) _putenv_s(k, v)
+#define unsetenv(k) _putenv_s(k, "")
 #define realpath(a, b) _fullpath(a, b, strlen(a))
 #endif
 
 static hash_t *visited_packages = 0;
+static hash_t *package_flights = 0;
+static clib_download_queue_t *downloads = 0;
+static clib_pool_t *workers = 0;
+static hash_t *prefetched_manifests = 0;
+static hash_t *repo_refs = 0;
+static hash_t *refreshed_manifests = 0;
+
+typedef struct fetch_package_file_data fetch_package_file_data_t;
+struct fetch_package_file_data {
+  clib_package_t *pkg;
+  char *file;
+  int verbose;
+  int *failures;
+};
 
+/**
+ * The outcome of the first install of an author/name@version, shared with
+ * every install of the same package started meanwhile.
+ */
+
+typedef struct {
+  int refs;
+  int done;
+  int rc;
 #ifdef HAVE_PTHREADS
-typedef struct fetch_package_file_thread_data fetch_package_file_thread_data_t;
-struct fetch_package_file_thread_data {
+  pthread_cond_t cond;
+#endif
+} package_flight_t;
+
+/**
+ * The state of a package install between queueing its downloads and
+ * finishing it.
+ */
+
+typedef struct {
   clib_package_t *pkg;
   const char *dir;
-  char *file;
+  char *pkg_dir;
+  int verbose;
+  int done;     // nothing to do, e.g. the package was already installed
+  int download; // sources are downloaded instead of loaded from the cache
+  int skip_dependencies; // installed separately, see `install_packages()`
+  package_flight_t *flight;
+  int joined; // `flight` belongs to another install, which is waited for
+  int claim;  // held on the cache entry until the package is saved to it
+  int failures;
+  int makefile_failures;
+  clib_download_group_t group;
+} package_install_t;
+
+/**
+ * A manifest requested ahead of time by `prefetch_manifests()`.
+ */
+
+typedef struct {
+  char *url;
+  char *body;
+  char *stale; // an expired manifest being revalidated
+  long status;
+  char *author;
+  char *name;
+  char *version;
+  const char *file;
+  clib_cache_validators_t validators; // of the response
+  clib_download_group_t group;
+} manifest_prefetch_t;
+
+/**
+ * A stale manifest served from the cache, revalidated in the background by
+ * `refresh_manifest()` for the next run.
+ */
+
+typedef struct {
+  char *author;
+  char *name;
+  char *version;
+  clib_cache_validators_t validators; // of the cached manifest
+  clib_download_group_t group;
+} manifest_refresh_t;
+
+/**
+ * The refs of a repository, looked up once to resolve the versions of its
+ * packages to commits.
+ */
+
+typedef struct {
+  char *body; // NULL if the lookup failed
+  size_t size;
+  int done;
+  list_t *waiting; // slugs to prefetch once looked up
+  clib_download_group_t group;
+} repo_refs_t;
+
+typedef struct package_graph package_graph_t;
+typedef struct package_node package_node_t;
+
+/**
+ * The transitive dependencies of a list of packages, deduplicated by slug.
+ */
+
+struct package_graph {
+  hash_t *nodes; // slug -> package_node_t
+  list_t *order; // nodes breadth first from the roots once resolved
+  clib_pool_t *pool;
+  clib_pool_group_t group;
+  const char *dir;
   int verbose;
-  pthread_t thread;
-  pthread_attr_t attr;
-  void *data;
+  int failures;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+#endif
 };
 
+struct package_node {
+  char *slug;
+  clib_package_t *pkg;
+  list_t *dependents; // nodes that can only be installed after this one
+  int unfinished;     // dependencies not installed yet
+  int scheduled;
+  package_graph_t *graph;
+};
+
+#ifdef HAVE_PTHREADS
 typedef struct clib_package_lock clib_package_lock_t;
 struct clib_package_lock {
   pthread_mutex_t mutex;
+  pthread_mutex_t env; // held while a command runs in a changed environment
 };
 
-static clib_package_lock_t lock = {PTHREAD_MUTEX_INITIALIZER};
+static clib_package_lock_t lock = {PTHREAD_MUTEX_INITIALIZER,
+                                   PTHREAD_MUTEX_INITIALIZER};
 
 #endif
 
@@ -124,6 +243,21 @@ static inline list_t *parse_package_deps(JSON_Object *);
 
 static inline int install_packages(list_t *, const char *, int);
 
+static clib_download_queue_t *get_download_queue(void);
+
+static clib_pool_t *get_worker_pool(void);
+
+static void prefetch_manifests(list_t *);
+
+static int start_package_install(package_install_t *);
+
+static int finish_package_install(package_install_t *);
+
+static void package_install_init(package_install_t *, clib_package_t *,
+                                 const char *, int);
+
+static void package_install_destroy(package_install_t *);
+
 void clib_package_set_opts(clib_package_opts_t o) {
   if (1 == opts.skip_cache && 0 == o.skip_cache) {
     opts.skip_cache = 0;
@@ -341,69 +475,411 @@ done:
   return list;
 }
 
+static inline void graph_lock(package_graph_t *graph) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&graph->mutex);
+#endif
+}
+
+static inline void graph_unlock(package_graph_t *graph) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&graph->mutex);
+#endif
+}
+
+static void resolve_package_node(void *);
+
+static void install_package_node(void *);
+
+/**
+ * Get the node of `slug`, adding it to `graph` and scheduling the fetch
+ * of its manifest if it was not seen before. Called with the graph locked.
+ */
+
+static package_node_t *graph_node(package_graph_t *graph, char *slug) {
+  package_node_t *node = hash_get(graph->nodes, slug);
+
+  if (node) {
+    free(slug);
+    return node;
+  }
+
+  if (!(node = malloc(sizeof(package_node_t)))) {
+    free(slug);
+    return NULL;
+  }
+
+  memset(node, 0, sizeof(package_node_t));
+  node->slug = slug;
+  node->graph = graph;
+
+  if (!(node->dependents = list_new())) {
+    free(slug);
+    free(node);
+    return NULL;
+  }
+
+  hash_set(graph->nodes, node->slug, node);
+  list_rpush(graph->order, list_node_new(node));
+
+  if (0 != clib_pool_submit(graph->pool, &graph->group, resolve_package_node,
+                            node)) {
+    graph->failures++;
+  }
+
+  return node;
+}
+
+/**
+ * Record that `dependency` must be installed before `node`.
+ */
+
+static void graph_edge(package_node_t *node, package_node_t *dependency) {
+  list_rpush(dependency->dependents, list_node_new(node));
+  node->unfinished++;
+}
+
+/**
+ * Fetch the manifest of `node` and discover its dependencies.
+ */
+
+static void resolve_package_node(void *data) {
+  package_node_t *node = data;
+  package_graph_t *graph = node->graph;
+  clib_package_t *pkg = clib_package_new_from_slug(node->slug, graph->verbose);
+  list_iterator_t *iterator = NULL;
+  list_node_t *item = NULL;
+
+  graph_lock(graph);
+
+  node->pkg = pkg;
+
+  if (NULL == pkg) {
+    graph->failures++;
+    goto done;
+  }
+
+  if (NULL == pkg->dependencies) {
+    goto done;
+  }
+
+  iterator = list_iterator_new(pkg->dependencies, LIST_HEAD);
+  while ((item = list_iterator_next(iterator))) {
+    clib_package_dependency_t *dep = item->val;
+    package_node_t *dependency = NULL;
+    char *slug = clib_package_slug(dep->author, dep->name, dep->version);
+
+    if (NULL == slug || !(dependency = graph_node(graph, slug))) {
+      graph->failures++;
+      break;
+    }
+
+    if (dependency != node) {
+      graph_edge(node, dependency);
+    }
+  }
+  list_iterator_destroy(iterator);
+
+done:
+  graph_unlock(graph);
+}
+
+/**
+ * Queue `node` on the pool. Called with the graph locked.
+ */
+
+static void schedule_package_node(package_node_t *node) {
+  node->scheduled = 1;
+
+  if (0 != clib_pool_submit(node->graph->pool, &node->graph->group,
+                            install_package_node, node)) {
+    node->graph->failures++;
+  }
+}
+
+/**
+ * Install `node` alone, then schedule the dependents it was the last
+ * missing dependency of.
+ */
+
+static void install_package_node(void *data) {
+  package_node_t *node = data;
+  package_graph_t *graph = node->graph;
+  package_install_t install;
+  list_iterator_t *iterator = NULL;
+  list_node_t *item = NULL;
+  int rc = 0;
+
+  package_install_init(&install, node->pkg, graph->dir, graph->verbose);
+  install.skip_dependencies = 1;
+
+  rc = start_package_install(&install);
+
+  if (0 == rc) {
+    rc = finish_package_install(&install);
+  }
+
+  package_install_destroy(&install);
+
+  graph_lock(graph);
+
+  if (0 != rc) {
+    graph->failures++;
+    goto done;
+  }
+
+  iterator = list_iterator_new(node->dependents, LIST_HEAD);
+  while ((item = list_iterator_next(iterator))) {
+    package_node_t *dependent = item->val;
+    if (0 == --dependent->unfinished && !dependent->scheduled) {
+      schedule_package_node(dependent);
+    }
+  }
+  list_iterator_destroy(iterator);
+
+done:
+  graph_unlock(graph);
+}
+
+/**
+ * Append the node of `dep` to `order` unless it is in it already.
+ */
+
+static int order_package_node(package_graph_t *graph, list_t *order,
+                              hash_t *ordered,
+                              clib_package_dependency_t *dep) {
+  package_node_t *node = NULL;
+  char *slug = clib_package_slug(dep->author, dep->name, dep->version);
+
+  if (NULL == slug)
+    return -1;
+
+  node = hash_get(graph->nodes, slug);
+  free(slug);
+
+  if (node && NULL == hash_get(ordered, node->slug)) {
+    hash_set(ordered, node->slug, node);
+    list_rpush(order, list_node_new(node));
+  }
+
+  return 0;
+}
+
+/**
+ * Put the nodes of a resolved graph breadth first from `roots`, each in
+ * the order its dependencies are declared. The manifests are fetched
+ * concurrently, so the order the nodes were found in changes from one
+ * run to the next.
+ */
+
+static int order_package_graph(package_graph_t *graph, list_t *roots) {
+  list_t *order = NULL;
+  hash_t *ordered = NULL;
+  list_iterator_t *iterator = NULL;
+  list_node_t *item = NULL;
+  int rc = -1;
+
+  if (!(order = list_new()) || !(ordered = hash_new()))
+    goto cleanup;
+
+  iterator = list_iterator_new(roots, LIST_HEAD);
+  while ((item = list_iterator_next(iterator))) {
+    if (0 != order_package_node(graph, order, ordered, item->val))
+      goto cleanup;
+  }
+  list_iterator_destroy(iterator);
+  iterator = NULL;
+
+  // `order` is the queue of the walk, it grows while it is read
+  for (list_node_t *next = order->head; next; next = next->next) {
+    package_node_t *node = next->val;
+
+    if (NULL == node->pkg->dependencies)
+      continue;
+
+    iterator = list_iterator_new(node->pkg->dependencies, LIST_HEAD);
+    while ((item = list_iterator_next(iterator))) {
+      if (0 != order_package_node(graph, order, ordered, item->val))
+        goto cleanup;
+    }
+    list_iterator_destroy(iterator);
+    iterator = NULL;
+  }
+
+  // every node is reachable from the roots, this only keeps them all owned
+  iterator = list_iterator_new(graph->order, LIST_HEAD);
+  while ((item = list_iterator_next(iterator))) {
+    package_node_t *node = item->val;
+    if (NULL == hash_get(ordered, node->slug)) {
+      hash_set(ordered, node->slug, node);
+      list_rpush(order, list_node_new(node));
+    }
+  }
+
+  list_destroy(graph->order);
+  graph->order = order;
+  order = NULL;
+  rc = 0;
+
+cleanup:
+  if (iterator)
+    list_iterator_destroy(iterator);
+  if (ordered)
+    hash_free(ordered);
+  if (order)
+    list_destroy(order);
+  return rc;
+}
+
+static void package_graph_free(package_graph_t *graph) {
+  list_node_t *item = NULL;
+
+  if (graph->pool) {
+    clib_pool_group_wait(graph->pool, &graph->group);
+  }
+
+  if (graph->order) {
+    while ((item = list_lpop(graph->order))) {
+      package_node_t *node = item->val;
+      if (node->pkg) {
+        clib_package_free(node->pkg);
+      }
+      list_destroy(node->dependents);
+      free(node->slug);
+      free(node);
+      free(item);
+    }
+    list_destroy(graph->order);
+  }
+
+  if (graph->nodes) {
+    hash_free(graph->nodes);
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_destroy(&graph->mutex);
+#endif
+}
+
+/**
+ * Install the packages of `list` and all of their dependencies in two
+ * phases. The whole dependency graph is resolved first, fetching the
+ * manifests concurrently, then every package is installed on the worker
+ * pool as soon as all of its own dependencies are installed.
+ */
+
 static inline int install_packages(list_t *list, const char *dir, int verbose) {
-  list_node_t *node = NULL;
+  package_graph_t graph;
   list_iterator_t *iterator = NULL;
+  list_node_t *item = NULL;
+  hash_t *names = NULL;
   int rc = -1;
-  list_t *freelist = NULL;
 
   if (!list || !dir)
+    return -1;
+
+  prefetch_manifests(list);
+
+  memset(&graph, 0, sizeof(package_graph_t));
+  graph.dir = dir;
+  graph.verbose = verbose;
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&graph.mutex, NULL);
+#endif
+
+  if (!(graph.nodes = hash_new()) || !(graph.order = list_new()))
     goto cleanup;
 
-  iterator = list_iterator_new(list, LIST_HEAD);
-  if (NULL == iterator)
+  if (!(graph.pool = get_worker_pool()))
     goto cleanup;
 
-  freelist = list_new();
+  clib_pool_group_init(&graph.group);
 
-  while ((node = list_iterator_next(iterator))) {
-    clib_package_dependency_t *dep = NULL;
-    char *slug = NULL;
-    clib_package_t *pkg = NULL;
-    int error = 1;
+  // phase 1: resolve the graph
+  graph_lock(&graph);
+  iterator = list_iterator_new(list, LIST_HEAD);
+  while ((item = list_iterator_next(iterator))) {
+    clib_package_dependency_t *dep = item->val;
+    char *slug = clib_package_slug(dep->author, dep->name, dep->version);
+    if (NULL == slug || NULL == graph_node(&graph, slug)) {
+      graph.failures++;
+      break;
+    }
+  }
+  list_iterator_destroy(iterator);
+  graph_unlock(&graph);
 
-    dep = (clib_package_dependency_t *)node->val;
-    slug = clib_package_slug(dep->author, dep->name, dep->version);
-    if (NULL == slug)
-      goto loop_cleanup;
+  clib_pool_group_wait(graph.pool, &graph.group);
 
-    pkg = clib_package_new_from_slug(slug, verbose);
-    if (NULL == pkg)
-      goto loop_cleanup;
+  if (0 != graph.failures || 0 != order_package_graph(&graph, list))
+    goto cleanup;
 
-    if (-1 == clib_package_install(pkg, dir, verbose))
-      goto loop_cleanup;
+  // different versions of the same package are installed in the same
+  // directory, so only the first one found breadth first may win
+  names = hash_new();
+  iterator = list_iterator_new(graph.order, LIST_HEAD);
+  while ((item = list_iterator_next(iterator))) {
+    package_node_t *node = item->val;
+    package_node_t *first = NULL;
 
-    list_rpush(freelist, list_node_new(pkg));
-    error = 0;
+    if (NULL == node->pkg->name)
+      continue;
 
-  loop_cleanup:
-    if (slug)
-      free(slug);
-    if (error) {
-      list_iterator_destroy(iterator);
-      iterator = NULL;
-      rc = -1;
-      goto cleanup;
+    if ((first = hash_get(names, node->pkg->name))) {
+      graph_edge(node, first);
+    } else {
+      hash_set(names, node->pkg->name, node);
     }
   }
+  list_iterator_destroy(iterator);
 
-  rc = 0;
+  // phase 2: install the leaves, they schedule their dependents
+  while (1) {
+    package_node_t *blocked = NULL;
 
-cleanup:
-  if (iterator)
+    graph_lock(&graph);
+    iterator = list_iterator_new(graph.order, LIST_HEAD);
+    while ((item = list_iterator_next(iterator))) {
+      package_node_t *node = item->val;
+      if (!node->scheduled && 0 == node->unfinished) {
+        schedule_package_node(node);
+      }
+    }
     list_iterator_destroy(iterator);
+    graph_unlock(&graph);
 
-  if (freelist) {
-    iterator = list_iterator_new(freelist, LIST_HEAD);
-    while ((node = list_iterator_next(iterator))) {
-      clib_package_t *pkg = node->val;
-      if (pkg)
-        clib_package_free(pkg);
+    clib_pool_group_wait(graph.pool, &graph.group);
+
+    if (0 != graph.failures)
+      break;
+
+    // anything left is part of a dependency cycle, which is broken by
+    // installing its first package found regardless
+    iterator = list_iterator_new(graph.order, LIST_HEAD);
+    while ((item = list_iterator_next(iterator))) {
+      package_node_t *node = item->val;
+      if (!node->scheduled) {
+        blocked = node;
+        break;
+      }
     }
     list_iterator_destroy(iterator);
-    list_destroy(freelist);
+
+    if (NULL == blocked)
+      break;
+
+    _debug("dependency cycle at %s", blocked->slug);
+    blocked->unfinished = 0;
   }
+
+  if (0 == graph.failures)
+    rc = 0;
+
+cleanup:
+  if (names)
+    hash_free(names);
+  package_graph_free(&graph);
   return rc;
 }
 
@@ -595,83 +1071,739 @@ cleanup:
   return pkg;
 }
 
-static clib_package_t *
-clib_package_new_from_slug_with_package_name(const char *slug, int verbose,
-                                             const char *file) {
-  char *author = NULL;
-  char *name = NULL;
-  char *version = NULL;
+static void prefetch_package(const char *);
+
+/**
+ * The version a package is cached as: the commit it was resolved to, whose
+ * entries never expire, or the version asked for.
+ */
+
+static inline char *cache_version(clib_package_t *pkg) {
+  return pkg->commit ? pkg->commit : pkg->version;
+}
+
+static char *refs_url(const char *author, const char *name) {
   char *url = NULL;
-  char *json_url = NULL;
-  char *repo = NULL;
-  char *json = NULL;
-  char *log = NULL;
-  http_get_response_t *res = NULL;
-  clib_package_t *pkg = NULL;
-  int retries = 3;
+  int rc = 0 != opts.token
+               ? asprintf(&url, GITHUB_URL_WITH_TOKEN "%s/%s" GITHUB_REFS_PATH,
+                          opts.token, author, name)
+               : asprintf(&url, GITHUB_URL "%s/%s" GITHUB_REFS_PATH, author,
+                          name);
 
-  // parse chunks
-  if (!slug)
-    goto error;
-  _debug("creating package: %s", slug);
-  if (!(author = parse_repo_owner(slug, DEFAULT_REPO_OWNER)))
+  return -1 == rc ? NULL : url;
+}
+
+static void on_refs(clib_download_t *download, void *data) {
+  repo_refs_t *refs = data;
+  list_iterator_t *iterator = NULL;
+  list_node_t *node = NULL;
+  list_t *waiting = NULL;
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+
+  refs->done = 1;
+
+  if (download->ok) {
+    refs->body = download->body;
+    refs->size = download->size;
+    download->body = NULL;
+  }
+
+  waiting = refs->waiting;
+  refs->waiting = NULL;
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+  // resolvable now
+  if (waiting) {
+    iterator = list_iterator_new(waiting, LIST_HEAD);
+    while ((node = list_iterator_next(iterator))) {
+      prefetch_package(node->val);
+    }
+    list_iterator_destroy(iterator);
+    list_destroy(waiting);
+  }
+}
+
+/**
+ * Resolve `version` of a package to the commit it points to, looking up
+ * the refs of its repository once per process. Tags are taken to never
+ * move and remembered by the cache, branches are looked up by every
+ * install. Takes the lock for the refs only, never waits.
+ *
+ * @param waiting A slug prefetched again once the refs are looked up
+ * @param pending Set to the refs being looked up, if not NULL
+ *
+ * @return 1 if `commit` was set, 0 if `version` cannot be resolved, e.g.
+ * offline or outside of GitHub, -1 while the refs are being looked up
+ */
+
+static int resolve_version(char *author, char *name, char *version,
+                           char *commit, const char *waiting,
+                           repo_refs_t **pending) {
+  repo_refs_t *refs = NULL;
+  char *key = NULL;
+  char *url = NULL;
+  int done = 0;
+  int kind = 0;
+
+  if (clib_refs_is_commit(version)) {
+    memcpy(commit, version, CLIB_REFS_COMMIT_SIZE);
+    return 1;
+  }
+
+  if (!opts.skip_cache &&
+      0 == clib_cache_read_ref(author, name, version, commit)) {
+    return 1;
+  }
+
+  if (NULL == downloads || -1 == asprintf(&key, "%s/%s", author, name)) {
+    return 0;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+
+  if (NULL == repo_refs) {
+    repo_refs = hash_new();
+  }
+
+  if (NULL == (refs = hash_get(repo_refs, key))) {
+    if (!(refs = calloc(1, sizeof(repo_refs_t))) ||
+        !(url = refs_url(author, name))) {
+      free(refs);
+      refs = NULL;
+      goto unlock;
+    }
+
+    clib_download_group_init(&refs->group, downloads);
+    hash_set(repo_refs, key, refs);
+    key = NULL;
+
+    _debug("refs: %s", url);
+    if (0 != clib_download_group_add(&refs->group, url, NULL, on_refs, refs)) {
+      refs->done = 1;
+    }
+
+    free(url);
+  }
+
+  if (!(done = refs->done)) {
+    if (waiting && (refs->waiting || (refs->waiting = list_new()))) {
+      refs->waiting->free = free;
+      list_rpush(refs->waiting, list_node_new(strdup(waiting)));
+    }
+
+    if (pending) {
+      *pending = refs;
+    }
+  }
+
+unlock:
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+  free(key);
+
+  if (NULL == refs) {
+    return 0;
+  }
+
+  if (!done) {
+    return -1;
+  }
+
+  // the body of looked up refs never changes
+  if (NULL == refs->body ||
+      0 == (kind = clib_refs_find(refs->body, refs->size, version, commit))) {
+    return 0;
+  }
+
+  if (CLIB_REFS_TAG == kind && !opts.skip_cache) {
+    clib_cache_save_ref(author, name, version, commit);
+  }
+
+  return 1;
+}
+
+/**
+ * Like `resolve_version()`, waiting for the refs if needed.
+ */
+
+static int resolve_version_wait(char *author, char *name, char *version,
+                                char *commit) {
+  repo_refs_t *refs = NULL;
+  int rc = -1;
+
+  while (-1 == rc) {
+    rc = resolve_version(author, name, version, commit, NULL, &refs);
+
+    if (-1 == rc && 0 != clib_download_group_wait(&refs->group)) {
+      return 0;
+    }
+  }
+
+  return rc;
+}
+
+/**
+ * Prefetch the manifests of the dependencies listed in `json`.
+ * Called without the lock.
+ */
+
+static void prefetch_dependencies(const char *json) {
+  clib_package_t *pkg = clib_package_new(json, 0);
+  list_iterator_t *iterator = NULL;
+  list_node_t *node = NULL;
+
+  if (NULL == pkg) {
+    return;
+  }
+
+  if (pkg->dependencies) {
+    iterator = list_iterator_new(pkg->dependencies, LIST_HEAD);
+    while ((node = list_iterator_next(iterator))) {
+      clib_package_dependency_t *dep = node->val;
+      char *slug = clib_package_slug(dep->author, dep->name, dep->version);
+      if (slug) {
+        prefetch_package(slug);
+        free(slug);
+      }
+    }
+    list_iterator_destroy(iterator);
+  }
+
+  clib_package_free(pkg);
+}
+
+static void on_prefetched_manifest(clib_download_t *download, void *data) {
+  manifest_prefetch_t *prefetch = data;
+  const char *json = NULL;
+
+  if (404 == download->status) {
+    clib_cache_save_missing(prefetch->author, prefetch->name,
+                            prefetch->version, prefetch->file);
+  } else if (304 == download->status) {
+    clib_cache_renew_json(prefetch->author, prefetch->name, prefetch->version);
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+
+  prefetch->status = download->status;
+
+  if (download->ok) {
+    if (304 == download->status) {
+      prefetch->body = prefetch->stale;
+      prefetch->stale = NULL;
+    } else {
+      prefetch->body = download->body;
+      download->body = NULL;
+      clib_cache_validators_init(&prefetch->validators, prefetch->file,
+                                 download->etag, download->last_modified);
+    }
+
+    // taken once the group is done, which is after this returns
+    json = prefetch->body;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+  // the next depth is requested as soon as this one is known
+  if (json) {
+    prefetch_dependencies(json);
+  }
+}
+
+static void manifest_prefetch_free(manifest_prefetch_t *prefetch) {
+  free(prefetch->url);
+  free(prefetch->body);
+  free(prefetch->stale);
+  free(prefetch->author);
+  free(prefetch->name);
+  free(prefetch->version);
+  free(prefetch);
+}
+
+static manifest_prefetch_t *new_manifest_prefetch(char *author, char *name,
+                                                  char *version,
+                                                  const char *url, int file) {
+  manifest_prefetch_t *prefetch = malloc(sizeof(manifest_prefetch_t));
+
+  if (NULL == prefetch) {
+    return NULL;
+  }
+
+  memset(prefetch, 0, sizeof(manifest_prefetch_t));
+  prefetch->file = manifest_names[file];
+  clib_download_group_init(&prefetch->group, downloads);
+
+  if (!(prefetch->url = clib_package_file_url(url, prefetch->file)) ||
+      !(prefetch->author = strdup(author)) ||
+      !(prefetch->name = strdup(name)) ||
+      !(prefetch->version = strdup(version))) {
+    manifest_prefetch_free(prefetch);
+    return NULL;
+  }
+
+  hash_set(prefetched_manifests, prefetch->url, prefetch);
+  return prefetch;
+}
+
+/**
+ * Queue the requests of every manifest name of `slug` at once unless they
+ * were already requested. The manifests of a package found in the cache
+ * are not requested, only its dependencies are. An expired one is
+ * revalidated instead, along with the names looked up before it. Called
+ * without the lock, which is only held to claim the requests: the cache
+ * is read and manifests are parsed meanwhile.
+ */
+
+static void prefetch_package(const char *slug) {
+  manifest_prefetch_t *prefetch = NULL;
+  clib_cache_validators_t validators;
+  char commit[CLIB_REFS_COMMIT_SIZE];
+  int missing[sizeof(manifest_names) / sizeof(*manifest_names)] = {0};
+  char *author = NULL;
+  char *name = NULL;
+  char *version = NULL;
+  char *url = NULL;
+  char *json_url = NULL;
+  char *json = NULL;
+  char *stale = NULL;
+  int seen = 0;
+
+  if (!(author = parse_repo_owner(slug, DEFAULT_REPO_OWNER)))
+    goto cleanup;
+  if (!(name = parse_repo_name(slug)))
+    goto cleanup;
+  if (!(version = parse_repo_version(slug, DEFAULT_REPO_VERSION)))
+    goto cleanup;
+
+  // requested again once the refs are looked up
+  switch (resolve_version(author, name, version, commit, slug, NULL)) {
+  case -1:
+    goto cleanup;
+  case 1:
+    free(version);
+    if (!(version = strdup(commit)))
+      goto cleanup;
+  }
+
+  if (!(url = clib_package_url(author, name, version)))
+    goto cleanup;
+  if (!(json_url = clib_package_file_url(url, manifest_names[0])))
+    goto cleanup;
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+  seen = NULL != hash_get(prefetched_manifests, json_url);
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+  if (seen)
+    goto cleanup;
+
+  if (!opts.skip_cache && clib_cache_has_json(author, name, version)) {
+    json = clib_cache_read_json(author, name, version);
+  }
+
+  if (!json && !opts.skip_cache) {
+    stale = clib_cache_read_stale_json(author, name, version, &validators);
+
+    for (int i = 0; NULL != manifest_names[i]; i++) {
+      missing[i] = clib_cache_has_missing(author, name, version,
+                                          manifest_names[i]);
+    }
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+
+  // requested by another thread meanwhile
+  if ((seen = NULL != hash_get(prefetched_manifests, json_url))) {
+    goto unlock;
+  }
+
+  if (json) {
+    // remember the package as seen, without a download
+    new_manifest_prefetch(author, name, version, url, 0);
+    goto unlock;
+  }
+
+  for (int i = 0; NULL != manifest_names[i]; i++) {
+    if (!(prefetch = new_manifest_prefetch(author, name, version, url, i)))
+      break;
+
+    if (missing[i]) {
+      _debug("missing: %s", prefetch->url);
+      prefetch->status = 404;
+      continue;
+    }
+
+    if (stale && 0 == strcmp(validators.file, prefetch->file)) {
+      _debug("revalidate: %s", prefetch->url);
+      prefetch->stale = stale;
+      stale = NULL;
+      clib_download_group_revalidate(
+          &prefetch->group, prefetch->url, validators.etag,
+          validators.last_modified, on_prefetched_manifest, prefetch);
+      // the names after it are not looked up
+      break;
+    }
+
+    _debug("prefetch: %s", prefetch->url);
+    clib_download_group_add(&prefetch->group, prefetch->url, NULL,
+                            on_prefetched_manifest, prefetch);
+  }
+
+unlock:
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+  if (json && !seen) {
+    prefetch_dependencies(json);
+  }
+
+cleanup:
+  free(author);
+  free(name);
+  free(version);
+  free(url);
+  free(json_url);
+  free(json);
+  free(stale);
+}
+
+/**
+ * Request the manifests of `deps` and, breadth first as the responses
+ * come in, the manifests of all of their transitive dependencies.
+ * `clib_package_new_from_slug()` picks them up instead of fetching them.
+ */
+
+static void prefetch_manifests(list_t *deps) {
+  list_iterator_t *iterator = NULL;
+  list_node_t *node = NULL;
+
+  if (NULL == deps || NULL == get_download_queue()) {
+    return;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+  if (NULL == prefetched_manifests) {
+    prefetched_manifests = hash_new();
+  }
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+  iterator = list_iterator_new(deps, LIST_HEAD);
+  while ((node = list_iterator_next(iterator))) {
+    clib_package_dependency_t *dep = node->val;
+    char *slug = clib_package_slug(dep->author, dep->name, dep->version);
+    if (slug) {
+      prefetch_package(slug);
+      free(slug);
+    }
+  }
+  list_iterator_destroy(iterator);
+}
+
+/**
+ * Take the prefetched manifest at `url`, waiting for it if needed.
+ *
+ * @param validators Set to those of the response
+ *
+ * @return 1 if `*json` was set, 2 if it was set to the cached manifest,
+ *         which did not change, -1 if the manifest is missing, 0 if it
+ *         has to be fetched
+ */
+
+static int take_prefetched_manifest(const char *url, char **json,
+                                    clib_cache_validators_t *validators) {
+  manifest_prefetch_t *prefetch = NULL;
+  int rc = 0;
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+  if (prefetched_manifests) {
+    prefetch = hash_get(prefetched_manifests, (char *)url);
+  }
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+  if (NULL == prefetch) {
+    return 0;
+  }
+
+  clib_download_group_wait(&prefetch->group);
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+  if (prefetch->body) {
+    *json = prefetch->body;
+    *validators = prefetch->validators;
+    prefetch->body = NULL;
+    rc = 304 == prefetch->status ? 2 : 1;
+  } else if (404 == prefetch->status) {
+    // other errors may not last, they are retried
+    rc = -1;
+  }
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+  return rc;
+}
+
+static void on_refreshed_manifest(clib_download_t *download, void *data) {
+  manifest_refresh_t *refresh = data;
+  clib_cache_validators_t validators;
+
+  if (304 == download->status) {
+    clib_cache_renew_json(refresh->author, refresh->name, refresh->version);
+  } else if (download->ok && download->body) {
+    clib_cache_validators_init(&validators, refresh->validators.file,
+                               download->etag, download->last_modified);
+    clib_cache_save_json_with_validators(refresh->author, refresh->name,
+                                         refresh->version, download->body,
+                                         &validators);
+  }
+
+  // otherwise it is served until it is too stale
+}
+
+static void manifest_refresh_free(manifest_refresh_t *refresh) {
+  free(refresh->author);
+  free(refresh->name);
+  free(refresh->version);
+  free(refresh);
+}
+
+static manifest_refresh_t *
+new_manifest_refresh(char *author, char *name, char *version,
+                     const clib_cache_validators_t *validators) {
+  manifest_refresh_t *refresh = malloc(sizeof(manifest_refresh_t));
+
+  if (NULL == refresh) {
+    return NULL;
+  }
+
+  memset(refresh, 0, sizeof(manifest_refresh_t));
+  refresh->validators = *validators;
+  clib_download_group_init(&refresh->group, downloads);
+
+  if (!(refresh->author = strdup(author)) || !(refresh->name = strdup(name)) ||
+      !(refresh->version = strdup(version))) {
+    manifest_refresh_free(refresh);
+    return NULL;
+  }
+
+  return refresh;
+}
+
+/**
+ * Revalidate the stale manifest of author/name@version, just served from
+ * the cache, while the install goes on. It is waited for at cleanup.
+ */
+
+static void refresh_manifest(char *author, char *name, char *version) {
+  manifest_refresh_t *refresh = NULL;
+  clib_cache_validators_t validators;
+  char *stale = NULL;
+  char *url = NULL;
+  char *json_url = NULL;
+
+  // which manifest name it came from is only known from its validators
+  if (!(stale = clib_cache_read_stale_json(author, name, version,
+                                           &validators)) ||
+      !*validators.file) {
+    goto cleanup;
+  }
+
+  if (NULL == get_download_queue() ||
+      !(url = clib_package_url(author, name, version)) ||
+      !(json_url = clib_package_file_url(url, validators.file))) {
+    goto cleanup;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+
+  if (NULL == refreshed_manifests) {
+    refreshed_manifests = hash_new();
+  }
+
+  if (NULL == hash_get(refreshed_manifests, json_url) &&
+      (refresh = new_manifest_refresh(author, name, version, &validators))) {
+    _debug("refresh: %s", json_url);
+    hash_set(refreshed_manifests, json_url, refresh);
+    clib_download_group_revalidate(&refresh->group, json_url, validators.etag,
+                                   validators.last_modified,
+                                   on_refreshed_manifest, refresh);
+    json_url = NULL;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+cleanup:
+  free(stale);
+  free(url);
+  free(json_url);
+}
+
+static clib_package_t *
+clib_package_new_from_slug_with_package_name(const char *slug, int verbose,
+                                             const char *file) {
+  char commit[CLIB_REFS_COMMIT_SIZE];
+  char *author = NULL;
+  char *name = NULL;
+  char *version = NULL;
+  char *cached = NULL; // the version in the cache, `version` or its commit
+  char *url = NULL;
+  char *json_url = NULL;
+  char *slug_repo = NULL; // what `cached` was resolved in
+  char *repo = NULL;
+  char *json = NULL;
+  char *stale = NULL; // an expired manifest, revalidated
+  char *log = NULL;
+  clib_cache_validators_t validators;
+  clib_download_t *download = NULL;
+  clib_package_t *pkg = NULL;
+  int prefetched = 0;
+  int fetched = 0;
+  int retries = 3;
+
+  // parse chunks
+  if (!slug)
+    goto error;
+  _debug("creating package: %s", slug);
+  if (!(author = parse_repo_owner(slug, DEFAULT_REPO_OWNER)))
     goto error;
   if (!(name = parse_repo_name(slug)))
     goto error;
   if (!(version = parse_repo_version(slug, DEFAULT_REPO_VERSION)))
     goto error;
-  if (!(url = clib_package_url(author, name, version)))
+  if (!(slug_repo = clib_package_repo(author, name)))
+    goto error;
+
+  // fetched at the commit, so that what is cached is what it points to
+  if (1 == resolve_version_wait(author, name, version, commit)) {
+    if (!(cached = strdup(commit)))
+      goto error;
+  } else if (!(cached = strdup(version))) {
+    goto error;
+  }
+
+  if (!(url = clib_package_url(author, name, cached)))
     goto error;
   if (!(json_url = clib_package_file_url(url, file)))
     goto error;
 
   _debug("author: %s", author);
   _debug("name: %s", name);
-  _debug("version: %s", version);
+  _debug("version: %s (%s)", version, cached);
 
-#ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&lock.mutex);
-#endif
   // fetch json
-  if (clib_cache_has_json(author, name, version)) {
+  if (clib_cache_has_json(author, name, cached)) {
     if (opts.skip_cache) {
-      clib_cache_delete_json(author, name, version);
+      clib_cache_delete_json(author, name, cached);
       goto download;
     }
 
-    json = clib_cache_read_json(author, name, version);
+    json = clib_cache_read_json(author, name, cached);
 
     if (!json) {
       goto download;
     }
 
+    if (clib_cache_is_stale_json(author, name, cached)) {
+      refresh_manifest(author, name, cached);
+    }
+
     log = "cache";
-#ifdef HAVE_PTHREADS
-    pthread_mutex_unlock(&lock.mutex);
-#endif
   } else {
   download:
-#ifdef HAVE_PTHREADS
-    pthread_mutex_unlock(&lock.mutex);
-#endif
     if (retries-- <= 0) {
       goto error;
+    }
+
+    prefetched = take_prefetched_manifest(json_url, &json, &validators);
+
+    // the server already answered, don't ask again
+    if (-1 == prefetched ||
+        (0 == prefetched && !opts.skip_cache &&
+         clib_cache_has_missing(author, name, cached, file))) {
+      goto error;
+    }
+
+    if (0 != prefetched) {
+      fetched = 1 == prefetched;
+      log = fetched ? "fetch" : "cache";
     } else {
+      // an expired manifest costs no body if it did not change
+      if (!stale && !opts.skip_cache &&
+          (stale = clib_cache_read_stale_json(author, name, cached,
+                                              &validators)) &&
+          0 != strcmp(validators.file, file)) {
+        free(stale);
+        stale = NULL;
+      }
+
+      // clean up when retrying
+      clib_download_free(download);
 #ifdef HAVE_PTHREADS
       init_curl_share();
-      _debug("GET %s", json_url);
-      // clean up when retrying
-      http_get_free(res);
-      res = http_get_shared(json_url, clib_package_curl_share);
+      download = clib_download_get(json_url, stale ? validators.etag : NULL,
+                                   stale ? validators.last_modified : NULL,
+                                   clib_package_curl_share);
 #else
-      res = http_get(json_url);
+      download = clib_download_get(json_url, stale ? validators.etag : NULL,
+                                   stale ? validators.last_modified : NULL,
+                                   NULL);
 #endif
-      json = res->data;
-      _debug("status: %d", res->status);
-      if (!res || !res->ok) {
+      if (!download || !download->ok) {
+        // a missing manifest does not appear by asking again
+        if (download && 404 == download->status) {
+          retries = 0;
+          clib_cache_save_missing(author, name, cached, file);
+        }
         goto download;
       }
-      log = "fetch";
+
+      if (304 == download->status) {
+        clib_cache_renew_json(author, name, cached);
+        json = stale;
+        stale = NULL;
+        log = "cache";
+      } else {
+        json = download->body;
+        download->body = NULL;
+        clib_cache_validators_init(&validators, file, download->etag,
+                                   download->last_modified);
+        fetched = 1;
+        log = "fetch";
+      }
     }
   }
 
@@ -692,6 +1824,14 @@ clib_package_new_from_slug_with_package_name(const char *slug, int verbose,
   if (!pkg)
     goto error;
 
+  if (0 != strcmp(cached, version)) {
+    pkg->commit = cached;
+    cached = NULL;
+  }
+
+  free(cached);
+  cached = NULL;
+
   // force version number
   if (pkg->version) {
     if (version) {
@@ -724,7 +1864,12 @@ clib_package_new_from_slug_with_package_name(const char *slug, int verbose,
   }
 
   if (pkg->repo) {
-    if (0 != strcmp(repo, pkg->repo)) {
+    // the name of the manifest may not be the one of the repo, e.g. "trim"
+    // of trim.c, `url` is right if the slug names the repo
+    if (0 != strcmp(repo, pkg->repo) && 0 != strcmp(slug_repo, pkg->repo)) {
+      // the commit is one of another repo
+      free(pkg->commit);
+      pkg->commit = NULL;
       free(url);
       if (!(url = clib_package_url_from_repo(pkg->repo, pkg->version)))
         goto error;
@@ -736,32 +1881,23 @@ clib_package_new_from_slug_with_package_name(const char *slug, int verbose,
   }
 
   pkg->url = url;
+  free(slug_repo);
 
-#ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&lock.mutex);
-#endif
-  // cache json
-  if (pkg && pkg->author && pkg->name && pkg->version) {
-    if (-1 ==
-        clib_cache_save_json(pkg->author, pkg->name, pkg->version, json)) {
+  // cache json, with what it takes to revalidate it once expired
+  if (fetched && pkg->author && pkg->name && pkg->version) {
+    if (-1 == clib_cache_save_json_with_validators(pkg->author, pkg->name,
+                                                   cache_version(pkg), json,
+                                                   &validators)) {
       _debug("failed to cache JSON for: %s/%s@%s", pkg->author, pkg->name,
              pkg->version);
     } else {
       _debug("cached: %s/%s@%s", pkg->author, pkg->name, pkg->version);
     }
   }
-#ifdef HAVE_PTHREADS
-  pthread_mutex_unlock(&lock.mutex);
-#endif
 
-  if (res) {
-    http_get_free(res);
-    json = NULL;
-    res = NULL;
-  } else {
-    free(json);
-    json = NULL;
-  }
+  clib_download_free(download);
+  free(stale);
+  free(json);
 
   return pkg;
 
@@ -775,13 +1911,14 @@ error:
   free(author);
   free(name);
   free(version);
+  free(cached);
   free(url);
   free(json_url);
+  free(slug_repo);
   free(repo);
-  if (!res && json)
-    free(json);
-  if (res)
-    http_get_free(res);
+  free(json);
+  free(stale);
+  clib_download_free(download);
   if (pkg)
     clib_package_free(pkg);
   return NULL;
@@ -796,6 +1933,23 @@ clib_package_t *clib_package_new_from_slug(const char *slug, int verbose) {
   const char *name = NULL;
   unsigned int i = 0;
 
+  if (!slug)
+    return NULL;
+
+  // probe every manifest name concurrently, they are still tried in order
+  if (NULL != get_download_queue()) {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&lock.mutex);
+#endif
+    if (NULL == prefetched_manifests) {
+      prefetched_manifests = hash_new();
+    }
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&lock.mutex);
+#endif
+    prefetch_package(slug);
+  }
+
   do {
     name = manifest_names[i];
     package = clib_package_new_from_slug_with_package_name(slug, verbose, name);
@@ -911,19 +2065,61 @@ clib_package_dependency_t *clib_package_dependency_new(const char *repo,
   return dep;
 }
 
-static int fetch_package_file_work(clib_package_t *pkg, const char *dir,
-                                   char *file, int verbose) {
+/**
+ * Report the outcome of a file fetched with `fetch_package_file()`.
+ */
+
+static void on_package_file(clib_download_t *download, void *data) {
+  fetch_package_file_data_t *fetch = data;
+
+  if (!download->ok) {
+    (void)(*fetch->failures)++;
+    if (fetch->verbose) {
+#ifdef HAVE_PTHREADS
+      pthread_mutex_lock(&lock.mutex);
+#endif
+      logger_error("error", "unable to fetch %s:%s", fetch->pkg->repo,
+                   fetch->file);
+      fflush(stderr);
+#ifdef HAVE_PTHREADS
+      pthread_mutex_unlock(&lock.mutex);
+#endif
+    }
+  } else if (fetch->verbose) {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&lock.mutex);
+#endif
+    logger_info("save", download->path);
+    fflush(stdout);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&lock.mutex);
+#endif
+  }
+
+  free(fetch);
+}
+
+/**
+ * Queue a fetch of a file associated with the given `pkg` in `group`.
+ * Failed downloads are counted in `failures` once `group` is finished.
+ *
+ * Returns 0 on success.
+ */
+
+static int fetch_package_file(clib_package_t *pkg, const char *dir, char *file,
+                              int verbose, clib_download_group_t *group,
+                              int *failures) {
+  fetch_package_file_data_t *fetch = NULL;
   char *url = NULL;
   char *path = NULL;
-  int saved = 0;
   int rc = 0;
 
-  _debug("fetch file: %s/%s", pkg->repo, file);
-
   if (NULL == pkg) {
     return 1;
   }
 
+  _debug("fetch file: %s/%s", pkg->repo, file);
+
   if (NULL == pkg->url) {
     return 1;
   }
@@ -941,148 +2137,131 @@ static int fetch_package_file_work(clib_package_t *pkg, const char *dir,
     goto cleanup;
   }
 
-#ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&lock.mutex);
-#endif
-
-  if (1 == opts.force || -1 == fs_exists(path)) {
-    if (verbose) {
-      logger_info("fetch", "%s:%s", pkg->repo, file);
-      fflush(stdout);
-    }
-
-#ifdef HAVE_PTHREADS
-    pthread_mutex_unlock(&lock.mutex);
-#endif
+  if (0 == opts.force && 0 == fs_exists(path)) {
+    goto cleanup;
+  }
 
-    rc = http_get_file_shared(url, path, clib_package_curl_share);
-    saved = 1;
-  } else {
-#ifdef HAVE_PTHREADS
-    pthread_mutex_unlock(&lock.mutex);
-#endif
+  if (!(fetch = malloc(sizeof(fetch_package_file_data_t)))) {
+    rc = 1;
+    goto cleanup;
   }
 
-  if (-1 == rc) {
-    if (verbose) {
+  fetch->pkg = pkg;
+  fetch->file = file;
+  fetch->verbose = verbose;
+  fetch->failures = failures;
+
+  if (verbose) {
 #ifdef HAVE_PTHREADS
-      pthread_mutex_lock(&lock.mutex);
+    pthread_mutex_lock(&lock.mutex);
 #endif
-      logger_error("error", "unable to fetch %s:%s", pkg->repo, file);
-      fflush(stderr);
-      rc = 1;
+    logger_info("fetch", "%s:%s", pkg->repo, file);
+    fflush(stdout);
 #ifdef HAVE_PTHREADS
-      pthread_mutex_unlock(&lock.mutex);
+    pthread_mutex_unlock(&lock.mutex);
 #endif
-      goto cleanup;
-    }
   }
 
-  if (saved) {
-    if (verbose) {
-#ifdef HAVE_PTHREADS
-      pthread_mutex_lock(&lock.mutex);
-#endif
-      logger_info("save", path);
-      fflush(stdout);
-#ifdef HAVE_PTHREADS
-      pthread_mutex_unlock(&lock.mutex);
-#endif
-    }
+  if (0 != clib_download_group_add(group, url, path, on_package_file, fetch)) {
+    free(fetch);
+    rc = 1;
   }
 
 cleanup:
-
   free(url);
   free(path);
   return rc;
 }
 
-#ifdef HAVE_PTHREADS
-static void *fetch_package_file_thread(void *arg) {
-  fetch_package_file_thread_data_t *data = arg;
-  int *status = malloc(sizeof(int));
-  int rc =
-      fetch_package_file_work(data->pkg, data->dir, data->file, data->verbose);
-  *status = rc;
-  (void)data->pkg->refs--;
-  pthread_exit((void *)status);
-  return (void *)(intptr_t)rc;
-}
-#endif
-
 /**
- * Fetch a file associated with the given `pkg`.
- *
- * Returns 0 on success.
+ * Get the PREFIX the commands of `pkg` run with, creating it, or NULL
+ * when there is none.
  */
 
-static int fetch_package_file(clib_package_t *pkg, const char *dir, char *file,
-                              int verbose, void **data) {
-#ifndef HAVE_PTHREADS
-  return fetch_package_file_work(pkg, dir, file, verbose);
-#else
-  fetch_package_file_thread_data_t *fetch = malloc(sizeof(*fetch));
-  int rc = 0;
+static char *package_prefix(clib_package_t *pkg, long path_max) {
+  if (NULL != opts.prefix || NULL != pkg->prefix) {
+    char path[path_max];
+    memset(path, 0, path_max);
 
-  if (0 == fetch) {
-    return -1;
+    if (opts.prefix) {
+      realpath(opts.prefix, path);
+    } else {
+      realpath(pkg->prefix, path);
+    }
+
+    _debug("env: PREFIX: %s", path);
+    mkdirp(path, 0777);
+    return strdup(path);
   }
 
-  *data = 0;
+  return NULL;
+}
 
-  memset(fetch, 0, sizeof(*fetch));
+/**
+ * Restore the environment variable `name` to `value`, unsetting it when
+ * it was not set.
+ */
 
-  fetch->pkg = pkg;
-  fetch->dir = dir;
-  fetch->file = file;
-  fetch->verbose = verbose;
+static void restore_env(const char *name, char *value) {
+  if (value) {
+    setenv(name, value, 1);
+    free(value);
+  } else {
+    unsetenv(name);
+  }
+}
 
-  rc = pthread_attr_init(&fetch->attr);
+/**
+ * Run `command` with PREFIX set to `prefix` and `flags` added to CFLAGS,
+ * when given. Packages are installed concurrently in the same process,
+ * so the environment is only changed, read by `system()` and restored
+ * under a lock.
+ */
 
-  if (0 != rc) {
-    free(fetch);
-    return rc;
-  }
+static int run_command(const char *command, const char *prefix,
+                       const char *flags) {
+  char *saved_prefix = NULL;
+  char *saved_flags = NULL;
+  char *cflags = NULL;
+  int rc = 0;
 
-  (void)pkg->refs++;
-  rc = pthread_create(&fetch->thread, NULL, fetch_package_file_thread, fetch);
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.env);
+#endif
 
-  if (0 != rc) {
-    pthread_attr_destroy(&fetch->attr);
-    free(fetch);
-    return rc;
+  if (prefix) {
+    if ((saved_prefix = getenv("PREFIX"))) {
+      saved_prefix = strdup(saved_prefix);
+    }
+    setenv("PREFIX", prefix, 1);
   }
 
-  rc = pthread_attr_destroy(&fetch->attr);
-
-  if (0 != rc) {
-    pthread_cancel(fetch->thread);
-    free(fetch);
-    return rc;
+  if (flags) {
+    if ((saved_flags = getenv("CFLAGS"))) {
+      saved_flags = strdup(saved_flags);
+      asprintf(&cflags, "%s %s", saved_flags, flags);
+    } else {
+      asprintf(&cflags, "%s", flags);
+    }
+    setenv("CFLAGS", cflags, 1);
   }
 
-  *data = fetch;
+  rc = system(command);
 
-  return rc;
-#endif
-}
+  if (prefix) {
+    restore_env("PREFIX", saved_prefix);
+  }
 
-static void set_prefix(clib_package_t *pkg, long path_max) {
-  if (NULL != opts.prefix || NULL != pkg->prefix) {
-    char path[path_max];
-    memset(path, 0, path_max);
+  if (flags) {
+    restore_env("CFLAGS", saved_flags);
+  }
 
-    if (opts.prefix) {
-      realpath(opts.prefix, path);
-    } else {
-      realpath(pkg->prefix, path);
-    }
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.env);
+#endif
 
-    _debug("env: PREFIX: %s", path);
-    setenv("PREFIX", path, 1);
-    mkdirp(path, 0777);
-  }
+  free(cflags);
+  return rc;
 }
 
 int clib_package_install_executable(clib_package_t *pkg, const char *dir,
@@ -1104,6 +2283,7 @@ int clib_package_install_executable(clib_package_t *pkg, const char *dir,
   char *deps = NULL;
   char *tmp = NULL;
   char *reponame = NULL;
+  char *prefix = NULL;
   char dir_path[path_max];
 
   _debug("install executable %s", pkg->repo);
@@ -1161,14 +2341,14 @@ int clib_package_install_executable(clib_package_t *pkg, const char *dir,
   _debug("command(extract): %s", command);
 
   // cheap untar
-  rc = system(command);
+  rc = run_command(command, NULL, NULL);
   if (0 != rc)
     goto cleanup;
 
   free(command);
   command = NULL;
 
-  set_prefix(pkg, path_max);
+  prefix = package_prefix(pkg, path_max);
 
   const char *configure = pkg->configure;
 
@@ -1200,70 +2380,207 @@ int clib_package_install_executable(clib_package_t *pkg, const char *dir,
     E_FORMAT(&command, "cp -fr %s/%s/%s %s", dir_path, pkg->name,
              basename(pkg->makefile), unpack_dir);
 
-    rc = system(command);
-    if (0 != rc) {
-      goto cleanup;
-    }
+    rc = run_command(command, NULL, NULL);
+    if (0 != rc) {
+      goto cleanup;
+    }
+
+    free(command);
+    command = NULL;
+  }
+
+  E_FORMAT(&command, "cd %s && %s", unpack_dir, pkg->install);
+
+  _debug("command(install): %s", command);
+  rc = run_command(command, prefix, pkg->flags);
+
+cleanup:
+  free(prefix);
+  free(tmp);
+  free(command);
+  free(tarball);
+  free(file);
+  free(url);
+  return rc;
+}
+
+/**
+ * Get the process wide download queue shared by every package install.
+ */
+
+static clib_download_queue_t *get_download_queue(void) {
+#ifdef HAVE_PTHREADS
+  init_curl_share();
+  pthread_mutex_lock(&lock.mutex);
+#endif
+
+  if (NULL == downloads) {
+    downloads =
+        clib_download_queue_new(opts.concurrency, clib_package_curl_share);
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+
+  return downloads;
+}
+
+static void release_package_flight(package_flight_t *flight) {
+  if (0 == __sync_sub_and_fetch(&flight->refs, 1)) {
+#ifdef HAVE_PTHREADS
+    pthread_cond_destroy(&flight->cond);
+#endif
+    free(flight);
+  }
+}
+
+/**
+ * Join the install of the same author/name@version already in flight, or
+ * register `install` as the one everybody else joins.
+ *
+ * @return 0 on success, -1 on error
+ */
+
+static int join_package_flight(package_install_t *install) {
+  clib_package_t *pkg = install->pkg;
+  package_flight_t *flight = NULL;
+  char *key = NULL;
+  int rc = 0;
+
+  if (!pkg->author || !pkg->name || !pkg->version) {
+    return 0;
+  }
+
+  if (!(key = clib_package_slug(pkg->author, pkg->name, pkg->version))) {
+    return -1;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+
+  if (0 == package_flights) {
+    package_flights = hash_new();
+  }
+
+  if ((flight = hash_get(package_flights, key))) {
+    __sync_add_and_fetch(&flight->refs, 1);
+    install->flight = flight;
+    install->joined = 1;
+    _debug("joining install of %s", key);
+    free(key);
+    goto unlock;
+  }
+
+  if (!(flight = malloc(sizeof(package_flight_t)))) {
+    free(key);
+    rc = -1;
+    goto unlock;
+  }
+
+  memset(flight, 0, sizeof(package_flight_t));
+  flight->refs = 2; // the table and `install`
+#ifdef HAVE_PTHREADS
+  pthread_cond_init(&flight->cond, NULL);
+#endif
+  hash_set(package_flights, key, flight);
+  install->flight = flight;
+
+unlock:
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+  return rc;
+}
+
+/**
+ * Publish the outcome of the install owning its flight, once.
+ */
+
+static void land_package_flight(package_install_t *install, int rc) {
+  package_flight_t *flight = install->flight;
 
-    free(command);
+  if (NULL == flight || install->joined) {
+    return;
   }
 
-  if (pkg->flags) {
-    char *flags = NULL;
-#ifdef _GNU_SOURCE
-    char *cflags = secure_getenv("CFLAGS");
-#else
-    char *cflags = getenv("CFLAGS");
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+#endif
+  if (!flight->done) {
+    flight->rc = rc;
+    flight->done = 1;
+#ifdef HAVE_PTHREADS
+    pthread_cond_broadcast(&flight->cond);
 #endif
-
-    if (cflags) {
-      asprintf(&flags, "%s %s", cflags, pkg->flags);
-    } else {
-      asprintf(&flags, "%s", pkg->flags);
-    }
-
-    setenv("CFLAGS", cflags, 1);
   }
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
+}
 
-  E_FORMAT(&command, "cd %s && %s", unpack_dir, pkg->install);
+/**
+ * Wait for the install `install` joined.
+ *
+ * @return The result of that install
+ */
 
-  _debug("command(install): %s", command);
-  rc = system(command);
+static int wait_package_flight(package_install_t *install) {
+  package_flight_t *flight = install->flight;
+  int rc = 0;
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
+  while (!flight->done) {
+    pthread_cond_wait(&flight->cond, &lock.mutex);
+  }
+#endif
+  // without threads an unfinished flight is further up the stack
+  rc = flight->done ? flight->rc : 0;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&lock.mutex);
+#endif
 
-cleanup:
-  free(tmp);
-  free(command);
-  free(tarball);
-  free(file);
-  free(url);
   return rc;
 }
 
 /**
- * Install the given `pkg` in `dir`
+ * Get the process wide worker pool shared by every install, nested ones
+ * included, so the number of threads stays at the configured concurrency.
  */
 
-int clib_package_install(clib_package_t *pkg, const char *dir, int verbose) {
-  list_iterator_t *iterator = NULL;
-  char *package_json = NULL;
-  char *pkg_dir = NULL;
-  char *command = NULL;
-  int pending = 0;
-  int rc = 0;
-  int i = 0;
-
-#ifdef PATH_MAX
-  long path_max = PATH_MAX;
-#elif defined(_PC_PATH_MAX)
-  long path_max = pathconf(dir, _PC_PATH_MAX);
-#else
-  long path_max = 4096;
+static clib_pool_t *get_worker_pool(void) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&lock.mutex);
 #endif
 
+  if (NULL == workers) {
+    workers = clib_pool_new(opts.concurrency);
+    clib_cache_set_pool(workers);
+  }
+
 #ifdef HAVE_PTHREADS
-  int max = opts.concurrency;
+  pthread_mutex_unlock(&lock.mutex);
 #endif
 
+  return workers;
+}
+
+/**
+ * Start installing `install->pkg`: write its manifest and queue the
+ * download of its files on the shared queue, or load it from the cache.
+ * Nothing is waited for, see `finish_package_install()`.
+ */
+
+static int start_package_install(package_install_t *install) {
+  clib_package_t *pkg = install->pkg;
+  const char *dir = install->dir;
+  int verbose = install->verbose;
+  clib_download_queue_t *queue = NULL;
+  char *package_json = NULL;
+  int rc = 0;
+
 #ifdef CLIB_PACKAGE_PREFIX
   if (0 == opts.prefix) {
 #ifdef HAVE_PTHREADS
@@ -1294,6 +2611,21 @@ int clib_package_install(clib_package_t *pkg, const char *dir, int verbose) {
 #endif
   }
 
+  if (!pkg || !dir) {
+    rc = -1;
+    goto cleanup;
+  }
+
+  // the package is fetched only once, however many installs reach it
+  if (0 != join_package_flight(install)) {
+    rc = -1;
+    goto cleanup;
+  }
+
+  if (install->joined) {
+    return 0;
+  }
+
   if (0 == visited_packages) {
 #ifdef HAVE_PTHREADS
     pthread_mutex_lock(&lock.mutex);
@@ -1308,60 +2640,46 @@ int clib_package_install(clib_package_t *pkg, const char *dir, int verbose) {
 #endif
   }
 
-  if (0 == opts.force && pkg && pkg->name) {
+  if (pkg->name) {
 #ifdef HAVE_PTHREADS
     pthread_mutex_lock(&lock.mutex);
 #endif
 
-    if (hash_has(visited_packages, pkg->name)) {
-#ifdef HAVE_PTHREADS
-      pthread_mutex_unlock(&lock.mutex);
-#endif
-      return 0;
+    // checked and marked at once, so another version of the package
+    // started meanwhile cannot slip through
+    if (0 == opts.force && hash_has(visited_packages, pkg->name)) {
+      install->done = 1;
+    } else if (!hash_has(visited_packages, pkg->name)) {
+      hash_set(visited_packages, strdup(pkg->name), "t");
     }
 
 #ifdef HAVE_PTHREADS
     pthread_mutex_unlock(&lock.mutex);
 #endif
-  }
 
-#ifdef HAVE_PTHREADS
-  fetch_package_file_thread_data_t **fetchs = 0;
-  if (NULL != pkg && NULL != pkg->src) {
-    if (pkg->src->len > 0) {
-      fetchs = malloc(pkg->src->len * sizeof(fetch_package_file_thread_data_t));
+    if (install->done) {
+      land_package_flight(install, 0);
+      return 0;
     }
   }
 
-  if (fetchs) {
-    memset(fetchs, 0, pkg->src->len * sizeof(fetch_package_file_thread_data_t));
-  }
-
-#endif
-
-  if (!pkg || !dir) {
-    rc = -1;
-    goto cleanup;
-  }
-
-  set_prefix(pkg, path_max);
-
-  if (!(pkg_dir = path_join(dir, pkg->name))) {
+  if (!(install->pkg_dir = path_join(dir, pkg->name))) {
     rc = -1;
     goto cleanup;
   }
 
   if (!opts.global) {
-    _debug("mkdir -p %s", pkg_dir);
+    _debug("mkdir -p %s", install->pkg_dir);
     // create directory for pkg
-    if (-1 == mkdirp(pkg_dir, 0777)) {
+    if (-1 == mkdirp(install->pkg_dir, 0777)) {
       rc = -1;
       goto cleanup;
     }
   }
 
   if (NULL == pkg->url) {
-    pkg->url = clib_package_url(pkg->author, pkg->repo_name, pkg->version);
+    pkg->url =
+        clib_package_url(pkg->author, pkg->repo_name, cache_version(pkg));
 
     if (NULL == pkg->url) {
       rc = -1;
@@ -1370,13 +2688,17 @@ int clib_package_install(clib_package_t *pkg, const char *dir, int verbose) {
   }
 
   // write clib.json or package.json
-  if (!(package_json = path_join(pkg_dir, pkg->filename))) {
+  if (!(package_json = path_join(install->pkg_dir, pkg->filename))) {
     rc = -1;
     goto cleanup;
   }
 
   if (!opts.global && NULL != pkg->src) {
     _debug("write: %s", package_json);
+
+    // may be a hard link into the package store, never written through
+    remove(package_json);
+
     if (-1 == fs_write(package_json, pkg->json)) {
       if (verbose) {
         logger_error("error", "Failed to write %s", package_json);
@@ -1387,68 +2709,36 @@ int clib_package_install(clib_package_t *pkg, const char *dir, int verbose) {
     }
   }
 
-  if (pkg->name) {
-#ifdef HAVE_PTHREADS
-    pthread_mutex_lock(&lock.mutex);
-#endif
-    if (!hash_has(visited_packages, pkg->name)) {
-      hash_set(visited_packages, strdup(pkg->name), "t");
-    }
-#ifdef HAVE_PTHREADS
-    pthread_mutex_unlock(&lock.mutex);
-#endif
+  if (!(queue = get_download_queue())) {
+    rc = -1;
+    goto cleanup;
   }
 
-  // fetch makefile
-  if (!opts.global && pkg->makefile) {
-    _debug("fetch: %s/%s", pkg->repo, pkg->makefile);
-    void *fetch = 0;
-    rc = fetch_package_file(pkg, pkg_dir, pkg->makefile, verbose, &fetch);
-    if (0 != rc) {
-      goto cleanup;
-    }
-
-#ifdef HAVE_PTHREADS
-    if (0 != fetch) {
-      fetch_package_file_thread_data_t *data = fetch;
-      int *status;
-      pthread_join(data->thread, (void **)&status);
-      if (NULL != status) {
-        rc = *status;
-        free(status);
-        status = 0;
-        if (0 != rc) {
-          rc = 0;
-          logger_warn("warning", "unable to fetch Makefile (%s) for '%s'",
-                      pkg->makefile, pkg->name);
-        }
-      }
-    }
-#endif
-  }
+  clib_download_group_init(&install->group, queue);
 
   // if no sources are listed, just install
   if (opts.global || NULL == pkg->src)
-    goto install;
+    goto makefile;
 
-#ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&lock.mutex);
-#endif
+  // another process may be downloading it, and caches it before we go on
+  if (!opts.skip_cache) {
+    install->claim =
+        clib_cache_claim_package(pkg->author, pkg->name, cache_version(pkg));
+  }
 
-  if (clib_cache_has_package(pkg->author, pkg->name, pkg->version)) {
+  // the cache locks its own entries
+  if (clib_cache_has_package(pkg->author, pkg->name, cache_version(pkg))) {
     if (opts.skip_cache) {
-      clib_cache_delete_package(pkg->author, pkg->name, pkg->version);
-#ifdef HAVE_PTHREADS
-      pthread_mutex_unlock(&lock.mutex);
-#endif
+      clib_cache_delete_package(pkg->author, pkg->name, cache_version(pkg));
       goto download;
     }
 
-    if (0 != clib_cache_load_package(pkg->author, pkg->name, pkg->version,
-                                     pkg_dir)) {
-#ifdef HAVE_PTHREADS
-      pthread_mutex_unlock(&lock.mutex);
-#endif
+    clib_cache_release_package(pkg->author, pkg->name, cache_version(pkg),
+                               install->claim);
+    install->claim = -1;
+
+    if (0 != clib_cache_load_package(pkg->author, pkg->name,
+                                     cache_version(pkg), install->pkg_dir)) {
       goto download;
     }
 
@@ -1456,116 +2746,102 @@ int clib_package_install(clib_package_t *pkg, const char *dir, int verbose) {
       logger_info("cache", pkg->repo);
     }
 
-#ifdef HAVE_PTHREADS
-    pthread_mutex_unlock(&lock.mutex);
-#endif
-
-    goto install;
+    goto makefile;
   }
 
-#ifdef HAVE_PTHREADS
-  pthread_mutex_unlock(&lock.mutex);
-#endif
-
 download:
+  install->download = 1;
 
-  iterator = list_iterator_new(pkg->src, LIST_HEAD);
+  list_iterator_t *iterator = list_iterator_new(pkg->src, LIST_HEAD);
   list_node_t *source;
 
   while ((source = list_iterator_next(iterator))) {
-    void *fetch = NULL;
-    rc = fetch_package_file(pkg, pkg_dir, source->val, verbose, &fetch);
+    rc = fetch_package_file(pkg, install->pkg_dir, source->val, verbose,
+                            &install->group, &install->failures);
 
     if (0 != rc) {
-      list_iterator_destroy(iterator);
-      iterator = NULL;
       rc = -1;
-      goto cleanup;
+      break;
     }
+  }
 
-#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-    usleep(1024 * 10);
-#endif
+  list_iterator_destroy(iterator);
 
-#ifdef HAVE_PTHREADS
-    if (i < 0) {
-      i = 0;
-    }
+  if (0 != rc) {
+    goto cleanup;
+  }
 
-    fetchs[i] = fetch;
+makefile:
+  // fetched alongside the sources, a failure is only a warning
+  if (!opts.global && pkg->makefile) {
+    _debug("fetch: %s/%s", pkg->repo, pkg->makefile);
+    rc = fetch_package_file(pkg, install->pkg_dir, pkg->makefile, verbose,
+                            &install->group, &install->makefile_failures);
+  }
 
-    (void)pending++;
+cleanup:
+  if (package_json)
+    free(package_json);
+  return rc;
+}
 
-    if (i < max) {
-      (void)i++;
-    } else {
-      while (--i >= 0) {
-        fetch_package_file_thread_data_t *data = fetchs[i];
-        int *status;
-        pthread_join(data->thread, (void **)&status);
-        free(data);
-        fetchs[i] = NULL;
-
-        (void)pending--;
-
-        if (NULL != status) {
-          rc = *status;
-          free(status);
-          status = 0;
-        }
+/**
+ * Wait for the downloads queued by `start_package_install()`, then
+ * configure and install the package and its dependencies.
+ */
 
-        if (0 != rc) {
-          rc = -1;
-          goto cleanup;
-        }
+static int finish_package_install(package_install_t *install) {
+  clib_package_t *pkg = install->pkg;
+  const char *dir = install->dir;
+  int verbose = install->verbose;
+  char *command = NULL;
+  char *prefix = NULL;
+  int rc = 0;
 
-#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-        usleep(1024 * 10);
-#endif
-      }
-    }
+#ifdef PATH_MAX
+  long path_max = PATH_MAX;
+#elif defined(_PC_PATH_MAX)
+  long path_max = pathconf(dir, _PC_PATH_MAX);
+#else
+  long path_max = 4096;
 #endif
+
+  if (install->joined) {
+    return wait_package_flight(install);
   }
 
-#ifdef HAVE_PTHREADS
-  while (--i >= 0) {
-    fetch_package_file_thread_data_t *data = fetchs[i];
-    int *status;
+  if (install->done) {
+    return 0;
+  }
 
-    pthread_join(data->thread, (void **)&status);
+  if (0 != clib_download_group_wait(&install->group)) {
+    return -1;
+  }
 
-    (void)pending--;
-    free(data);
-    fetchs[i] = NULL;
+  if (0 != install->makefile_failures) {
+    logger_warn("warning", "unable to fetch Makefile (%s) for '%s'",
+                pkg->makefile, pkg->name);
+  }
 
-    if (NULL != status) {
-      rc = *status;
-      free(status);
-      status = 0;
+  if (install->download) {
+    if (0 != install->failures) {
+      return -1;
     }
 
-    if (0 != rc) {
-      rc = -1;
-      goto cleanup;
-    }
+    // stored while the install goes on, the claim is released once saved
+    clib_cache_save_package_async(pkg->author, pkg->name, cache_version(pkg),
+                                  install->pkg_dir, install->claim);
+    install->claim = -1;
   }
-#endif
 
-#ifdef HAVE_PTHREADS
-  pthread_mutex_lock(&lock.mutex);
-#endif
-  clib_cache_save_package(pkg->author, pkg->name, pkg->version, pkg_dir);
-#ifdef HAVE_PTHREADS
-  pthread_mutex_unlock(&lock.mutex);
-#endif
+  prefix = package_prefix(pkg, path_max);
 
-install:
   if (pkg->configure) {
     E_FORMAT(&command, "cd %s/%s && %s", dir, pkg->name, pkg->configure);
 
     _debug("command(configure): %s", command);
 
-    rc = system(command);
+    rc = run_command(command, prefix, NULL);
     if (0 != rc)
       goto cleanup;
   }
@@ -1574,29 +2850,71 @@ install:
     rc = clib_package_install_executable(pkg, dir, verbose);
   }
 
-  if (0 == rc) {
+  // the package itself is ready, a dependency cycle must not wait for it
+  land_package_flight(install, rc);
+
+  if (0 == rc && !install->skip_dependencies) {
     rc = clib_package_install_dependencies(pkg, dir, verbose);
   }
 
 cleanup:
-  if (pkg_dir)
-    free(pkg_dir);
-  if (package_json)
-    free(package_json);
-  if (iterator)
-    list_iterator_destroy(iterator);
+  if (prefix)
+    free(prefix);
   if (command)
     free(command);
-#ifdef HAVE_PTHREADS
-  if (NULL != pkg && NULL != pkg->src) {
-    if (pkg->src->len > 0) {
-      if (fetchs) {
-        free(fetchs);
-      }
-    }
+  return rc;
+}
+
+static void package_install_init(package_install_t *install,
+                                 clib_package_t *pkg, const char *dir,
+                                 int verbose) {
+  memset(install, 0, sizeof(package_install_t));
+  install->pkg = pkg;
+  install->dir = dir;
+  install->verbose = verbose;
+  install->claim = -1;
+}
+
+/**
+ * Release `install` once none of its downloads are in flight anymore.
+ */
+
+static void package_install_destroy(package_install_t *install) {
+  clib_download_group_wait(&install->group);
+  if (-1 != install->claim) {
+    clib_cache_release_package(install->pkg->author, install->pkg->name,
+                               cache_version(install->pkg), install->claim);
+    install->claim = -1;
   }
-  fetchs = NULL;
-#endif
+  if (install->flight) {
+    // an install that did not get to the end failed
+    land_package_flight(install, -1);
+    release_package_flight(install->flight);
+    install->flight = NULL;
+  }
+  if (install->pkg_dir) {
+    free(install->pkg_dir);
+    install->pkg_dir = NULL;
+  }
+}
+
+/**
+ * Install the given `pkg` in `dir`
+ */
+
+int clib_package_install(clib_package_t *pkg, const char *dir, int verbose) {
+  package_install_t install;
+  int rc = 0;
+
+  package_install_init(&install, pkg, dir, verbose);
+
+  rc = start_package_install(&install);
+
+  if (0 == rc) {
+    rc = finish_package_install(&install);
+  }
+
+  package_install_destroy(&install);
   return rc;
 }
 
@@ -1637,7 +2955,8 @@ void clib_package_free(clib_package_t *pkg) {
     return;
   }
 
-  if (0 != pkg->refs) {
+  // a shared package is only freed by its last holder
+  if (0 < __sync_fetch_and_sub(&pkg->refs, 1)) {
     return;
   }
 
@@ -1658,6 +2977,7 @@ void clib_package_free(clib_package_t *pkg) {
   FREE(repo_name);
   FREE(url);
   FREE(version);
+  FREE(commit);
   FREE(flags);
 #undef FREE
 
@@ -1686,6 +3006,32 @@ void clib_package_dependency_free(void *_dep) {
 }
 
 void clib_package_cleanup() {
+  clib_cache_gc_stats_t evicted;
+
+  // ready for the next run
+  if (0 != refreshed_manifests) {
+    hash_each(refreshed_manifests, {
+      clib_download_group_wait(&((manifest_refresh_t *)val)->group);
+      free((char *)key);
+      manifest_refresh_free(val);
+    });
+
+    hash_free(refreshed_manifests);
+    refreshed_manifests = 0;
+  }
+
+  clib_cache_flush();
+
+  _debug("requests saved by the missing manifest cache: %lu",
+         clib_cache_stats().missing_hits);
+
+  // a few entries at a time, `clib cache gc` does the rest
+  if (!opts.skip_cache && 0 == clib_cache_evict(&evicted) &&
+      evicted.evicted > 0) {
+    _debug("evicted %ld cache entries, %lld bytes reclaimed", evicted.evicted,
+           (long long)evicted.reclaimed);
+  }
+
   if (0 != visited_packages) {
     hash_each(visited_packages, {
       free((void *)key);
@@ -1696,5 +3042,51 @@ void clib_package_cleanup() {
     visited_packages = 0;
   }
 
+  if (0 != package_flights) {
+    hash_each(package_flights, {
+      free((void *)key);
+      release_package_flight(val);
+    });
+
+    hash_free(package_flights);
+    package_flights = 0;
+  }
+
+  if (0 != workers) {
+    clib_cache_set_pool(0);
+    clib_pool_free(workers);
+    workers = 0;
+  }
+
+  if (0 != downloads) {
+    clib_download_queue_free(downloads);
+    downloads = 0;
+  }
+
+  if (0 != prefetched_manifests) {
+    hash_each(prefetched_manifests, {
+      (void)key;
+      manifest_prefetch_free(val);
+    });
+
+    hash_free(prefetched_manifests);
+    prefetched_manifests = 0;
+  }
+
+  if (0 != repo_refs) {
+    hash_each(repo_refs, {
+      repo_refs_t *refs = val;
+      free((char *)key);
+      free(refs->body);
+      if (refs->waiting) {
+        list_destroy(refs->waiting);
+      }
+      free(refs);
+    });
+
+    hash_free(repo_refs);
+    repo_refs = 0;
+  }
+
   curl_share_cleanup(clib_package_curl_share);
 }
@@ -30,6 +30,7 @@ typedef struct {
   char *repo_name;
   char *url;
   char *version;
+  char *commit; // `version` resolved, NULL if it could not be
   char *makefile;
   char *filename; // `package.json` or `clib.json`
   char *flags;
@@ -38,7 +39,7 @@ typedef struct {
   list_t *development;
   list_t *src;
   void *data; // user data
-  unsigned int refs;
+  unsigned int refs; // holders besides the first, see `clib_package_free()`
 } clib_package_t;
 
 typedef struct {
@@ -0,0 +1,314 @@
+//
+// clib-pool.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#include "clib-pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  clib_pool_fn fn;
+  void *data;
+  clib_pool_group_t *group;
+} clib_pool_task_t;
+
+static inline void pool_lock(clib_pool_t *pool) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&pool->mutex);
+#endif
+}
+
+static inline void pool_unlock(clib_pool_t *pool) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+/**
+ * @return The worker of `pool` running the calling thread, if any
+ */
+
+static inline clib_pool_worker_t *current_worker(clib_pool_t *pool) {
+#ifdef HAVE_PTHREADS
+  return pthread_getspecific(pool->self);
+#else
+  return NULL;
+#endif
+}
+
+/**
+ * Pick the next task for `worker`, NULL if the calling thread is not a
+ * worker: its own newest task, else the oldest task submitted from outside,
+ * else the oldest task of another worker. Called with the lock held.
+ */
+
+static clib_pool_task_t *take_task(clib_pool_t *pool,
+                                   clib_pool_worker_t *worker) {
+  list_node_t *node = NULL;
+  clib_pool_task_t *task = NULL;
+
+#ifdef HAVE_PTHREADS
+  if (worker) {
+    node = list_rpop(worker->deque);
+  }
+#endif
+
+  if (NULL == node) {
+    node = list_lpop(pool->tasks);
+  }
+
+#ifdef HAVE_PTHREADS
+  for (int i = 0; NULL == node && i < pool->size; i++) {
+    clib_pool_worker_t *victim = &pool->workers[i];
+    if (victim != worker) {
+      node = list_lpop(victim->deque);
+    }
+  }
+#endif
+
+  if (node) {
+    task = node->val;
+    free(node);
+  }
+
+  return task;
+}
+
+/**
+ * Run `task` and account for it. Called with the lock held, which is
+ * released meanwhile.
+ */
+
+static void run_task(clib_pool_t *pool, clib_pool_task_t *task) {
+  clib_pool_group_t *group = task->group;
+
+  pool_unlock(pool);
+  task->fn(task->data);
+  free(task);
+  pool_lock(pool);
+
+  pool->pending--;
+  if (group) {
+    group->pending--;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_cond_broadcast(&pool->idle);
+#endif
+}
+
+/**
+ * Run tasks until `*pending` drops to zero, sleeping only when there is
+ * nothing left to run. Called with the lock held.
+ */
+
+static void help_until_done(clib_pool_t *pool, int *pending) {
+  clib_pool_worker_t *worker = current_worker(pool);
+  clib_pool_task_t *task = NULL;
+
+  while (*pending > 0) {
+    if ((task = take_task(pool, worker))) {
+      run_task(pool, task);
+      continue;
+    }
+
+#ifdef HAVE_PTHREADS
+    pthread_cond_wait(&pool->idle, &pool->mutex);
+#else
+    // everything pending was run already, nothing else can finish it
+    break;
+#endif
+  }
+}
+
+#ifdef HAVE_PTHREADS
+static void *worker_main(void *arg) {
+  clib_pool_worker_t *worker = arg;
+  clib_pool_t *pool = worker->pool;
+  clib_pool_task_t *task = NULL;
+
+  pthread_setspecific(pool->self, worker);
+  pthread_mutex_lock(&pool->mutex);
+
+  while (1) {
+    if ((task = take_task(pool, worker))) {
+      run_task(pool, task);
+      continue;
+    }
+
+    if (pool->stopping) {
+      break;
+    }
+
+    pthread_cond_wait(&pool->work, &pool->mutex);
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+#endif
+
+clib_pool_t *clib_pool_new(int concurrency) {
+  clib_pool_t *pool = malloc(sizeof(clib_pool_t));
+
+  if (NULL == pool) {
+    return NULL;
+  }
+
+  memset(pool, 0, sizeof(clib_pool_t));
+
+  if (!(pool->tasks = list_new())) {
+    free(pool);
+    return NULL;
+  }
+
+#ifdef HAVE_PTHREADS
+  int size = concurrency > 0 ? concurrency : 1;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pthread_key_create(&pool->self, NULL);
+
+  if (!(pool->workers = malloc(size * sizeof(clib_pool_worker_t)))) {
+    clib_pool_free(pool);
+    return NULL;
+  }
+
+  for (pool->size = 0; pool->size < size; pool->size++) {
+    pool->workers[pool->size].pool = pool;
+    if (!(pool->workers[pool->size].deque = list_new())) {
+      clib_pool_free(pool);
+      return NULL;
+    }
+  }
+
+  // workers steal from each other, so they are all set up before any runs
+  pthread_mutex_lock(&pool->mutex);
+  for (pool->running = 0; pool->running < size; pool->running++) {
+    clib_pool_worker_t *worker = &pool->workers[pool->running];
+    if (0 != pthread_create(&worker->thread, NULL, worker_main, worker)) {
+      // run with the workers we have
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (0 == pool->running) {
+    clib_pool_free(pool);
+    return NULL;
+  }
+#else
+  (void)concurrency;
+#endif
+
+  return pool;
+}
+
+int clib_pool_submit(clib_pool_t *pool, clib_pool_group_t *group,
+                     clib_pool_fn fn, void *data) {
+  clib_pool_worker_t *worker = NULL;
+  clib_pool_task_t *task = NULL;
+  list_node_t *node = NULL;
+
+  if (!pool || !fn) {
+    return -1;
+  }
+
+  if (!(task = malloc(sizeof(clib_pool_task_t)))) {
+    return -1;
+  }
+
+  task->fn = fn;
+  task->data = data;
+  task->group = group;
+
+  if (!(node = list_node_new(task))) {
+    free(task);
+    return -1;
+  }
+
+  worker = current_worker(pool);
+
+  pool_lock(pool);
+#ifdef HAVE_PTHREADS
+  if (worker) {
+    list_rpush(worker->deque, node);
+  } else {
+    list_rpush(pool->tasks, node);
+  }
+  pthread_cond_signal(&pool->work);
+#else
+  (void)worker;
+  list_rpush(pool->tasks, node);
+#endif
+  pool->pending++;
+  if (group) {
+    group->pending++;
+  }
+  pool_unlock(pool);
+
+  return 0;
+}
+
+void clib_pool_group_init(clib_pool_group_t *group) {
+  memset(group, 0, sizeof(clib_pool_group_t));
+}
+
+void clib_pool_group_wait(clib_pool_t *pool, clib_pool_group_t *group) {
+  if (!pool || !group) {
+    return;
+  }
+
+  pool_lock(pool);
+  help_until_done(pool, &group->pending);
+  pool_unlock(pool);
+}
+
+void clib_pool_wait(clib_pool_t *pool) {
+  if (!pool) {
+    return;
+  }
+
+  pool_lock(pool);
+  help_until_done(pool, &pool->pending);
+  pool_unlock(pool);
+}
+
+void clib_pool_free(clib_pool_t *pool) {
+  if (!pool) {
+    return;
+  }
+
+  clib_pool_wait(pool);
+
+#ifdef HAVE_PTHREADS
+  if (pool->workers) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->running; i++) {
+      pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool->size; i++) {
+      list_destroy(pool->workers[i].deque);
+    }
+
+    free(pool->workers);
+  }
+
+  pthread_key_delete(pool->self);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+#endif
+
+  list_destroy(pool->tasks);
+  free(pool);
+}
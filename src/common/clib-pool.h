@@ -0,0 +1,94 @@
+//
+// clib-pool.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_POOL_H
+#define CLIB_POOL_H 1
+
+#include "list/list.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+typedef void (*clib_pool_fn)(void *data);
+
+typedef struct clib_pool clib_pool_t;
+typedef struct clib_pool_group clib_pool_group_t;
+typedef struct clib_pool_worker clib_pool_worker_t;
+
+/**
+ * A set of tasks that can be waited on together, e.g. the dependencies of
+ * a single package, while sharing the workers with everyone else.
+ */
+struct clib_pool_group {
+  int pending;
+};
+
+#ifdef HAVE_PTHREADS
+struct clib_pool_worker {
+  clib_pool_t *pool;
+  list_t *deque; // tasks submitted by this worker, popped from the back
+  pthread_t thread;
+};
+#endif
+
+struct clib_pool {
+  list_t *tasks; // tasks submitted from outside of the workers
+  int size;
+  int running; // workers whose thread started
+  int pending; // submitted but not finished yet
+  int stopping;
+#ifdef HAVE_PTHREADS
+  clib_pool_worker_t *workers;
+  pthread_key_t self;
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t idle;
+#endif
+};
+
+/**
+ * Start a pool of `concurrency` worker threads. Without pthreads the tasks
+ * are run on the calling thread by `clib_pool_wait()`.
+ *
+ * @return A new pool, or NULL on error
+ */
+clib_pool_t *clib_pool_new(int concurrency);
+
+/**
+ * Queue `fn(data)` to run on a worker, tracked by the optional `group`.
+ * A worker runs the tasks it submitted itself newest first, idle workers
+ * steal the oldest ones.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_pool_submit(clib_pool_t *pool, clib_pool_group_t *group,
+                     clib_pool_fn fn, void *data);
+
+/**
+ * Initialize an empty group of tasks.
+ */
+void clib_pool_group_init(clib_pool_group_t *group);
+
+/**
+ * Block until every task of `group` has finished. The calling thread runs
+ * queued tasks meanwhile, so a task may wait for the tasks it submitted
+ * without holding up a worker.
+ */
+void clib_pool_group_wait(clib_pool_t *pool, clib_pool_group_t *group);
+
+/**
+ * Like `clib_pool_group_wait()`, for every submitted task.
+ */
+void clib_pool_wait(clib_pool_t *pool);
+
+/**
+ * Wait for the pending tasks, then stop the workers and free the pool.
+ */
+void clib_pool_free(clib_pool_t *pool);
+
+#endif
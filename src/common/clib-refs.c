@@ -0,0 +1,136 @@
+//
+// clib-refs.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#include "clib-refs.h"
+#include <ctype.h>
+#include <string.h>
+
+#define TAGS "refs/tags/"
+#define HEADS "refs/heads/"
+#define PEELED "^{}"
+
+int clib_refs_is_commit(const char *version) {
+  if (NULL == version || CLIB_REFS_COMMIT_SIZE - 1 != strlen(version)) {
+    return 0;
+  }
+
+  for (int i = 0; i < CLIB_REFS_COMMIT_SIZE - 1; i++) {
+    if (!isxdigit((unsigned char)version[i])) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * @return The length of the pkt-line at `line`, prefix included, or -1 if
+ * it is not one
+ */
+
+static int pkt_length(const char *line) {
+  int length = 0;
+
+  for (int i = 0; i < 4; i++) {
+    char c = line[i];
+
+    if (!isxdigit((unsigned char)c)) {
+      return -1;
+    }
+
+    length = 16 * length + (isdigit((unsigned char)c)
+                                ? c - '0'
+                                : tolower((unsigned char)c) - 'a' + 10);
+  }
+
+  return length;
+}
+
+/**
+ * @return 1 if the ref `name` of `length` bytes is `prefix` followed by
+ * `version`, and `suffix`
+ */
+
+static int is_ref(const char *name, size_t length, const char *prefix,
+                  const char *version, const char *suffix) {
+  size_t prefix_length = strlen(prefix);
+  size_t version_length = strlen(version);
+  size_t suffix_length = strlen(suffix);
+
+  return length == prefix_length + version_length + suffix_length &&
+         0 == strncmp(name, prefix, prefix_length) &&
+         0 == strncmp(name + prefix_length, version, version_length) &&
+         0 == strncmp(name + prefix_length + version_length, suffix,
+                      suffix_length);
+}
+
+int clib_refs_find(const char *refs, size_t size, const char *version,
+                   char *commit) {
+  size_t offset = 0;
+  int peeled = 0;
+  int found = 0;
+
+  while (offset + 4 <= size) {
+    int length = pkt_length(refs + offset);
+    const char *line = refs + offset + 4;
+    const char *name = line + CLIB_REFS_COMMIT_SIZE;
+    size_t name_length = 0;
+    int kind = 0;
+
+    if (length < 0) {
+      return 0;
+    }
+
+    // flush and delimiter packets carry no ref
+    if (length <= 4) {
+      offset += 4;
+      continue;
+    }
+
+    if (offset + length > size) {
+      break;
+    }
+
+    offset += length;
+
+    // "<commit> <name>", then capabilities after a NUL on the first line,
+    // skipping the "# service=git-upload-pack" header
+    if (length - 4 <= CLIB_REFS_COMMIT_SIZE ||
+        ' ' != line[CLIB_REFS_COMMIT_SIZE - 1]) {
+      continue;
+    }
+
+    while (name + name_length < refs + offset && name[name_length] &&
+           '\n' != name[name_length]) {
+      name_length++;
+    }
+
+    if (is_ref(name, name_length, TAGS, version, PEELED)) {
+      // the commit of an annotated tag, listed after the tag itself
+      kind = CLIB_REFS_TAG;
+      peeled = 1;
+    } else if (is_ref(name, name_length, TAGS, version, "")) {
+      kind = peeled ? 0 : CLIB_REFS_TAG;
+    } else if (is_ref(name, name_length, HEADS, version, "")) {
+      kind = found ? 0 : CLIB_REFS_BRANCH;
+    }
+
+    if (kind) {
+      char sha[CLIB_REFS_COMMIT_SIZE];
+
+      memcpy(sha, line, CLIB_REFS_COMMIT_SIZE - 1);
+      sha[CLIB_REFS_COMMIT_SIZE - 1] = 0;
+
+      if (clib_refs_is_commit(sha)) {
+        memcpy(commit, sha, CLIB_REFS_COMMIT_SIZE);
+        found = kind;
+      }
+    }
+  }
+
+  return found;
+}
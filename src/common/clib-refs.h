@@ -0,0 +1,43 @@
+//
+// clib-refs.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_REFS_H
+#define CLIB_REFS_H 1
+
+#include <stddef.h>
+
+/**
+ * The 40 hex digits of a commit, and a terminating NUL
+ */
+#define CLIB_REFS_COMMIT_SIZE 41
+
+enum {
+  CLIB_REFS_BRANCH = 1,
+  CLIB_REFS_TAG = 2,
+};
+
+/**
+ * @return 1 if `version` is a full commit SHA, which names the same files
+ * forever, 0 otherwise
+ */
+int clib_refs_is_commit(const char *version);
+
+/**
+ * Find `version` among the refs a git server advertises to clients, i.e.
+ * the response to `GET <repo>.git/info/refs?service=git-upload-pack`. Tags
+ * are looked up before branches, like git does, and annotated tags are
+ * resolved to the commit they point to.
+ *
+ * @param commit Set to the commit `version` points to, at least
+ * `CLIB_REFS_COMMIT_SIZE` bytes
+ *
+ * @return `CLIB_REFS_TAG` or `CLIB_REFS_BRANCH` if found, 0 otherwise
+ */
+int clib_refs_find(const char *refs, size_t size, const char *version,
+                   char *commit);
+
+#endif
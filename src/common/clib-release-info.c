@@ -5,31 +5,54 @@
 // MIT licensed
 //
 
+#include "clib-cache.h"
+#include "clib-download.h"
 #include "debug/debug.h"
-#include "http-get/http-get.h"
 #include "parson/parson.h"
 #include "strdup/strdup.h"
+#include <stdlib.h>
 
 #define LATEST_RELEASE_ENDPOINT                                                \
   "https://api.github.com/repos/clibs/clib/releases/latest"
 
+#define LATEST_RELEASE_CACHE "release-latest.json"
+
 static debug_t debugger;
 
 const char *clib_release_get_latest_tag(void) {
   debug_init(&debugger, "clib-release-info");
 
-  http_get_response_t *res = http_get(LATEST_RELEASE_ENDPOINT);
+  clib_cache_validators_t validators;
+  char *cached = clib_cache_read_meta(LATEST_RELEASE_CACHE, &validators);
+
+  // the unchanged release costs no body and no rate limit
+  clib_download_t *download = clib_download_get(
+      LATEST_RELEASE_ENDPOINT, cached ? validators.etag : NULL,
+      cached ? validators.last_modified : NULL, NULL);
 
   JSON_Value *root_json = NULL;
   JSON_Object *json_object = NULL;
+  const char *data = NULL;
   char *tag_name = NULL;
 
-  if (!res->ok) {
+  if (!download || !download->ok) {
     debug(&debugger, "Couldn't lookup latest release");
     goto cleanup;
   }
 
-  if (!(root_json = json_parse_string(res->data))) {
+  if (304 == download->status) {
+    debug(&debugger, "Latest release not modified");
+    data = cached;
+  } else {
+    data = download->body;
+    clib_cache_validators_init(&validators, NULL, download->etag,
+                               download->last_modified);
+    if (data) {
+      clib_cache_save_meta(LATEST_RELEASE_CACHE, data, &validators);
+    }
+  }
+
+  if (!data || !(root_json = json_parse_string(data))) {
     debug(&debugger, "Unable to parse release JSON response");
     goto cleanup;
   }
@@ -50,7 +73,8 @@ cleanup:
   if (root_json)
     json_value_free(root_json);
 
-  http_get_free(res);
+  clib_download_free(download);
+  free(cached);
 
   return tag_name;
 }
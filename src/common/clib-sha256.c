@@ -0,0 +1,177 @@
+//
+// clib-sha256.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#include "clib-sha256.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static void transform(clib_sha256_t *ctx, const unsigned char *block) {
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h;
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+  }
+
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  a = ctx->state[0];
+  b = ctx->state[1];
+  c = ctx->state[2];
+  d = ctx->state[3];
+  e = ctx->state[4];
+  f = ctx->state[5];
+  g = ctx->state[6];
+  h = ctx->state[7];
+
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + k[i] + w[i];
+    uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+  ctx->state[5] += f;
+  ctx->state[6] += g;
+  ctx->state[7] += h;
+}
+
+void clib_sha256_init(clib_sha256_t *ctx) {
+  static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                      0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19};
+
+  memset(ctx, 0, sizeof(clib_sha256_t));
+  memcpy(ctx->state, initial, sizeof(initial));
+}
+
+void clib_sha256_update(clib_sha256_t *ctx, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+
+  ctx->length += size;
+
+  while (size > 0) {
+    size_t n = sizeof(ctx->block) - ctx->used;
+
+    if (n > size) {
+      n = size;
+    }
+
+    memcpy(ctx->block + ctx->used, bytes, n);
+    ctx->used += n;
+    bytes += n;
+    size -= n;
+
+    if (sizeof(ctx->block) == ctx->used) {
+      transform(ctx, ctx->block);
+      ctx->used = 0;
+    }
+  }
+}
+
+int clib_sha256_update_file(clib_sha256_t *ctx, const char *path) {
+  unsigned char buffer[BUFSIZ];
+  FILE *file = fopen(path, "rb");
+  size_t n = 0;
+  int rc = 0;
+
+  if (NULL == file) {
+    return -1;
+  }
+
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    clib_sha256_update(ctx, buffer, n);
+  }
+
+  if (ferror(file)) {
+    rc = -1;
+  }
+
+  fclose(file);
+  return rc;
+}
+
+int clib_sha256_update_fd(clib_sha256_t *ctx, int fd) {
+  unsigned char buffer[BUFSIZ];
+  ssize_t n = 0;
+
+  while (0 != (n = read(fd, buffer, sizeof(buffer)))) {
+    if (n < 0) {
+      return -1;
+    }
+
+    clib_sha256_update(ctx, buffer, n);
+  }
+
+  return 0;
+}
+
+void clib_sha256_final_hex(clib_sha256_t *ctx, char hex[CLIB_SHA256_HEX_SIZE]) {
+  static const char digits[] = "0123456789abcdef";
+  unsigned char length[8];
+  uint64_t bits = ctx->length * 8;
+
+  for (int i = 7; i >= 0; i--) {
+    length[i] = bits & 0xff;
+    bits >>= 8;
+  }
+
+  clib_sha256_update(ctx, "\x80", 1);
+
+  while (56 != ctx->used) {
+    clib_sha256_update(ctx, "\0", 1);
+  }
+
+  clib_sha256_update(ctx, length, sizeof(length));
+
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 4; j++) {
+      unsigned char byte = (ctx->state[i] >> (24 - j * 8)) & 0xff;
+      hex[i * 8 + j * 2] = digits[byte >> 4];
+      hex[i * 8 + j * 2 + 1] = digits[byte & 0xf];
+    }
+  }
+
+  hex[CLIB_SHA256_HEX_SIZE - 1] = 0;
+}
@@ -0,0 +1,45 @@
+//
+// clib-sha256.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_SHA256_H
+#define CLIB_SHA256_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CLIB_SHA256_SIZE 32
+#define CLIB_SHA256_HEX_SIZE (2 * CLIB_SHA256_SIZE + 1)
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length; // bytes hashed so far
+  unsigned char block[64];
+  size_t used; // bytes buffered in `block`
+} clib_sha256_t;
+
+void clib_sha256_init(clib_sha256_t *ctx);
+
+void clib_sha256_update(clib_sha256_t *ctx, const void *data, size_t size);
+
+/**
+ * Hash the contents of the file at `path`.
+ *
+ * @return 0 on success, -1 if it could not be read
+ */
+int clib_sha256_update_file(clib_sha256_t *ctx, const char *path);
+
+/**
+ * Like `clib_sha256_update_file()`, reading `fd` to its end.
+ */
+int clib_sha256_update_fd(clib_sha256_t *ctx, int fd);
+
+/**
+ * Finish hashing and write the digest as a NUL terminated hex string.
+ */
+void clib_sha256_final_hex(clib_sha256_t *ctx, char hex[CLIB_SHA256_HEX_SIZE]);
+
+#endif
@@ -0,0 +1,653 @@
+//
+// clib-tree.c
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+// openat() and friends, and the type of directory entries
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifndef _DARWIN_C_SOURCE
+#define _DARWIN_C_SOURCE
+#endif
+
+#include "clib-tree.h"
+#include "asprintf/asprintf.h"
+#include "copy/copy.h"
+#include "debug/debug.h"
+#include "strdup/strdup.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifdef __APPLE__
+#define st_atim st_atimespec
+#define st_mtim st_mtimespec
+#endif
+
+// file systems that do not report the type of entries are stat'ed instead
+#ifdef DT_DIR
+#define entry_type(entry) (entry)->d_type
+#else
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_REG 8
+#define DT_LNK 10
+#define entry_type(entry) DT_UNKNOWN
+#endif
+
+static debug_t debugger;
+
+#define _debug(...)                                                            \
+  ({                                                                           \
+    if (!(debugger.name))                                                      \
+      debug_init(&debugger, "clib-tree");                                      \
+    debug(&debugger, __VA_ARGS__);                                             \
+  })
+
+#ifdef _WIN32
+
+#include "rimraf/rimraf.h"
+#include "tinydir/tinydir.h"
+
+// there are no directory fds to walk trees relative to, files are reached
+// by their paths on the calling thread
+
+static int walk_path(const char *path, const char *relative, clib_tree_fn fn,
+                     void *data) {
+  tinydir_dir dir;
+  int rc = 0;
+
+  if (0 != tinydir_open(&dir, path)) {
+    return -1;
+  }
+
+  while (0 == rc && dir.has_next) {
+    tinydir_file file;
+    struct stat st;
+    char *child = NULL;
+
+    if (0 != tinydir_readfile(&dir, &file)) {
+      rc = -1;
+      break;
+    }
+
+    if (0 != strcmp(".", file.name) && 0 != strcmp("..", file.name)) {
+      if (*relative) {
+        asprintf(&child, "%s/%s", relative, file.name);
+      } else {
+        child = strdup(file.name);
+      }
+
+      if (NULL == child) {
+        rc = -1;
+      } else if (file.is_dir) {
+        rc = walk_path(file.path, child, fn, data);
+      } else if (0 == stat(file.path, &st) && S_ISREG(st.st_mode)) {
+        rc = fn(AT_FDCWD, file.path, child, &st, data);
+      }
+
+      free(child);
+    }
+
+    if (0 == rc && 0 != tinydir_next(&dir)) {
+      rc = -1;
+    }
+  }
+
+  tinydir_close(&dir);
+
+  if (0 != rc) {
+    _debug("failed at %s", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+int clib_tree_walk(clib_pool_t *pool, const char *root, clib_tree_fn fn,
+                   void *data) {
+  return walk_path(root, "", fn, data);
+}
+
+int clib_tree_copy(clib_pool_t *pool, const char *from, const char *to) {
+  return copy_dir((char *)from, (char *)to);
+}
+
+int clib_tree_link(clib_pool_t *pool, const char *from, const char *to) {
+  return clib_tree_copy(pool, from, to);
+}
+
+int clib_tree_remove(clib_pool_t *pool, const char *path) {
+  return rimraf(path);
+}
+
+#else
+
+#define ROOT_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#define DIR_FLAGS (ROOT_FLAGS | O_NOFOLLOW)
+
+enum { TREE_WALK, TREE_COPY, TREE_LINK, TREE_REMOVE };
+
+typedef struct tree_walk tree_walk_t;
+typedef struct tree_dir tree_dir_t;
+
+struct tree_walk {
+  clib_pool_t *pool;
+  clib_pool_group_t group;
+  int op;
+  clib_tree_fn fn;
+  void *data;
+  int open_dirs;
+  int rc;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t mutex;
+#endif
+};
+
+/**
+ * A directory being walked. It stays open until nothing below it is
+ * pending anymore, so that its entries can be reached relative to it.
+ */
+struct tree_dir {
+  tree_walk_t *walk;
+  tree_dir_t *parent;
+  char *name; // in the parent, or the root as given
+  char *path; // relative to the root
+  int fd;
+  int to_fd; // the directory copied to
+  struct stat st;
+  int refs; // itself, and its pending subdirectories and batches
+  int sync; // walked on the calling thread only
+};
+
+typedef struct {
+  tree_dir_t *dir;
+  int count;
+  char *names[CLIB_TREE_BATCH];
+  unsigned char types[CLIB_TREE_BATCH];
+} tree_batch_t;
+
+static void walk_dir(tree_dir_t *dir);
+
+static inline void walk_lock(tree_walk_t *walk) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&walk->mutex);
+#endif
+}
+
+static inline void walk_unlock(tree_walk_t *walk) {
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&walk->mutex);
+#endif
+}
+
+static void fail(tree_walk_t *walk, tree_dir_t *dir, const char *name) {
+  _debug("failed at %s%s%s: %s", dir ? dir->path : "",
+         dir && *dir->path ? "/" : "", name, strerror(errno));
+
+  walk_lock(walk);
+  walk->rc = -1;
+  walk_unlock(walk);
+}
+
+static int failed(tree_walk_t *walk) {
+  int rc = 0;
+
+  walk_lock(walk);
+  rc = walk->rc;
+  walk_unlock(walk);
+
+  return 0 != rc;
+}
+
+/**
+ * Open `name` below `parent`, or the root if `parent` is NULL, and the
+ * directory `to_name` it is copied to. `parent` is held until it is done.
+ */
+
+static tree_dir_t *open_dir(tree_walk_t *walk, tree_dir_t *parent,
+                            const char *name, const char *to_name) {
+  tree_dir_t *dir = malloc(sizeof(tree_dir_t));
+  int at = parent ? parent->fd : AT_FDCWD;
+  int to_at = parent ? parent->to_fd : AT_FDCWD;
+
+  if (NULL == dir) {
+    return NULL;
+  }
+
+  memset(dir, 0, sizeof(tree_dir_t));
+  dir->walk = walk;
+  dir->parent = parent;
+  dir->fd = -1;
+  dir->to_fd = -1;
+  dir->refs = 1;
+  dir->sync = parent ? parent->sync : 0;
+  dir->name = strdup(name);
+
+  if (parent && *parent->path) {
+    asprintf(&dir->path, "%s/%s", parent->path, name);
+  } else {
+    dir->path = strdup(parent ? name : "");
+  }
+
+  if (!dir->name || !dir->path) {
+    goto error;
+  }
+
+  if (-1 == (dir->fd = openat(at, name, parent ? DIR_FLAGS : ROOT_FLAGS)) ||
+      0 != fstat(dir->fd, &dir->st)) {
+    goto error;
+  }
+
+  if (TREE_COPY == walk->op || TREE_LINK == walk->op) {
+    if (0 != mkdirat(to_at, to_name, 0700) && EEXIST != errno) {
+      goto error;
+    }
+
+    if (-1 == (dir->to_fd = openat(to_at, to_name, ROOT_FLAGS))) {
+      goto error;
+    }
+  }
+
+  walk_lock(walk);
+  walk->open_dirs++;
+  if (parent) {
+    parent->refs++;
+  }
+  walk_unlock(walk);
+
+  return dir;
+
+error:
+  fail(walk, parent, name);
+
+  if (-1 != dir->fd) {
+    close(dir->fd);
+  }
+
+  free(dir->name);
+  free(dir->path);
+  free(dir);
+  return NULL;
+}
+
+/**
+ * Finish `dir` now that everything below it is done: set the mode and
+ * times of its copy, or remove it.
+ */
+
+static void close_dir(tree_dir_t *dir) {
+  tree_walk_t *walk = dir->walk;
+  int at = dir->parent ? dir->parent->fd : AT_FDCWD;
+  int rc = 0;
+
+  if ((TREE_COPY == walk->op || TREE_LINK == walk->op) && !failed(walk)) {
+    struct timespec times[2] = {dir->st.st_atim, dir->st.st_mtim};
+
+    if (0 != fchmod(dir->to_fd, dir->st.st_mode & 07777) ||
+        0 != futimens(dir->to_fd, times)) {
+      rc = -1;
+    }
+  }
+
+  close(dir->fd);
+
+  if (-1 != dir->to_fd) {
+    close(dir->to_fd);
+  }
+
+  if (TREE_REMOVE == walk->op && !failed(walk) &&
+      0 != unlinkat(at, dir->name, AT_REMOVEDIR)) {
+    rc = -1;
+  }
+
+  if (0 != rc) {
+    fail(walk, dir->parent, dir->name);
+  }
+
+  walk_lock(walk);
+  walk->open_dirs--;
+  walk_unlock(walk);
+
+  free(dir->name);
+  free(dir->path);
+  free(dir);
+}
+
+/**
+ * Drop a reference to `dir`, and close it and then its parents as long as
+ * nothing below them is pending.
+ */
+
+static void release_dir(tree_dir_t *dir) {
+  while (dir) {
+    tree_walk_t *walk = dir->walk;
+    tree_dir_t *parent = dir->parent;
+    int refs = 0;
+
+    walk_lock(walk);
+    refs = --dir->refs;
+    walk_unlock(walk);
+
+    if (refs > 0) {
+      return;
+    }
+
+    close_dir(dir);
+    dir = parent;
+  }
+}
+
+static int copy_link(tree_dir_t *dir, const char *name) {
+  char target[PATH_MAX];
+  ssize_t length = readlinkat(dir->fd, name, target, sizeof(target) - 1);
+
+  if (length < 0) {
+    return -1;
+  }
+
+  target[length] = 0;
+  unlinkat(dir->to_fd, name, 0);
+
+  return symlinkat(target, dir->to_fd, name);
+}
+
+static int visit_file(tree_dir_t *dir, const char *name, unsigned char type) {
+  tree_walk_t *walk = dir->walk;
+  struct stat st;
+  char *path = NULL;
+  int rc = 0;
+
+  switch (walk->op) {
+  case TREE_REMOVE:
+    return unlinkat(dir->fd, name, 0);
+
+  case TREE_LINK:
+    if (DT_REG == type) {
+      unlinkat(dir->to_fd, name, 0);
+
+      if (0 == linkat(dir->fd, name, dir->to_fd, name, 0)) {
+        return 0;
+      }
+    }
+    // copied where it cannot be linked, e.g. across filesystems
+
+  case TREE_COPY:
+    if (DT_LNK == type) {
+      return copy_link(dir, name);
+    }
+
+    if (DT_REG == type) {
+      return copy_file_at(dir->fd, (char *)name, dir->to_fd, (char *)name);
+    }
+
+    return 0;
+
+  default:
+    // dangling links and special files are not part of the tree
+    if (0 != fstatat(dir->fd, name, &st, 0) || !S_ISREG(st.st_mode)) {
+      return 0;
+    }
+
+    if (*dir->path) {
+      asprintf(&path, "%s/%s", dir->path, name);
+    } else {
+      path = strdup(name);
+    }
+
+    if (NULL == path) {
+      return -1;
+    }
+
+    rc = walk->fn(dir->fd, name, path, &st, walk->data);
+    free(path);
+    return rc;
+  }
+}
+
+static void run_batch(tree_batch_t *batch) {
+  tree_dir_t *dir = batch->dir;
+
+  for (int i = 0; i < batch->count; i++) {
+    if (!failed(dir->walk) &&
+        0 != visit_file(dir, batch->names[i], batch->types[i])) {
+      fail(dir->walk, dir, batch->names[i]);
+    }
+
+    free(batch->names[i]);
+  }
+
+  free(batch);
+  release_dir(dir);
+}
+
+static void run_batch_task(void *data) { run_batch(data); }
+
+static void walk_dir_task(void *data) { walk_dir(data); }
+
+/**
+ * Hand `dir` to the pool, or walk it right away once too many directories
+ * are open, or without a pool.
+ */
+
+static void schedule_dir(tree_dir_t *dir) {
+  tree_walk_t *walk = dir->walk;
+
+  if (!dir->sync && walk->pool) {
+    walk_lock(walk);
+    dir->sync = walk->open_dirs > CLIB_TREE_MAX_OPEN_DIRS;
+    walk_unlock(walk);
+  }
+
+  if (!dir->sync && walk->pool &&
+      0 == clib_pool_submit(walk->pool, &walk->group, walk_dir_task, dir)) {
+    return;
+  }
+
+  // nothing below it is handed to the pool either
+  dir->sync = 1;
+  walk_dir(dir);
+}
+
+static void schedule_batch(tree_batch_t *batch) {
+  tree_walk_t *walk = batch->dir->walk;
+
+  if (!batch->dir->sync && walk->pool &&
+      0 == clib_pool_submit(walk->pool, &walk->group, run_batch_task, batch)) {
+    return;
+  }
+
+  run_batch(batch);
+}
+
+static tree_batch_t *new_batch(tree_dir_t *dir) {
+  tree_batch_t *batch = malloc(sizeof(tree_batch_t));
+
+  if (NULL == batch) {
+    return NULL;
+  }
+
+  memset(batch, 0, sizeof(tree_batch_t));
+  batch->dir = dir;
+
+  walk_lock(dir->walk);
+  dir->refs++;
+  walk_unlock(dir->walk);
+
+  return batch;
+}
+
+/**
+ * Read the entries of `dir`, handing out its subdirectories and batches of
+ * its files, then drop the reference of the walk to it.
+ */
+
+static void walk_dir(tree_dir_t *dir) {
+  tree_walk_t *walk = dir->walk;
+  tree_batch_t *batch = NULL;
+  struct dirent *entry = NULL;
+  DIR *handle = NULL;
+  int fd = dup(dir->fd);
+
+  if (-1 == fd || NULL == (handle = fdopendir(fd))) {
+    fail(walk, dir, ".");
+
+    if (-1 != fd) {
+      close(fd);
+    }
+
+    release_dir(dir);
+    return;
+  }
+
+  while (!failed(walk) && (entry = readdir(handle))) {
+    unsigned char type = entry_type(entry);
+    struct stat st;
+
+    if (0 == strcmp(".", entry->d_name) || 0 == strcmp("..", entry->d_name)) {
+      continue;
+    }
+
+    if (DT_UNKNOWN == type &&
+        0 == fstatat(dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+      type = S_ISDIR(st.st_mode)   ? DT_DIR
+             : S_ISLNK(st.st_mode) ? DT_LNK
+             : S_ISREG(st.st_mode) ? DT_REG
+                                   : DT_UNKNOWN;
+    }
+
+    if (DT_DIR == type) {
+      tree_dir_t *child =
+          open_dir(walk, dir, entry->d_name, entry->d_name);
+
+      if (NULL == child) {
+        break;
+      }
+
+      schedule_dir(child);
+      continue;
+    }
+
+    if (NULL == batch && NULL == (batch = new_batch(dir))) {
+      fail(walk, dir, entry->d_name);
+      break;
+    }
+
+    if (NULL == (batch->names[batch->count] = strdup(entry->d_name))) {
+      fail(walk, dir, entry->d_name);
+      break;
+    }
+
+    batch->types[batch->count++] = type;
+
+    if (CLIB_TREE_BATCH == batch->count) {
+      schedule_batch(batch);
+      batch = NULL;
+    }
+  }
+
+  if (batch) {
+    schedule_batch(batch);
+  }
+
+  closedir(handle);
+  release_dir(dir);
+}
+
+static int run_walk(tree_walk_t *walk, const char *root, const char *to) {
+  tree_dir_t *dir = NULL;
+
+  walk->open_dirs = 0;
+  walk->rc = 0;
+  clib_pool_group_init(&walk->group);
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_init(&walk->mutex, NULL);
+#endif
+
+  if ((dir = open_dir(walk, NULL, root, to))) {
+    walk_dir(dir);
+
+    if (walk->pool) {
+      clib_pool_group_wait(walk->pool, &walk->group);
+    }
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_destroy(&walk->mutex);
+#endif
+
+  return walk->rc;
+}
+
+int clib_tree_walk(clib_pool_t *pool, const char *root, clib_tree_fn fn,
+                   void *data) {
+  tree_walk_t walk;
+
+  memset(&walk, 0, sizeof(tree_walk_t));
+  walk.pool = pool;
+  walk.op = TREE_WALK;
+  walk.fn = fn;
+  walk.data = data;
+
+  return run_walk(&walk, root, NULL);
+}
+
+int clib_tree_copy(clib_pool_t *pool, const char *from, const char *to) {
+  tree_walk_t walk;
+
+  memset(&walk, 0, sizeof(tree_walk_t));
+  walk.pool = pool;
+  walk.op = TREE_COPY;
+
+  return run_walk(&walk, from, to);
+}
+
+int clib_tree_link(clib_pool_t *pool, const char *from, const char *to) {
+  tree_walk_t walk;
+
+  memset(&walk, 0, sizeof(tree_walk_t));
+  walk.pool = pool;
+  walk.op = TREE_LINK;
+
+  return run_walk(&walk, from, to);
+}
+
+int clib_tree_remove(clib_pool_t *pool, const char *path) {
+  tree_walk_t walk;
+  struct stat st;
+
+  if (0 != lstat(path, &st)) {
+    return -1;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    return unlink(path);
+  }
+
+  memset(&walk, 0, sizeof(tree_walk_t));
+  walk.pool = pool;
+  walk.op = TREE_REMOVE;
+
+  return run_walk(&walk, path, NULL);
+}
+
+#endif
@@ -0,0 +1,73 @@
+//
+// clib-tree.h
+//
+// Copyright (c) 2021 clib authors
+// MIT licensed
+//
+
+#ifndef CLIB_TREE_H
+#define CLIB_TREE_H 1
+
+#include "clib-pool.h"
+#include <sys/stat.h>
+
+/**
+ * Most directories kept open by a walk before it stops handing out
+ * subdirectories to the pool and walks them on the calling thread.
+ */
+#define CLIB_TREE_MAX_OPEN_DIRS 64
+
+/**
+ * Number of files handled by a single task of a walk.
+ */
+#define CLIB_TREE_BATCH 16
+
+/**
+ * Called for every file below the root of a walk, possibly from several
+ * threads at once.
+ *
+ * @param dir_fd The directory of the file, AT_FDCWD on Windows
+ * @param name The name of the file in `dir_fd`, its path on Windows
+ * @param path The path of the file relative to the root
+ * @param st The status of the file, symbolic links followed
+ *
+ * @return 0 to go on, anything else to stop the walk with an error
+ */
+typedef int (*clib_tree_fn)(int dir_fd, const char *name, const char *path,
+                            const struct stat *st, void *data);
+
+/**
+ * Call `fn` for every file below `root`. Symbolic links to directories are
+ * not followed. Subdirectories and batches of files are handled in parallel
+ * on `pool`, or on the calling thread if it is NULL.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_tree_walk(clib_pool_t *pool, const char *root, clib_tree_fn fn,
+                   void *data);
+
+/**
+ * Copy the tree at `from` to `to` like `copy_dir()`, keeping modes and
+ * modification times, and symbolic links as such.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_tree_copy(clib_pool_t *pool, const char *from, const char *to);
+
+/**
+ * Like `clib_tree_copy()`, with hard links to the files of `from` where the
+ * filesystem allows, which takes a snapshot of the files a tree holds
+ * without copying them.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_tree_link(clib_pool_t *pool, const char *from, const char *to);
+
+/**
+ * Remove the tree at `path`, without following symbolic links.
+ *
+ * @return 0 on success, -1 on error
+ */
+int clib_tree_remove(clib_pool_t *pool, const char *path);
+
+#endif
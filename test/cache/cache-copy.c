@@ -0,0 +1,171 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "copy/copy.h"
+#include "fs/fs.h"
+#include "rimraf/rimraf.h"
+#include <describe/describe.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FIXTURES "test/fixtures/copy-file"
+#define BENCH_FILE_SIZE (4 * 1024 * 1024)
+#define BENCH_RUNS 20
+
+/**
+ * How `copy_file()` used to copy, through a NUL terminated string.
+ */
+
+static int legacy_copy_file(char *from, char *to) {
+  char *content = fs_read(from);
+  if (!content) {
+    return -1;
+  }
+  fs_write(to, content);
+  free(content);
+
+  return 0;
+}
+
+static int write_fixture(const char *path, size_t size, int binary) {
+  FILE *file = fopen(path, "wb");
+
+  if (!file) {
+    return -1;
+  }
+
+  srand(42);
+
+  for (size_t i = 0; i < size; i++) {
+    fputc(binary ? rand() % 256 : 'a' + rand() % 26, file);
+  }
+
+  return fclose(file);
+}
+
+static int same_contents(const char *a, const char *b) {
+  FILE *fa = fopen(a, "rb");
+  FILE *fb = fopen(b, "rb");
+  int same = fa && fb;
+
+  while (same) {
+    int ca = fgetc(fa);
+    int cb = fgetc(fb);
+
+    same = ca == cb;
+
+    if (EOF == ca) {
+      break;
+    }
+  }
+
+  if (fa) {
+    fclose(fa);
+  }
+
+  if (fb) {
+    fclose(fb);
+  }
+
+  return same;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(int (*copy)(char *, char *), char *from, char *to) {
+  double start = now();
+
+  for (int i = 0; i < BENCH_RUNS; i++) {
+    copy(from, to);
+  }
+
+  return now() - start;
+}
+
+int main() {
+  rimraf(FIXTURES);
+  fs_mkdir("test", 0755);
+  fs_mkdir("test/fixtures", 0755);
+  fs_mkdir(FIXTURES, 0755);
+
+  describe("copy") {
+    struct timespec times[2] = {{1000000000, 0}, {1000000000, 0}};
+    struct stat from;
+    struct stat to;
+
+    write_fixture(FIXTURES "/binary", 64 * 1024, 1);
+    chmod(FIXTURES "/binary", 0751);
+    utimensat(AT_FDCWD, FIXTURES "/binary", times, 0);
+
+    it("should copy files with NUL bytes") {
+      assert_equal(0, copy_file(FIXTURES "/binary", FIXTURES "/binary.copy"));
+      assert_equal(1, same_contents(FIXTURES "/binary", FIXTURES "/binary.copy"));
+    }
+
+    it("should keep permissions and modification time") {
+      stat(FIXTURES "/binary", &from);
+      stat(FIXTURES "/binary.copy", &to);
+
+      assert_equal(0751, (int)(to.st_mode & 07777));
+      assert_equal((int)from.st_mtime, (int)to.st_mtime);
+    }
+
+    it("should not write through a hard link") {
+      fs_write(FIXTURES "/linked", "shared");
+      unlink(FIXTURES "/link");
+      link(FIXTURES "/linked", FIXTURES "/link");
+
+      assert_equal(0, copy_file(FIXTURES "/binary", FIXTURES "/link"));
+      assert_equal(1, same_contents(FIXTURES "/binary", FIXTURES "/link"));
+      assert_equal(6, (int)fs_size(FIXTURES "/linked"));
+    }
+
+    it("should copy directories") {
+      fs_mkdir(FIXTURES "/dir", 0755);
+      fs_mkdir(FIXTURES "/dir/sub", 0750);
+      copy_file(FIXTURES "/binary", FIXTURES "/dir/sub/binary");
+
+      assert_equal(0, copy_dir(FIXTURES "/dir", FIXTURES "/dir.copy"));
+      assert_equal(1, same_contents(FIXTURES "/binary",
+                                    FIXTURES "/dir.copy/sub/binary"));
+
+      stat(FIXTURES "/dir.copy/sub", &to);
+      assert_equal(0750, (int)(to.st_mode & 07777));
+    }
+
+    it("should fail for missing files") {
+      assert_equal(-1, copy_file(FIXTURES "/missing", FIXTURES "/missing.copy"));
+      assert_equal(-1, fs_exists(FIXTURES "/missing.copy"));
+    }
+  }
+
+  describe("copy benchmark") {
+    double legacy = 0;
+    double current = 0;
+
+    // text only, the legacy copy stops at the first NUL byte
+    write_fixture(FIXTURES "/bench", BENCH_FILE_SIZE, 0);
+
+    it("should copy as the legacy implementation did") {
+      legacy = bench(legacy_copy_file, FIXTURES "/bench", FIXTURES "/legacy");
+      current = bench(copy_file, FIXTURES "/bench", FIXTURES "/current");
+
+      assert_equal(1, same_contents(FIXTURES "/legacy", FIXTURES "/current"));
+    }
+
+    printf("    %d x %d KiB: fs_read/fs_write %.1f ms, copy_file %.1f ms\n",
+           BENCH_RUNS, BENCH_FILE_SIZE / 1024, legacy * 1000, current * 1000);
+  }
+
+  rimraf(FIXTURES);
+
+  return assert_failures();
+}
@@ -0,0 +1,208 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../../src/common/clib-cache-index.h"
+#include "fs/fs.h"
+#include "rimraf/rimraf.h"
+#include <describe/describe.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FIXTURES "test/fixtures/index"
+#define INDEX FIXTURES "/index"
+#define MANY (2 * CLIB_CACHE_INDEX_CAPACITY)
+
+// offset of the flag a writer leaves set when it crashes
+#define WRITING_OFFSET 24
+
+static int fills = 0;
+
+static void make_entry(clib_cache_index_entry_t *entry, int kind,
+                       const char *key, int64_t size) {
+  memset(entry, 0, sizeof(clib_cache_index_entry_t));
+  entry->kind = kind;
+  entry->size = size;
+  entry->inserted = 1000;
+  entry->accessed = 1000;
+  snprintf(entry->key, sizeof(entry->key), "%s", key);
+  snprintf(entry->location, sizeof(entry->location), "json/%s.json", key);
+}
+
+static int fill(clib_cache_index_t *index, void *data) {
+  clib_cache_index_entry_t entry;
+
+  fills++;
+  make_entry(&entry, CLIB_CACHE_INDEX_JSON, "on_disk_1.0.0", 7);
+
+  return clib_cache_index_put(index, &entry);
+}
+
+static void corrupt(long offset, const char *bytes) {
+  FILE *file = fopen(INDEX, "r+b");
+
+  if (file) {
+    fseek(file, offset, SEEK_SET);
+    fwrite(bytes, 1, strlen(bytes), file);
+    fclose(file);
+  }
+}
+
+static void put_many(clib_cache_index_t *index, const char *prefix, int n) {
+  clib_cache_index_entry_t entry;
+  char key[64];
+
+  for (int i = 0; i < n; i++) {
+    sprintf(key, "%s_%d", prefix, i);
+    make_entry(&entry, CLIB_CACHE_INDEX_JSON, key, i);
+    clib_cache_index_put(index, &entry);
+  }
+}
+
+static void remove_many(clib_cache_index_t *index, const char *prefix,
+                        int n) {
+  char key[64];
+
+  for (int i = 0; i < n; i++) {
+    sprintf(key, "%s_%d", prefix, i);
+    clib_cache_index_remove(index, CLIB_CACHE_INDEX_JSON, key);
+  }
+}
+
+int main() {
+  clib_cache_index_t *index = NULL;
+  clib_cache_index_t *other = NULL;
+  size_t small = 0;
+
+  rimraf(FIXTURES);
+  fs_mkdir("test", 0755);
+  fs_mkdir("test/fixtures", 0755);
+  fs_mkdir(FIXTURES, 0755);
+
+  describe("clib-cache-index") {
+    clib_cache_index_entry_t entry;
+    clib_cache_index_entry_t found;
+
+    it("should be built from the cache when missing") {
+      assert_not_null(index = clib_cache_index_open(INDEX, fill, NULL));
+      assert_equal(1, fills);
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_JSON,
+                                           "on_disk_1.0.0", &found));
+      assert_equal(7, (int)found.size);
+    }
+
+    it("should add, replace and remove entries") {
+      make_entry(&entry, CLIB_CACHE_INDEX_PACKAGE, "a_b_1.0.0", 42);
+      assert_equal(0, clib_cache_index_put(index, &entry));
+      assert_equal(-1, clib_cache_index_get(index, CLIB_CACHE_INDEX_JSON,
+                                            "a_b_1.0.0", &found));
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_PACKAGE,
+                                           "a_b_1.0.0", &found));
+      assert_equal(0, strcmp("json/a_b_1.0.0.json", found.location));
+
+      entry.size = 43;
+      assert_equal(0, clib_cache_index_put(index, &entry));
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_PACKAGE,
+                                           "a_b_1.0.0", &found));
+      assert_equal(43, (int)found.size);
+
+      assert_equal(0, clib_cache_index_touch(index, CLIB_CACHE_INDEX_PACKAGE,
+                                             "a_b_1.0.0", 2000));
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_PACKAGE,
+                                           "a_b_1.0.0", &found));
+      assert_equal(2000, (int)found.accessed);
+
+      assert_equal(0, clib_cache_index_remove(index, CLIB_CACHE_INDEX_PACKAGE,
+                                              "a_b_1.0.0"));
+      assert_equal(-1, clib_cache_index_get(index, CLIB_CACHE_INDEX_PACKAGE,
+                                            "a_b_1.0.0", NULL));
+    }
+
+    it("should grow, and be shared with the other processes") {
+      char key[64];
+      int missing = 0;
+
+      assert_not_null(other = clib_cache_index_open(INDEX, fill, NULL));
+      assert_equal(1, fills);
+
+      for (int i = 0; i < MANY; i++) {
+        sprintf(key, "author_name_%d", i);
+        make_entry(&entry, CLIB_CACHE_INDEX_JSON, key, i);
+        clib_cache_index_put(index, &entry);
+      }
+
+      // mapped the file before it was replaced with a bigger one
+      for (int i = 0; i < MANY; i++) {
+        sprintf(key, "author_name_%d", i);
+        missing += 0 != clib_cache_index_get(other, CLIB_CACHE_INDEX_JSON,
+                                             key, &found) ||
+                   i != (int)found.size;
+      }
+
+      assert_equal(0, missing);
+      clib_cache_index_free(other);
+    }
+
+    it("should keep its entries") {
+      clib_cache_index_free(index);
+      assert_not_null(index = clib_cache_index_open(INDEX, fill, NULL));
+      assert_equal(1, fills);
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_JSON,
+                                           "author_name_7", NULL));
+    }
+
+    it("should be rebuilt after a crash") {
+      clib_cache_index_free(index);
+      corrupt(WRITING_OFFSET, "\x01");
+
+      assert_not_null(index = clib_cache_index_open(INDEX, fill, NULL));
+      assert_equal(2, fills);
+      assert_equal(-1, clib_cache_index_get(index, CLIB_CACHE_INDEX_JSON,
+                                            "author_name_7", NULL));
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_JSON,
+                                           "on_disk_1.0.0", NULL));
+    }
+
+    it("should be rebuilt when corrupted") {
+      clib_cache_index_free(index);
+      corrupt(0, "garbage");
+
+      assert_not_null(index = clib_cache_index_open(INDEX, fill, NULL));
+      assert_equal(3, fills);
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_JSON,
+                                           "on_disk_1.0.0", NULL));
+    }
+
+    it("should not grow from removed entries") {
+      small = fs_size(INDEX);
+
+      // a quarter of its slots at a time, many times over
+      for (int i = 0; i < 16; i++) {
+        char prefix[16];
+        sprintf(prefix, "removed_%d", i);
+        put_many(index, prefix, CLIB_CACHE_INDEX_CAPACITY / 4);
+        remove_many(index, prefix, CLIB_CACHE_INDEX_CAPACITY / 4);
+      }
+
+      assert_equal((int)small, (int)fs_size(INDEX));
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_JSON,
+                                           "on_disk_1.0.0", NULL));
+    }
+
+    it("should shrink when rebuilt") {
+      put_many(index, "evicted", MANY);
+      assert_equal(1, fs_size(INDEX) > small);
+
+      remove_many(index, "evicted", MANY);
+      assert_equal(0, clib_cache_index_rebuild(index));
+      assert_equal(4, fills);
+      assert_equal((int)small, (int)fs_size(INDEX));
+      assert_equal(0, clib_cache_index_get(index, CLIB_CACHE_INDEX_JSON,
+                                           "on_disk_1.0.0", NULL));
+    }
+  }
+
+  clib_cache_index_free(index);
+  rimraf(FIXTURES);
+
+  return assert_failures();
+}
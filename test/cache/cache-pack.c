@@ -0,0 +1,188 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../../src/common/clib-pack.h"
+#include "fs/fs.h"
+#include "rimraf/rimraf.h"
+#include <describe/describe.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FIXTURES "test/fixtures/pack"
+#define DIRS 4
+#define FILES 20
+#define NOISE_SIZE 4096
+
+static char text[BUFSIZ];
+
+static void write_fixtures(void) {
+  unsigned seed = 1;
+  char noise[NOISE_SIZE];
+  char path[BUFSIZ];
+  FILE *file = NULL;
+
+  // compresses well
+  for (size_t i = 0; i + 1 < sizeof(text); i++) {
+    text[i] = "clib packs "[i % 11];
+  }
+
+  fs_mkdir(FIXTURES "/from", 0755);
+
+  for (int d = 0; d < DIRS; d++) {
+    snprintf(path, sizeof(path), FIXTURES "/from/dir-%d", d);
+    fs_mkdir(path, 0755);
+    snprintf(path, sizeof(path), FIXTURES "/from/dir-%d/sub", d);
+    fs_mkdir(path, 0755);
+
+    for (int f = 0; f < FILES; f++) {
+      snprintf(path, sizeof(path), FIXTURES "/from/dir-%d/%sfile-%d", d,
+               f % 2 ? "sub/" : "", f);
+      fs_write(path, f % 3 ? path : text);
+    }
+  }
+
+  // does not
+  for (int i = 0; i < NOISE_SIZE; i++) {
+    seed = seed * 1103515245 + 12345;
+    noise[i] = (char)(seed >> 16);
+  }
+
+  file = fopen(FIXTURES "/from/noise", "wb");
+  fwrite(noise, 1, NOISE_SIZE, file);
+  fclose(file);
+
+  fs_write(FIXTURES "/from/empty", "");
+  fs_write(FIXTURES "/from/run.sh", "#!/bin/sh\n");
+  chmod(FIXTURES "/from/run.sh", 0755);
+}
+
+static int same_files(const char *a, const char *b) {
+  char *left = fs_read(a);
+  char *right = fs_read(b);
+  int same = left && right && 0 == strcmp(left, right);
+
+  free(left);
+  free(right);
+  return same;
+}
+
+int main() {
+  clib_pool_t *pool = clib_pool_new(4);
+
+  rimraf(FIXTURES);
+  fs_mkdir("test", 0755);
+  fs_mkdir("test/fixtures", 0755);
+  fs_mkdir(FIXTURES, 0755);
+  write_fixtures();
+
+  describe("clib-pack") {
+    clib_pack_t *pack = NULL;
+    struct stat st;
+
+    it("should pack every file") {
+      assert_equal(0, clib_pack_write(pool, FIXTURES "/from",
+                                      FIXTURES "/from.pack"));
+      assert_not_null(pack = clib_pack_open(FIXTURES "/from.pack"));
+      assert_equal(DIRS * FILES + 3, (int)pack->count);
+
+      for (size_t i = 1; i < pack->count; i++) {
+        assert_equal(1, strcmp(pack->entries[i - 1].path,
+                               pack->entries[i].path) < 0);
+      }
+    }
+
+    it("should read files at random") {
+      const clib_pack_entry_t *entry = NULL;
+      char *content = NULL;
+
+      assert_not_null(entry = clib_pack_find(pack, "dir-2/sub/file-13"));
+      assert_str_equal(FIXTURES "/from/dir-2/sub/file-13",
+                       content = clib_pack_read(pack, entry));
+      free(content);
+
+      assert_not_null(entry = clib_pack_find(pack, "dir-3/file-0"));
+      assert_equal(clib_pack_has_zlib(), entry->deflated);
+      assert_str_equal(text, content = clib_pack_read(pack, entry));
+      free(content);
+
+      assert_not_null(entry = clib_pack_find(pack, "noise"));
+      assert_equal(0, entry->deflated);
+      assert_equal(NOISE_SIZE, (int)entry->size);
+
+      assert_not_null(entry = clib_pack_find(pack, "empty"));
+      assert_str_equal("", content = clib_pack_read(pack, entry));
+      free(content);
+
+      assert_equal(1, clib_pack_find(pack, "run.sh")->executable);
+      assert_null(clib_pack_find(pack, "dir-2/missing"));
+
+      clib_pack_close(pack);
+    }
+
+    it("should make the same pack of the same files") {
+      assert_equal(0, clib_pack_write(NULL, FIXTURES "/from",
+                                      FIXTURES "/again.pack"));
+      assert_equal(1, same_files(FIXTURES "/from.pack",
+                                 FIXTURES "/again.pack"));
+    }
+
+    it("should extract packs") {
+      assert_equal(0, clib_pack_extract(FIXTURES "/from.pack",
+                                        FIXTURES "/to"));
+      assert_equal(1, same_files(FIXTURES "/from/dir-3/sub/file-19",
+                                 FIXTURES "/to/dir-3/sub/file-19"));
+      assert_equal(1, same_files(FIXTURES "/from/dir-0/file-0",
+                                 FIXTURES "/to/dir-0/file-0"));
+      assert_equal(0, fs_exists(FIXTURES "/to/empty"));
+
+      stat(FIXTURES "/to/noise", &st);
+      assert_equal(NOISE_SIZE, (int)st.st_size);
+      stat(FIXTURES "/to/run.sh", &st);
+      assert_equal(0755, (int)(st.st_mode & 0777));
+    }
+
+    it("should replace files without writing through them") {
+      fs_write(FIXTURES "/shared", "shared");
+      unlink(FIXTURES "/to/empty");
+      link(FIXTURES "/shared", FIXTURES "/to/empty");
+
+      assert_equal(0, clib_pack_extract(FIXTURES "/from.pack",
+                                        FIXTURES "/to"));
+      assert_equal(1, same_files(FIXTURES "/from/empty", FIXTURES "/to/empty"));
+      assert_str_equal("shared", fs_read(FIXTURES "/shared"));
+    }
+
+    it("should shrink what compresses") {
+      if (clib_pack_has_zlib()) {
+        stat(FIXTURES "/from.pack", &st);
+        assert_equal(1, st.st_size < DIRS * FILES / 3 * (int)strlen(text));
+      }
+    }
+
+    it("should reject what is not a pack") {
+      FILE *file = fopen(FIXTURES "/truncated.pack", "wb");
+      char *data = fs_read(FIXTURES "/from.pack");
+
+      stat(FIXTURES "/from.pack", &st);
+      fwrite(data, 1, st.st_size - 1, file);
+      fclose(file);
+      free(data);
+
+      fs_write(FIXTURES "/text.pack", text);
+
+      assert_null(clib_pack_open(FIXTURES "/truncated.pack"));
+      assert_null(clib_pack_open(FIXTURES "/text.pack"));
+      assert_null(clib_pack_open(FIXTURES "/missing.pack"));
+      assert_equal(-1, clib_pack_extract(FIXTURES "/text.pack",
+                                         FIXTURES "/nowhere"));
+      assert_equal(-1, fs_exists(FIXTURES "/nowhere"));
+    }
+  }
+
+  clib_pool_free(pool);
+  rimraf(FIXTURES);
+
+  return assert_failures();
+}
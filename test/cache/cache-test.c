@@ -1,10 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "../../src/common/clib-cache.h"
+#include "../../src/common/clib-sha256.h"
+#include "copy/copy.h"
 #include "fs/fs.h"
 #include "rimraf/rimraf.h"
 #include <describe/describe.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #define assert_exists(f) assert_equal(0, fs_exists(f));
@@ -20,15 +26,99 @@ static void assert_cached_file(char *pkg_dir, char *file) {
   assert_exists(path);
 }
 
+#ifdef HAVE_PTHREADS
+#define JSON_WRITES 200
+
+static char *json_contents[] = {"{\"name\": \"a\"}", "{\"name\": \"bb\"}"};
+
+static void *write_json(void *data) {
+  for (int i = 0; i < JSON_WRITES; i++) {
+    clib_cache_save_json("a", "racy", "v", json_contents[i % 2]);
+  }
+  return NULL;
+}
+
+static void *read_json(void *data) {
+  int *torn = data;
+
+  for (int i = 0; i < JSON_WRITES; i++) {
+    char *json = clib_cache_read_json("a", "racy", "v");
+
+    if (json && 0 != strcmp(json_contents[0], json) &&
+        0 != strcmp(json_contents[1], json)) {
+      (*torn)++;
+    }
+
+    free(json);
+  }
+  return NULL;
+}
+#endif
+
 static void assert_cached_files(char *pkg_dir) {
   assert_cached_file(pkg_dir, "copy.c");
   assert_cached_file(pkg_dir, "copy.h");
   assert_cached_file(pkg_dir, "package.json");
 }
 
+#define COMMIT "0123456789abcdef0123456789abcdef01234567"
+#define UNIQUE_CONTENT "int unique = 1;\n"
+
+#define SHARED_SAVES 10
+#define SHARED_WRITERS 4
+
+/**
+ * Save the package over and over from another process.
+ */
+
+static pid_t spawn_writer(char *name) {
+  pid_t pid = fork();
+
+  if (0 == pid) {
+    int failures = 0;
+
+    for (int i = 0; i < SHARED_SAVES; i++) {
+      failures += 0 != clib_cache_save_package("author", name, "1.2.0",
+                                               "test/fixtures/copy");
+    }
+
+    _exit(failures);
+  }
+
+  return pid;
+}
+
+static int count_files(const char *dir, const char *pattern) {
+  char command[BUFSIZ];
+  FILE *find = NULL;
+  int count = 0;
+
+  sprintf(command, "find %s -type f -name '%s' | wc -l", dir, pattern);
+
+  if ((find = popen(command, "r"))) {
+    fscanf(find, "%d", &count);
+    pclose(find);
+  }
+
+  return count;
+}
+
 int main() {
+  // a cache of its own, whatever installs or other runs left behind
+  char home[] = "/tmp/clib-cache-test-XXXXXX";
+
+  if (NULL == mkdtemp(home) || 0 != setenv("HOME", home, 1)) {
+    return 1;
+  }
+
+  unsetenv("CLIB_CACHE_MAX_SIZE");
+  unsetenv("CLIB_CACHE_MAX_ENTRIES");
+  unsetenv("CLIB_CACHE_MAX_STALE");
+  unsetenv("CLIB_CACHE_PACKED");
 
   rimraf(clib_cache_dir());
+  fs_mkdir("test", 0755);
+  fs_mkdir("test/fixtures", 0755);
 
   describe("clib-cache opearions") {
 
@@ -46,8 +136,10 @@ int main() {
     sprintf(pkg_dir, "%s/author_pkg_1.2.0", clib_cache_dir());
 
     it("should manage the package cache") {
-      assert_equal(
-          0, clib_cache_save_package(author, name, version, "../../deps/copy"));
+      // saving links the files into the store, keep the sources out of it
+      assert_equal(0, copy_dir("../../deps/copy", "test/fixtures/copy"));
+      assert_equal(0, clib_cache_save_package(author, name, version,
+                                              "test/fixtures/copy"));
       assert_equal(1, clib_cache_has_package(author, name, version));
       assert_equal(0, clib_cache_is_expired_package(author, name, version));
 
@@ -55,6 +147,163 @@ int main() {
       assert_cached_files(pkg_dir);
     }
 
+    it("should wait for the process that claimed a package") {
+      int claim = clib_cache_claim_package(author, "claimed", version);
+      int status = -1;
+      pid_t pid = fork();
+
+      if (0 == pid) {
+        // a forked, not executed, process shares the lock of the parent
+        close(claim);
+        claim = clib_cache_claim_package(author, "claimed", version);
+        status = clib_cache_has_package(author, "claimed", version);
+        clib_cache_release_package(author, "claimed", version, claim);
+        _exit(status ? 0 : 1);
+      }
+
+      // the claim is held while the package is "downloaded"
+      sleep(1);
+      assert_equal(0, clib_cache_save_package(author, "claimed", version,
+                                              "test/fixtures/copy"));
+      clib_cache_release_package(author, "claimed", version, claim);
+
+      waitpid(pid, &status, 0);
+      assert_equal(1, WIFEXITED(status));
+      assert_equal(0, WEXITSTATUS(status));
+    }
+
+    it("should publish packages saved by several processes at once") {
+      pid_t writers[SHARED_WRITERS];
+      char shared_dir[BUFSIZ];
+      int failures = 0;
+      int status = 0;
+
+      // loaded while saved, not to be expired meanwhile
+      assert_equal(0, clib_cache_init(60 * 60));
+
+      sprintf(shared_dir, "%s/author_shared_1.2.0", clib_cache_dir());
+      assert_equal(0, clib_cache_save_package(author, "shared", version,
+                                              "test/fixtures/copy"));
+
+      for (int i = 0; i < SHARED_WRITERS; i++) {
+        writers[i] = spawn_writer("shared");
+      }
+
+      // every load sees a whole package, the one before or after a save
+      for (int i = 0; i < SHARED_SAVES * SHARED_WRITERS; i++) {
+        rimraf("test/fixtures/shared");
+        failures += 0 != clib_cache_load_package(author, "shared", version,
+                                                 "test/fixtures/shared");
+        failures += 0 != fs_exists("test/fixtures/shared/copy.c");
+      }
+
+      for (int i = 0; i < SHARED_WRITERS; i++) {
+        waitpid(writers[i], &status, 0);
+        failures += !WIFEXITED(status) || 0 != WEXITSTATUS(status);
+      }
+
+      assert_equal(0, failures);
+      assert_cached_files(shared_dir);
+      assert_equal(0, count_files(clib_cache_dir(), "*.tmp"));
+      assert_equal(0, clib_cache_init(expiraton));
+    }
+
+    it("should save packages in the background") {
+      char async_dir[BUFSIZ];
+
+      sprintf(async_dir, "%s/author_async_1.2.0", clib_cache_dir());
+      assert_equal(0, clib_cache_save_package_async(author, "async", version,
+                                                    "test/fixtures/copy", -1));
+
+      // a snapshot was taken, the package may change meanwhile
+      rename("test/fixtures/copy/copy.c", "test/fixtures/copy.c");
+      clib_cache_flush();
+      rename("test/fixtures/copy.c", "test/fixtures/copy/copy.c");
+
+      assert_equal(1, clib_cache_has_package(author, "async", version));
+      assert_cached_files(async_dir);
+      assert_equal(0, count_files(clib_cache_dir(), "*.tmp"));
+    }
+
+    it("should name objects after what they hold") {
+      char hash[CLIB_SHA256_HEX_SIZE];
+      char object[BUFSIZ];
+      char *content = NULL;
+      clib_sha256_t ctx;
+
+      fs_mkdir("test/fixtures/changing", 0755);
+      fs_write("test/fixtures/changing/changing.c", "before");
+      assert_equal(0, clib_cache_save_package_async(
+                          author, "changing", version,
+                          "test/fixtures/changing", -1));
+
+      // written through the snapshot, maybe while it is stored
+      fs_write("test/fixtures/changing/changing.c", "after");
+      clib_cache_flush();
+
+      rimraf("test/fixtures/changed");
+      assert_equal(0, clib_cache_load_package(author, "changing", version,
+                                              "test/fixtures/changed"));
+      assert_not_null(content = fs_read("test/fixtures/changed/changing.c"));
+
+      clib_sha256_init(&ctx);
+      clib_sha256_update(&ctx, content, strlen(content));
+      clib_sha256_final_hex(&ctx, hash);
+      sprintf(object, "%s/../store/%.2s/%s", clib_cache_dir(), hash, hash + 2);
+      assert_exists(object);
+
+      free(content);
+      assert_equal(0, clib_cache_delete_package(author, "changing", version));
+    }
+
+    it("should store copies of the files of a package") {
+      struct stat st;
+
+      fs_mkdir("test/fixtures/own", 0755);
+      fs_write("test/fixtures/own/own.c", "own");
+      link("test/fixtures/own/own.c", "test/fixtures/own.c");
+
+      assert_equal(0, clib_cache_save_package(author, "own", version,
+                                              "test/fixtures/own"));
+
+      // still the project's own, writable and linked from nowhere else
+      assert_equal(0, stat("test/fixtures/own.c", &st));
+      assert_equal(1, (int)st.st_nlink);
+      assert_equal(0644, (int)(st.st_mode & 0777));
+
+      assert_equal(0, clib_cache_delete_package(author, "own", version));
+    }
+
+    it("should save and load packed packages") {
+      char packed_dir[BUFSIZ];
+      char pack[BUFSIZ];
+
+      sprintf(packed_dir, "%s/author_packed_1.2.0", clib_cache_dir());
+      sprintf(pack, "%s/../packs/author_packed_1.2.0.pack", clib_cache_dir());
+
+      clib_cache_set_packed(1);
+      assert_equal(0, clib_cache_save_package(author, "packed", version,
+                                              "test/fixtures/copy"));
+      assert_equal(1, clib_cache_has_package(author, "packed", version));
+      assert_exists(pack);
+      assert_cached_dir(packed_dir, -1);
+
+      rimraf("test/fixtures/packed");
+      assert_equal(0, clib_cache_load_package(author, "packed", version,
+                                              "test/fixtures/packed"));
+      assert_cached_files("test/fixtures/packed");
+
+      // saved unpacked, the pack is replaced by a tree
+      clib_cache_set_packed(0);
+      assert_equal(0, clib_cache_save_package(author, "packed", version,
+                                              "test/fixtures/copy"));
+      assert_equal(-1, fs_exists(pack));
+      assert_cached_files(packed_dir);
+
+      assert_equal(0, clib_cache_delete_package(author, "packed", version));
+      assert_equal(0, clib_cache_has_package(author, "packed", version));
+    }
+
     it("should manage the json cache") {
       char *cached_json;
 
@@ -72,6 +321,112 @@ int main() {
       assert_null(clib_cache_read_json("a", "n", "v"));
     }
 
+#ifdef HAVE_PTHREADS
+    it("should never expose a partially written json cache") {
+      pthread_t threads[4];
+      int torn = 0;
+
+      clib_cache_save_json("a", "racy", "v", json_contents[0]);
+
+      pthread_create(&threads[0], NULL, write_json, NULL);
+      pthread_create(&threads[1], NULL, write_json, NULL);
+      pthread_create(&threads[2], NULL, read_json, &torn);
+      pthread_create(&threads[3], NULL, read_json, &torn);
+
+      for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+      }
+
+      assert_equal(0, torn);
+      assert_equal(0, clib_cache_delete_json("a", "racy", "v"));
+    }
+#endif
+
+    it("should manage the missing manifest cache") {
+      unsigned long hits = clib_cache_stats().missing_hits;
+
+      clib_cache_delete_missing("a", "n", "v", "clib.json");
+      assert_equal(0, clib_cache_has_missing("a", "n", "v", "clib.json"));
+
+      assert_equal(0, clib_cache_save_missing("a", "n", "v", "clib.json"));
+      assert_equal(1, clib_cache_has_missing("a", "n", "v", "clib.json"));
+      assert_equal(0, clib_cache_has_missing("a", "n", "v", "package.json"));
+      assert_equal(1, (int)(clib_cache_stats().missing_hits - hits));
+
+      assert_equal(0, clib_cache_delete_missing("a", "n", "v", "clib.json"));
+      assert_equal(0, clib_cache_has_missing("a", "n", "v", "clib.json"));
+    }
+
+    it("should expire the missing manifest cache") {
+      clib_cache_set_missing_expiration(expiraton);
+
+      assert_equal(0, clib_cache_save_missing("a", "n", "v", "clib.json"));
+      assert_equal(1, clib_cache_has_missing("a", "n", "v", "clib.json"));
+
+      sleep(expiraton + 1);
+
+      assert_equal(0, clib_cache_has_missing("a", "n", "v", "clib.json"));
+    }
+
+    it("should keep what a commit points to") {
+      char commit[64];
+      char ref[BUFSIZ];
+
+      sprintf(ref, "%s/../refs/a_n_1.0.0", clib_cache_dir());
+      unlink(ref);
+
+      assert_equal(-1, clib_cache_read_ref("a", "n", "1.0.0", commit));
+      assert_equal(-1, clib_cache_save_ref("a", "n", "1.0.0", "1.0.0"));
+      assert_equal(0, clib_cache_save_ref("a", "n", "1.0.0", COMMIT));
+      assert_equal(0, clib_cache_read_ref("a", "n", "1.0.0", commit));
+      assert_equal(0, strcmp(COMMIT, commit));
+
+      assert_equal(2, clib_cache_save_json("a", "n", "1.0.0", "{}"));
+      assert_equal(2, clib_cache_save_json("a", "n", COMMIT, "{}"));
+      sleep(expiraton + 1);
+      assert_equal(0, clib_cache_has_json("a", "n", "1.0.0"));
+      assert_equal(1, clib_cache_has_json("a", "n", COMMIT));
+
+      clib_cache_delete_json("a", "n", "1.0.0");
+      clib_cache_delete_json("a", "n", COMMIT);
+      unlink(ref);
+    }
+
+    it("should revalidate the expired json cache") {
+      clib_cache_validators_t validators;
+      char path[BUFSIZ];
+      char *stale;
+
+      sprintf(path, "%s/../json/a_r_1.0.0.json.validators", clib_cache_dir());
+      clib_cache_validators_init(&validators, "package.json", "\"v1\"",
+                                 "Tue, 01 Jun 2021 00:00:00 GMT");
+
+      assert_equal(2, clib_cache_save_json_with_validators("a", "r", "1.0.0",
+                                                           "{}", &validators));
+      assert_equal(0, fs_exists(path));
+      sleep(expiraton + 1);
+      assert_equal(0, clib_cache_has_json("a", "r", "1.0.0"));
+
+      memset(&validators, 0, sizeof(validators));
+      stale = clib_cache_read_stale_json("a", "r", "1.0.0", &validators);
+      assert_str_equal("{}", stale);
+      assert_str_equal("package.json", validators.file);
+      assert_str_equal("\"v1\"", validators.etag);
+      assert_str_equal("Tue, 01 Jun 2021 00:00:00 GMT",
+                       validators.last_modified);
+      free(stale);
+
+      assert_equal(0, clib_cache_renew_json("a", "r", "1.0.0"));
+      assert_equal(1, clib_cache_has_json("a", "r", "1.0.0"));
+
+      // without validators, it can only be fetched again
+      assert_equal(2, clib_cache_save_json("a", "r", "1.0.0", "{}"));
+      assert_equal(-1, fs_exists(path));
+      assert_null(clib_cache_read_stale_json("a", "r", "1.0.0", &validators));
+
+      clib_cache_delete_json("a", "r", "1.0.0");
+    }
+
     it("should manage the search cache") {
       char *cached_search;
 
@@ -102,8 +457,128 @@ int main() {
       assert_equal(0, clib_cache_has_search());
     }
 
+    it("should serve stale entries until refreshed") {
+      char *stale;
+
+      assert_equal(2, clib_cache_save_json("a", "s", "1.0.0", "{}"));
+      assert_equal(13, clib_cache_save_search("<html></html>"));
+      sleep(expiraton + 1);
+      assert_equal(0, clib_cache_has_json("a", "s", "1.0.0"));
+      assert_equal(0, clib_cache_has_search());
+      assert_equal(0, clib_cache_is_stale_json("a", "s", "1.0.0"));
+      assert_equal(0, clib_cache_is_stale_search());
+
+      clib_cache_set_max_stale(60 * 60);
+      assert_equal(1, clib_cache_has_json("a", "s", "1.0.0"));
+      assert_equal(1, clib_cache_is_stale_json("a", "s", "1.0.0"));
+      assert_str_equal("{}", stale = clib_cache_read_json("a", "s", "1.0.0"));
+      free(stale);
+      assert_equal(1, clib_cache_has_search());
+      assert_equal(1, clib_cache_is_stale_search());
+      assert_str_equal("<html></html>", stale = clib_cache_read_search());
+      free(stale);
+
+      // refreshed
+      assert_equal(0, clib_cache_renew_json("a", "s", "1.0.0"));
+      assert_equal(0, clib_cache_renew_search());
+      assert_equal(0, clib_cache_is_stale_json("a", "s", "1.0.0"));
+      assert_equal(0, clib_cache_is_stale_search());
+
+      clib_cache_set_max_stale(0);
+      clib_cache_delete_json("a", "s", "1.0.0");
+      clib_cache_delete_search();
+    }
+
+    it("should evict the least recently used packages") {
+      clib_cache_limits_t limits = {0, 1, 0};
+      clib_cache_gc_stats_t stats;
+      char lock[BUFSIZ];
+
+      assert_equal(0, clib_cache_init(60 * 60));
+      clib_cache_set_limits(limits);
+
+      // the other packages were used a second ago at least
+      sleep(1);
+      rimraf("test/fixtures/recent");
+      assert_equal(0, clib_cache_load_package(author, name, version,
+                                              "test/fixtures/recent"));
+
+      assert_equal(0, clib_cache_evict(&stats));
+      assert_equal(3, (int)stats.evicted);
+      assert_equal(1, (int)stats.entries);
+      assert_equal(1, (int)(stats.reclaimed > 0));
+      assert_equal(1, clib_cache_has_package(author, name, version));
+      assert_equal(0, clib_cache_has_package(author, "shared", version));
+      assert_equal(0, clib_cache_has_package(author, "async", version));
+      assert_cached_dir(pkg_dir, 0);
+
+      // with their lock files, the packages still cached keep theirs
+      sprintf(lock, "%s/../locks/author_shared_1.2.0.lock", clib_cache_dir());
+      assert_equal(-1, fs_exists(lock));
+      sprintf(lock, "%s/../locks/author_pkg_1.2.0.lock", clib_cache_dir());
+      assert_exists(lock);
+    }
+
+    it("should evict a few entries at a time") {
+      clib_cache_gc_stats_t stats;
+      char many[16];
+
+      for (int i = 0; i < CLIB_CACHE_EVICT_BATCH + 4; i++) {
+        sprintf(many, "%d", i);
+        assert_equal(2, clib_cache_save_json("a", "many", many, "{}"));
+      }
+
+      assert_equal(0, clib_cache_evict(&stats));
+      assert_equal(CLIB_CACHE_EVICT_BATCH, (int)stats.evicted);
+      assert_equal(5, (int)stats.entries);
+      assert_equal(2 * CLIB_CACHE_EVICT_BATCH, (int)stats.reclaimed);
+      assert_equal(1, clib_cache_has_package(author, name, version));
+    }
+
+    it("should reclaim the space of packages no longer used") {
+      clib_cache_limits_t limits = {1, 0, 0};
+      clib_cache_gc_stats_t stats;
+      char hash[CLIB_SHA256_HEX_SIZE];
+      char object[BUFSIZ];
+      char leftover[BUFSIZ];
+      clib_sha256_t ctx;
+
+      // objects are named after their content
+      clib_sha256_init(&ctx);
+      clib_sha256_update(&ctx, UNIQUE_CONTENT, strlen(UNIQUE_CONTENT));
+      clib_sha256_final_hex(&ctx, hash);
+      sprintf(object, "%s/../store/%.2s/%s", clib_cache_dir(), hash, hash + 2);
+      sprintf(leftover, "%s/../json/a_crashed_v.json.1.1.tmp",
+              clib_cache_dir());
+
+      fs_mkdir("test/fixtures/unique", 0755);
+      fs_write("test/fixtures/unique/unique.c", UNIQUE_CONTENT);
+      assert_equal(0, clib_cache_save_package(author, "unique", version,
+                                              "test/fixtures/unique"));
+
+      // linked from the cache only
+      rimraf("test/fixtures/unique");
+      assert_exists(object);
+      fs_write(leftover, "{");
+
+      clib_cache_set_limits(limits);
+      assert_equal(0, clib_cache_gc(&stats));
+      assert_equal(0, (int)stats.entries);
+      assert_equal(1, (int)(stats.reclaimed >= (int)strlen(UNIQUE_CONTENT)));
+      assert_equal(0, clib_cache_has_package(author, "unique", version));
+      assert_equal(0, clib_cache_has_package(author, name, version));
+      assert_equal(-1, fs_exists(object));
+      assert_equal(0, count_files(clib_cache_dir(), "*.tmp"));
+      assert_equal(-1, fs_exists(leftover));
+      sprintf(leftover, "%s/../locks", clib_cache_dir());
+      assert_equal(0, count_files(leftover, "*"));
+    }
+
     clib_cache_delete_search();
   }
 
+  rimraf("test/fixtures");
+  rimraf(home);
+
   return assert_failures();
 }
@@ -0,0 +1,139 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../../src/common/clib-tree.h"
+#include "fs/fs.h"
+#include "rimraf/rimraf.h"
+#include <describe/describe.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FIXTURES "test/fixtures/tree"
+#define DIRS 8
+#define FILES 40
+
+static int counted = 0;
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int count_file(int dir_fd, const char *name, const char *path,
+                      const struct stat *st, void *data) {
+  char expected[BUFSIZ];
+
+  snprintf(expected, sizeof(expected), "%s/%s", FIXTURES "/from", path);
+
+  // relative to the root, and reachable from the directory given
+  if (0 != faccessat(dir_fd, name, R_OK, 0) || 0 != fs_exists(expected)) {
+    return -1;
+  }
+
+#ifdef HAVE_PTHREADS
+  pthread_mutex_lock(&mutex);
+#endif
+  counted++;
+#ifdef HAVE_PTHREADS
+  pthread_mutex_unlock(&mutex);
+#endif
+
+  return 0;
+}
+
+static void write_fixtures(void) {
+  char path[BUFSIZ];
+
+  fs_mkdir(FIXTURES "/from", 0755);
+  fs_mkdir(FIXTURES "/outside", 0755);
+  fs_write(FIXTURES "/outside/keep", "keep");
+
+  for (int d = 0; d < DIRS; d++) {
+    snprintf(path, sizeof(path), FIXTURES "/from/dir-%d", d);
+    fs_mkdir(path, 0750);
+    snprintf(path, sizeof(path), FIXTURES "/from/dir-%d/sub", d);
+    fs_mkdir(path, 0755);
+
+    for (int f = 0; f < FILES; f++) {
+      snprintf(path, sizeof(path), FIXTURES "/from/dir-%d/%sfile-%d", d,
+               f % 2 ? "sub/" : "", f);
+      fs_write(path, path);
+    }
+  }
+
+  chmod(FIXTURES "/from/dir-0/file-0", 0755);
+  symlink("../outside", FIXTURES "/from/outside");
+}
+
+int main() {
+  clib_pool_t *pool = clib_pool_new(4);
+
+  rimraf(FIXTURES);
+  fs_mkdir("test", 0755);
+  fs_mkdir("test/fixtures", 0755);
+  fs_mkdir(FIXTURES, 0755);
+  write_fixtures();
+
+  describe("clib-tree") {
+    struct stat st;
+
+    it("should walk every file once") {
+      counted = 0;
+      assert_equal(0, clib_tree_walk(pool, FIXTURES "/from", count_file, NULL));
+      assert_equal(DIRS * FILES, counted);
+
+      counted = 0;
+      assert_equal(0, clib_tree_walk(NULL, FIXTURES "/from", count_file, NULL));
+      assert_equal(DIRS * FILES, counted);
+    }
+
+    it("should copy trees") {
+      assert_equal(0, clib_tree_copy(pool, FIXTURES "/from", FIXTURES "/to"));
+      assert_equal(0, fs_exists(FIXTURES "/to/dir-7/sub/file-39"));
+
+      stat(FIXTURES "/to/dir-3", &st);
+      assert_equal(0750, (int)(st.st_mode & 07777));
+      stat(FIXTURES "/to/dir-0/file-0", &st);
+      assert_equal(0755, (int)(st.st_mode & 07777));
+
+      lstat(FIXTURES "/to/outside", &st);
+      assert_equal(1, S_ISLNK(st.st_mode));
+    }
+
+    it("should link trees") {
+      struct stat linked;
+
+      assert_equal(0, clib_tree_link(pool, FIXTURES "/from", FIXTURES "/link"));
+
+      stat(FIXTURES "/from/dir-5/sub/file-21", &st);
+      stat(FIXTURES "/link/dir-5/sub/file-21", &linked);
+      assert_equal(1, st.st_ino == linked.st_ino);
+
+      stat(FIXTURES "/link/dir-3", &st);
+      assert_equal(0750, (int)(st.st_mode & 07777));
+
+      assert_equal(0, clib_tree_remove(pool, FIXTURES "/link"));
+      assert_equal(0, fs_exists(FIXTURES "/from/dir-5/sub/file-21"));
+    }
+
+    it("should remove trees without following links") {
+      assert_equal(0, clib_tree_remove(pool, FIXTURES "/to"));
+      assert_equal(-1, fs_exists(FIXTURES "/to"));
+      assert_equal(0, clib_tree_remove(NULL, FIXTURES "/from"));
+      assert_equal(-1, fs_exists(FIXTURES "/from"));
+      assert_equal(0, fs_exists(FIXTURES "/outside/keep"));
+    }
+
+    it("should fail for missing trees") {
+      assert_equal(-1, clib_tree_copy(pool, FIXTURES "/missing",
+                                      FIXTURES "/copy"));
+      assert_equal(-1, clib_tree_remove(pool, FIXTURES "/missing"));
+    }
+  }
+
+  clib_pool_free(pool);
+  rimraf(FIXTURES);
+
+  return assert_failures();
+}
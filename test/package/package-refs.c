@@ -0,0 +1,80 @@
+#include "clib-refs.h"
+#include "describe/describe.h"
+#include <stdio.h>
+#include <string.h>
+
+#define MAIN "1111111111111111111111111111111111111111"
+#define ANNOTATED "2222222222222222222222222222222222222222"
+#define PEELED "3333333333333333333333333333333333333333"
+#define LIGHT "4444444444444444444444444444444444444444"
+#define BRANCH "5555555555555555555555555555555555555555"
+
+static char refs[1024];
+static size_t size = 0;
+
+static void pkt_line(const char *line) {
+  size += sprintf(refs + size, "%04x%s\n", (unsigned)strlen(line) + 5, line);
+}
+
+// the capabilities follow a NUL on the first ref
+static void pkt_line_with_capabilities(const char *line, const char *caps) {
+  size += sprintf(refs + size, "%04x%s", (unsigned)(strlen(line) +
+                                                   strlen(caps) + 6), line);
+  size++;
+  size += sprintf(refs + size, "%s\n", caps);
+}
+
+static void pkt_flush(void) { size += sprintf(refs + size, "0000"); }
+
+int main() {
+  char commit[CLIB_REFS_COMMIT_SIZE];
+
+  pkt_line("# service=git-upload-pack");
+  pkt_flush();
+  pkt_line_with_capabilities(MAIN " HEAD", "multi_ack side-band-64k");
+  pkt_line(MAIN " refs/heads/master");
+  pkt_line(BRANCH " refs/heads/1.0.0");
+  pkt_line(ANNOTATED " refs/tags/1.0.0");
+  pkt_line(PEELED " refs/tags/1.0.0^{}");
+  pkt_line(LIGHT " refs/tags/1.0");
+  pkt_flush();
+
+  describe("clib_refs_is_commit") {
+    it("should accept a full commit") {
+      assert_equal(1, clib_refs_is_commit(MAIN));
+    }
+
+    it("should reject versions, branches and short commits") {
+      assert_equal(0, clib_refs_is_commit("1.0.0"));
+      assert_equal(0, clib_refs_is_commit("master"));
+      assert_equal(0, clib_refs_is_commit("1111111"));
+      assert_equal(0, clib_refs_is_commit(NULL));
+    }
+  }
+
+  describe("clib_refs_find") {
+    it("should resolve a branch") {
+      assert_equal(CLIB_REFS_BRANCH,
+                   clib_refs_find(refs, size, "master", commit));
+      assert_str_equal(MAIN, commit);
+    }
+
+    it("should resolve an annotated tag to its commit") {
+      assert_equal(CLIB_REFS_TAG, clib_refs_find(refs, size, "1.0.0", commit));
+      assert_str_equal(PEELED, commit);
+    }
+
+    it("should resolve a lightweight tag") {
+      assert_equal(CLIB_REFS_TAG, clib_refs_find(refs, size, "1.0", commit));
+      assert_str_equal(LIGHT, commit);
+    }
+
+    it("should not resolve unknown versions") {
+      assert_equal(0, clib_refs_find(refs, size, "2.0.0", commit));
+      assert_equal(0, clib_refs_find(refs, size, "1", commit));
+      assert_equal(0, clib_refs_find("not found", 9, "master", commit));
+    }
+  }
+
+  return assert_failures();
+}